@@ -0,0 +1,779 @@
+/* Whole-pipeline throughput and size regression check.
+ *
+ * usage: bench_pipeline [--out dir] [--baseline file] [--max-ratio r] [--iterations n]
+ *
+ * Every corpus is encoded through apng_init / apng_append_frame /
+ * apng_write_end in every mode of the table below. One JSON object per line is
+ * printed to stdout; feed a previous run back with --baseline to get the
+ * size ratio against it. The written files are validated with libpng and
+ * the process exits non-zero if any output is invalid or grew by more than
+ * --max-ratio. Every file is also read back with apng_decode_* and the
+ * decode rate is reported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <png.h>
+#include <zlib.h>
+#include "libapng.h"
+#include "corpus.h"
+
+//chunk-level edits of the output of an earlier mode
+enum EditOp {
+	NoEdit,
+	EditTrim,	//apng_trim, the middle half
+	EditDrop,	//apng_drop_frames, the middle half
+	EditConcat,	//apng_concat, the file twice
+	EditAppend,	//apng_open_append on a copy, every frame again
+};
+
+struct Mode {
+	const char *Name;
+	bool Optimize;
+	bool Palette;	//declare every frame with apng_add_palette_frame first
+	bool Lossless;
+	int ReuseMeanError;	//apng_set_palette_reuse, 0 = off
+	int Deferred;	//apng_set_deferred mode
+	const char *Source;	//apng_recompress, or Edit, the output of an earlier mode
+	int FrameBudgetMs;	//apng_set_time_budget per frame, 0 = off
+	double AutoPsnr;	//apng_set_auto_optimize, 0 = off
+	int ParallelTrials;	//apng_set_parallel_trials mode
+	int FilterStrategy;	//apng_set_filter_strategy
+	int FixedFilter;
+	int NearLossless;	//apng_set_near_lossless max error, 0 = off
+	int Dither;
+	int SubFrames;	//apng_set_sub_frames max regions, 0 = off
+	EditOp Edit;
+	int RingSlots;	//apng_ring_init slots, 0 = off; frames pushed back to back
+	int RingPolicy;
+	bool Pooled;	//apng_acquire after the pool held an optimize encode of the same corpus, must match lossless
+};
+
+static const Mode modes[] = {
+	{ "lossless", false, false, true, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "optimize", true, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "palette", false, true, false, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "reuse", true, false, false, 8, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "deferred", false, false, true, 0, 1, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "deferred-spill", true, false, false, 0, 2, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "recompress", false, false, true, 0, 0, "lossless", 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "budget", true, false, false, 0, 0, NULL, 20, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "auto", true, false, false, 0, 0, NULL, 0, 35, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "trials", false, false, true, 0, 0, NULL, 0, 0, 2, 0, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "filter-up", false, false, true, 0, 0, NULL, 0, 0, 0, 1, 2, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "filter-entropy", false, false, true, 0, 0, NULL, 0, 0, 0, 2, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "filter-deflate", false, false, true, 0, 0, NULL, 0, 0, 0, 3, 0, 0, 0, 0, NoEdit, 0, 0, false },
+	{ "near-lossless", false, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 3, 0, 0, NoEdit, 0, 0, false },
+	{ "near-lossless-ordered", false, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 3, 1, 0, NoEdit, 0, 0, false },
+	{ "near-lossless-diffuse", false, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 3, 2, 0, NoEdit, 0, 0, false },
+	{ "sub-frames", false, false, true, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 4, NoEdit, 0, 0, false },
+	{ "trim", false, false, true, 0, 0, "lossless", 0, 0, 0, 0, 0, 0, 0, 0, EditTrim, 0, 0, false },
+	{ "drop", false, false, true, 0, 0, "lossless", 0, 0, 0, 0, 0, 0, 0, 0, EditDrop, 0, 0, false },
+	{ "concat", false, false, true, 0, 0, "lossless", 0, 0, 0, 0, 0, 0, 0, 0, EditConcat, 0, 0, false },
+	{ "append", false, false, true, 0, 0, "lossless", 0, 0, 0, 0, 0, 0, 0, 0, EditAppend, 0, 0, false },
+	{ "pool", false, false, true, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 0, 0, true },
+	{ "ring", false, false, true, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 4, 0, false },
+	{ "ring-drop", false, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 2, 1, false },
+	{ "ring-merge", false, false, false, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, NoEdit, 2, 2, false },
+};
+
+struct BaselineEntry {
+	string Corpus;
+	string Mode;
+	long long Bytes;
+};
+
+static double now()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool json_string(const char *line, const char *key, string *value)
+{
+	string pattern = string("\"") + key + "\":\"";
+	const char *p = strstr(line, pattern.c_str());
+	if (!p) return false;
+	p += pattern.size();
+	const char *end = strchr(p, '"');
+	if (!end) return false;
+	value->assign(p, end);
+	return true;
+}
+
+static bool json_number(const char *line, const char *key, long long *value)
+{
+	string pattern = string("\"") + key + "\":";
+	const char *p = strstr(line, pattern.c_str());
+	if (!p) return false;
+	*value = atoll(p + pattern.size());
+	return true;
+}
+
+static vector<BaselineEntry> load_baseline(const char *fileName)
+{
+	vector<BaselineEntry> entries;
+	FILE *f = fopen(fileName, "r");
+	if (!f) {
+		fprintf(stderr, "cannot open baseline %s\n", fileName);
+		return entries;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		BaselineEntry e;
+		if (json_string(line, "corpus", &e.Corpus)
+			&& json_string(line, "mode", &e.Mode)
+			&& json_number(line, "bytes", &e.Bytes)) {
+			entries.push_back(e);
+		}
+	}
+	fclose(f);
+	return entries;
+}
+
+static unsigned int load_uint32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+/* Walks the chunk stream: signature, CRCs, acTL/fcTL counts, sequence
+ * numbers, and inflates every frame to check its size and filter bytes. */
+static bool validate_chunks(const vector<unsigned char> &file, const Corpus &corpus, unsigned int frames, string *error)
+{
+	static const unsigned char png_sign[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if (file.size() < 8 || memcmp(&file[0], png_sign, 8) != 0) {
+		*error = "bad signature";
+		return false;
+	}
+
+	size_t pos = 8;
+	unsigned int numFrames = 0, fcTLCount = 0, nextSeq = 0;
+	unsigned int frameWidth = 0, frameHeight = 0, channels = 4, depth = 8;
+	unsigned int paletteSize = 0;
+	bool indexed = false, seenIEND = false, inFrame = false;
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	vector<unsigned char> raw;
+	auto frame_rowbytes = [&]() -> size_t {
+		return ((size_t)frameWidth * channels * depth + 7) / 8;
+	};
+
+	auto finish_frame = [&]() -> bool {
+		if (!inFrame) return true;
+		inFrame = false;
+		size_t expected = (size_t)frameHeight * (frame_rowbytes() + 1);
+		int r = inflate(&zs, Z_FINISH);
+		size_t got = raw.size() - zs.avail_out;
+		inflateEnd(&zs);
+		if (r != Z_STREAM_END || got != expected) {
+			*error = "frame " + to_string(fcTLCount - 1) + " inflates to " + to_string(got) + " bytes, expected " + to_string(expected);
+			return false;
+		}
+		for (unsigned int y = 0; y < frameHeight; y++) {
+			if (raw[y * (frame_rowbytes() + 1)] > 4) {
+				*error = "bad filter type in frame " + to_string(fcTLCount - 1);
+				return false;
+			}
+		}
+		return true;
+	};
+
+	while (pos + 12 <= file.size()) {
+		unsigned int length = load_uint32(&file[pos]);
+		const unsigned char *type = &file[pos + 4];
+		const unsigned char *data = &file[pos + 8];
+		if (pos + 12 + length > file.size()) {
+			*error = "truncated chunk";
+			return false;
+		}
+		unsigned int crc = (unsigned int)crc32(0, type, length + 4);
+		if (crc != load_uint32(data + length)) {
+			*error = string("crc mismatch in ") + string((const char *)type, 4);
+			return false;
+		}
+
+		if (!memcmp(type, "IHDR", 4)) {
+			if ((int)load_uint32(data) != corpus.Width || (int)load_uint32(data + 4) != corpus.Height) {
+				*error = "IHDR size mismatch";
+				return false;
+			}
+			//the default image, until an fcTL comes first
+			frameWidth = corpus.Width;
+			frameHeight = corpus.Height;
+			depth = data[8];
+			channels = data[9] == 6 ? 4 : data[9] == 2 ? 3 : 1;
+			indexed = data[9] == 3;
+		}
+		else if (!memcmp(type, "PLTE", 4)) {
+			if (length == 0 || length % 3 != 0 || length > 3 * 256) {
+				*error = "bad PLTE length";
+				return false;
+			}
+			paletteSize = length / 3;
+		}
+		else if (!memcmp(type, "tRNS", 4) && indexed && length > paletteSize) {
+			*error = "tRNS longer than PLTE";
+			return false;
+		}
+		else if (!memcmp(type, "acTL", 4)) {
+			numFrames = load_uint32(data);
+		}
+		else if (!memcmp(type, "fcTL", 4) || !memcmp(type, "fdAT", 4)) {
+			if (load_uint32(data) != nextSeq++) {
+				*error = "sequence number out of order";
+				return false;
+			}
+			if (!memcmp(type, "fcTL", 4)) {
+				if (!finish_frame()) return false;
+				fcTLCount++;
+				frameWidth = load_uint32(data + 4);
+				frameHeight = load_uint32(data + 8);
+			}
+		}
+
+		if (!memcmp(type, "IDAT", 4) || !memcmp(type, "fdAT", 4)) {
+			if (indexed && paletteSize == 0) {
+				*error = "indexed image without PLTE";
+				return false;
+			}
+			if (!inFrame) {
+				inFrame = true;
+				inflateInit(&zs);
+				raw.assign((size_t)frameHeight * (frame_rowbytes() + 1) + 1, 0);
+				zs.next_out = &raw[0];
+				zs.avail_out = (uInt)raw.size();
+			}
+			unsigned int skip = memcmp(type, "fdAT", 4) ? 0 : 4;
+			zs.next_in = (Bytef *)data + skip;
+			zs.avail_in = length - skip;
+			int r = inflate(&zs, Z_NO_FLUSH);
+			if (r != Z_OK && r != Z_STREAM_END) {
+				*error = "inflate failed";
+				return false;
+			}
+		}
+		else if (!memcmp(type, "IEND", 4)) {
+			if (!finish_frame()) return false;
+			seenIEND = true;
+		}
+		pos += 12 + length;
+	}
+
+	if (!seenIEND) {
+		*error = "missing IEND";
+		return false;
+	}
+	if (numFrames != frames || fcTLCount != frames) {
+		*error = "frame count mismatch";
+		return false;
+	}
+	return true;
+}
+
+#ifdef PNG_APNG_SUPPORTED
+/* Full decode of every frame through libpng-apng. */
+static bool validate_libpng(const char *path, const Corpus &corpus, unsigned int frames, bool lossless, string *error)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		*error = "cannot reopen output";
+		return false;
+	}
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png_create_info_struct(png);
+	vector<png_bytep> rows;
+	vector<unsigned char> pixels;
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		*error = "libpng-apng failed to decode";
+		return false;
+	}
+	png_init_io(png, f);
+	png_read_info(png, info);
+	png_set_expand(png);
+	png_read_update_info(png, info);
+	if (!png_get_valid(png, info, PNG_INFO_acTL) || png_get_num_frames(png, info) != frames) {
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		*error = "libpng-apng frame count mismatch";
+		return false;
+	}
+
+	size_t rowbytes = png_get_rowbytes(png, info);
+	pixels.resize(rowbytes * corpus.Height);
+	rows.resize(corpus.Height);
+	for (int y = 0; y < corpus.Height; y++) {
+		rows[y] = &pixels[y * rowbytes];
+	}
+	for (unsigned int i = 0; i < frames; i++) {
+		png_read_frame_head(png, info);
+		png_read_image(png, &rows[0]);
+		if (i == 0 && lossless) {
+			const vector<uint8_t> &src = corpus.Frames[0];
+			for (int p = 0, p1 = corpus.Width * corpus.Height; p < p1; p++) {
+				const unsigned char *d = &pixels[p * 4];
+				const uint8_t *s = &src[p * 4];
+				if (d[0] != s[2] || d[1] != s[1] || d[2] != s[0] || d[3] != s[3]) {
+					png_destroy_read_struct(&png, &info, NULL);
+					fclose(f);
+					*error = "first frame pixels differ";
+					return false;
+				}
+			}
+		}
+	}
+	png_read_end(png, info);
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(f);
+	return true;
+}
+#else
+/* Without the apng patch libpng only sees the default image; decode it and,
+ * in lossless mode, compare it with the first source frame. The frame count
+ * is left to validate_chunks. */
+static bool validate_libpng(const char *path, const Corpus &corpus, unsigned int, bool lossless, string *error)
+{
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&image, path)) {
+		*error = string("libpng: ") + image.message;
+		return false;
+	}
+	image.format = PNG_FORMAT_BGRA;
+	vector<unsigned char> pixels(PNG_IMAGE_SIZE(image));
+	if (!png_image_finish_read(&image, NULL, &pixels[0], 0, NULL)) {
+		*error = string("libpng: ") + image.message;
+		return false;
+	}
+	if ((int)image.width != corpus.Width || (int)image.height != corpus.Height) {
+		*error = "default image size mismatch";
+		return false;
+	}
+	if (lossless) {
+		const vector<uint8_t> &src = corpus.Frames[0];
+		for (size_t p = 0; p < pixels.size(); p += 4) {
+			if (memcmp(&pixels[p], &src[p], 4) != 0) {
+				*error = "default image pixels differ";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+#endif
+
+/* Decodes every frame with the apng_decode_* api, timing the sequential
+ * pass, then seeks to the last and a middle frame on a fresh decoder and
+ * checks both against it. With maxError >= 0 the shown frames must match
+ * the source within maxError per color channel and exactly in alpha,
+ * fully transparent pixels in any color; lossless output passes 0. */
+static bool validate_decoder(const char *path, const Corpus &corpus, int count, int maxError, double *fps, string *error)
+{
+	wstring wpath(path, path + strlen(path));
+	size_t frameSize = (size_t)corpus.Width * corpus.Height * 4;
+	vector<unsigned char> frames(frameSize * count), seek(frameSize);
+	vector<int> delays(count);
+	ApngDecoder *pDec = NULL;
+
+	double t0 = now();
+	bool decoded = apng_decode_init(&wpath[0], 0, &pDec) == ApngError::Success;
+	if (decoded && (pDec->width != corpus.Width || pDec->height != corpus.Height || pDec->frameCount != count)) {
+		apng_decode_destroy(&pDec);
+		*error = "decoder size or frame count mismatch";
+		return false;
+	}
+	for (int i = 0; decoded && i < count; i++) {
+		ApngFrameInfo info;
+		decoded = apng_decode_frame(pDec, i, &frames[frameSize * i], corpus.Width * 4) == ApngError::Success
+			&& apng_decode_frame_info(pDec, i, &info) == ApngError::Success;
+		delays[i] = decoded ? info.delay_ms : 0;
+	}
+	apng_decode_destroy(&pDec);
+	double seconds = now() - t0;
+	*fps = seconds > 0 ? count / seconds : 0.0;
+	if (!decoded) {
+		*error = "decoder returned an error";
+		return false;
+	}
+	//frames merged, split or dropped keep the total
+	long long totalDelay = 0;
+	for (int i = 0; i < count; i++) {
+		totalDelay += delays[i];
+	}
+	if (totalDelay != (long long)corpus.Delay * (long long)corpus.Frames.size()) {
+		*error = "total delay mismatch";
+		return false;
+	}
+
+	if (maxError >= 0) {
+		//sub-frames of delay 0 are never shown, the frame after them is
+		size_t shown = 0;
+		for (int i = 0; i < count; i++) {
+			if (delays[i] == 0 && i + 1 < count) {
+				continue;
+			}
+			if (shown == corpus.Frames.size()) {
+				break;
+			}
+			const unsigned char *d = &frames[frameSize * i];
+			const uint8_t *src = &corpus.Frames[shown++][0];
+			for (size_t p = 0; p < frameSize; p += 4) {
+				if ((d[p + 3] | src[p + 3]) == 0) {
+					continue;
+				}
+				bool within = d[p + 3] == src[p + 3];
+				for (int c = 0; within && c < 3; c++) {
+					within = abs(d[p + c] - src[p + c]) <= maxError;
+				}
+				if (!within) {
+					*error = maxError > 0 ? "decoded frame pixels exceed the error limit" : "decoded frame pixels differ";
+					return false;
+				}
+			}
+		}
+		if (shown != corpus.Frames.size()) {
+			*error = "shown frame count mismatch";
+			return false;
+		}
+	}
+
+	int targets[2] = { count - 1, count / 2 };
+	decoded = apng_decode_init(&wpath[0], 4, &pDec) == ApngError::Success;
+	for (int t = 0; decoded && t < 2; t++) {
+		decoded = apng_decode_frame(pDec, targets[t], &seek[0], corpus.Width * 4) == ApngError::Success
+			&& memcmp(&seek[0], &frames[frameSize * targets[t]], frameSize) == 0;
+	}
+	apng_decode_destroy(&pDec);
+	if (!decoded) {
+		*error = "seeked frame differs from the sequential decode";
+		return false;
+	}
+	return true;
+}
+
+/* The middle half trim keeps and drop removes, at least one frame on
+ * each side. */
+static void edit_range(int frames, int *first, int *count)
+{
+	*first = frames / 4 > 1 ? frames / 4 : 1;
+	*count = frames - 2 * *first;
+}
+
+//the frames an edit of a lossless encode of corpus shows, in order
+static Corpus edited_corpus(const Corpus &corpus, EditOp op)
+{
+	Corpus edited;
+	edited.Name = corpus.Name;
+	edited.Width = corpus.Width;
+	edited.Height = corpus.Height;
+	edited.Delay = corpus.Delay;
+	int frames = (int)corpus.Frames.size(), first, count;
+	edit_range(frames, &first, &count);
+	for (int i = 0; i < frames; i++) {
+		bool middle = i >= first && i < first + count;
+		if (op == EditTrim ? middle : op == EditDrop ? !middle : true) {
+			edited.Frames.push_back(corpus.Frames[i]);
+		}
+	}
+	if (op == EditConcat || op == EditAppend) {
+		edited.Frames.insert(edited.Frames.end(), corpus.Frames.begin(), corpus.Frames.end());
+	}
+	return edited;
+}
+
+static bool copy_file(const string &from, const string &to)
+{
+	FILE *in = fopen(from.c_str(), "rb");
+	FILE *out = in ? fopen(to.c_str(), "wb") : NULL;
+	bool copied = in && out;
+	char buf[65536];
+	size_t n;
+	while (copied && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		copied = fwrite(buf, 1, n, out) == n;
+	}
+	if (in) fclose(in);
+	if (out) fclose(out);
+	return copied;
+}
+
+static vector<unsigned char> read_file(const string &path)
+{
+	vector<unsigned char> file;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		file.resize(ftell(f));
+		fseek(f, 0, SEEK_SET);
+		if (!file.empty() && fread(&file[0], 1, file.size(), f) != file.size()) file.clear();
+		fclose(f);
+	}
+	return file;
+}
+
+/* Leaves an encoder in the pool that has written an optimized encode of
+ * corpus, so the pool mode's apng_acquire gets one with state to reset. */
+static bool prime_pool(const Corpus &corpus, const string &scratch)
+{
+	wstring wscratch(scratch.begin(), scratch.end());
+	ApngEncoder *pEnc = NULL;
+	bool encoded = apng_acquire(&wscratch[0], corpus.Width, corpus.Height, &pEnc) == ApngError::Success;
+	for (size_t f = 0; encoded && f < corpus.Frames.size(); f++) {
+		encoded = apng_append_frame(pEnc, (void *)&corpus.Frames[f][0], 0, 0, corpus.Width, corpus.Height,
+			corpus.Width * 4, corpus.Delay, true) == ApngError::Success;
+	}
+	if (pEnc) {
+		apng_write_end(pEnc);
+		apng_release(&pEnc);
+	}
+	remove(scratch.c_str());
+	return encoded;
+}
+
+//an append with one frame written, to give up on
+static ApngEncoder *open_abandoned(const Corpus &corpus, wstring &wpath)
+{
+	ApngEncoder *pEnc = NULL;
+	if (apng_open_append(&wpath[0], &pEnc) == ApngError::Success
+		&& apng_append_frame(pEnc, (void *)&corpus.Frames[0][0], 0, 0, corpus.Width, corpus.Height,
+			corpus.Width * 4, corpus.Delay, false) == ApngError::Success) {
+		return pEnc;
+	}
+	apng_destroy(&pEnc);
+	return NULL;
+}
+
+/* Times one edit of source into path; for append the copy it starts from
+ * is not timed. Around the timed append two appends are given up with
+ * apng_destroy, one alone and one open while it runs, and neither may
+ * change the file. */
+static bool run_edit(const Mode &m, const Corpus &corpus, const string &source, const string &path, double *seconds, ApngStats *stats)
+{
+	wstring wsource(source.begin(), source.end());
+	wstring wpath(path.begin(), path.end());
+	int first, count;
+	edit_range((int)corpus.Frames.size(), &first, &count);
+	if (m.Edit == EditAppend && !copy_file(source, path)) {
+		return false;
+	}
+	ApngEncoder *abandoned = NULL;
+	if (m.Edit == EditAppend) {
+		vector<unsigned char> original = read_file(path);
+		abandoned = open_abandoned(corpus, wpath);
+		apng_destroy(&abandoned);
+		abandoned = open_abandoned(corpus, wpath);
+		if (!abandoned || read_file(path) != original) {
+			apng_destroy(&abandoned);
+			return false;
+		}
+	}
+
+	double t0 = now();
+	bool edited = false;
+	if (m.Edit == EditTrim) {
+		edited = apng_trim(&wsource[0], &wpath[0], first, count) == ApngError::Success;
+	}
+	else if (m.Edit == EditDrop) {
+		edited = apng_drop_frames(&wsource[0], &wpath[0], first, count) == ApngError::Success;
+	}
+	else if (m.Edit == EditConcat) {
+		wchar_t *files[2] = { &wsource[0], &wsource[0] };
+		edited = apng_concat(files, 2, &wpath[0]) == ApngError::Success;
+	}
+	else {
+		ApngEncoder *pEnc = NULL;
+		edited = apng_open_append(&wpath[0], &pEnc) == ApngError::Success;
+		for (size_t f = 0; edited && f < corpus.Frames.size(); f++) {
+			edited = apng_append_frame(pEnc, (void *)&corpus.Frames[f][0], 0, 0, corpus.Width, corpus.Height,
+				corpus.Width * 4, corpus.Delay, false) == ApngError::Success;
+		}
+		if (pEnc) {
+			if (edited) {
+				apng_write_end(pEnc);
+				edited = apng_get_stats(pEnc, stats) == ApngError::Success && pEnc->deferredError == ApngError::Success;
+			}
+			apng_destroy(&pEnc);
+		}
+	}
+	*seconds += now() - t0;
+	if (abandoned) {
+		vector<unsigned char> appended = read_file(path);
+		apng_destroy(&abandoned);
+		edited = edited && read_file(path) == appended;
+	}
+	return edited;
+}
+
+int main(int argc, char **argv)
+{
+	string outDir = ".";
+	const char *baselineFile = NULL;
+	double maxRatio = 0;
+	int iterations = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--out") && i + 1 < argc) outDir = argv[++i];
+		else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) baselineFile = argv[++i];
+		else if (!strcmp(argv[i], "--max-ratio") && i + 1 < argc) maxRatio = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) iterations = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "usage: %s [--out dir] [--baseline file] [--max-ratio r] [--iterations n]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (iterations <= 0) iterations = 1;
+
+	vector<BaselineEntry> baseline;
+	if (baselineFile) {
+		baseline = load_baseline(baselineFile);
+	}
+
+	Corpus corpora[] = {
+		MakeSpriteCorpus(24),
+		MakeUiCorpus(12),
+		MakeGradientCorpus(12),
+		MakeNoiseCorpus(3),
+		MakeIconCorpus(16),
+	};
+
+	bool failed = false;
+	for (auto &corpus : corpora) {
+		for (auto &m : modes) {
+			const char *mode = m.Name;
+			string path = outDir + "/" + corpus.Name + "-" + mode + ".png";
+			wstring wpath(path.begin(), path.end());
+
+			double seconds = 0, pushSeconds = 0, pushMax = 0;
+			bool encoded = true;
+			ApngStats stats;
+			memset(&stats, 0, sizeof(stats));
+			string source = m.Source ? outDir + "/" + corpus.Name + "-" + m.Source + ".png" : string();
+			for (int it = 0; it < iterations && encoded && m.Source && m.Edit != NoEdit; it++) {
+				encoded = run_edit(m, corpus, source, path, &seconds, &stats);
+			}
+			for (int it = 0; it < iterations && encoded && m.Source && m.Edit == NoEdit; it++) {
+				wstring wsource(source.begin(), source.end());
+				double t0 = now();
+				encoded = apng_recompress(&wsource[0], &wpath[0], &stats) == ApngError::Success;
+				seconds += now() - t0;
+			}
+			for (int it = 0; it < iterations && encoded && !m.Source; it++) {
+				if (m.Pooled) {
+					encoded = prime_pool(corpus, path + ".prime");
+				}
+				double t0 = now();
+				ApngEncoder *pEnc = NULL;
+				if (encoded) {
+					encoded = (m.Pooled ? apng_acquire(&wpath[0], corpus.Width, corpus.Height, &pEnc)
+						: apng_init(&wpath[0], corpus.Width, corpus.Height, &pEnc)) == ApngError::Success;
+				}
+				if (encoded && m.Deferred > 0) {
+					encoded = apng_set_deferred(pEnc, m.Deferred, false) == ApngError::Success;
+				}
+				if (encoded && m.FrameBudgetMs > 0) {
+					encoded = apng_set_time_budget(pEnc, m.FrameBudgetMs, 0) == ApngError::Success;
+				}
+				if (encoded && m.AutoPsnr > 0) {
+					encoded = apng_set_auto_optimize(pEnc, m.AutoPsnr) == ApngError::Success;
+				}
+				if (encoded && m.ParallelTrials > 0) {
+					encoded = apng_set_parallel_trials(pEnc, m.ParallelTrials) == ApngError::Success;
+				}
+				if (encoded && m.FilterStrategy > 0) {
+					encoded = apng_set_filter_strategy(pEnc, m.FilterStrategy, m.FixedFilter) == ApngError::Success;
+				}
+				if (encoded && m.SubFrames > 0) {
+					encoded = apng_set_sub_frames(pEnc, m.SubFrames) == ApngError::Success;
+				}
+				if (encoded && m.NearLossless > 0) {
+					encoded = apng_set_near_lossless(pEnc, m.NearLossless, m.Dither) == ApngError::Success;
+				}
+				if (encoded && m.ReuseMeanError > 0) {
+					encoded = apng_set_palette_reuse(pEnc, m.ReuseMeanError, 0) == ApngError::Success;
+				}
+				if (encoded && m.RingSlots > 0) {
+					encoded = apng_ring_init(pEnc, m.RingSlots, m.RingPolicy) == ApngError::Success;
+				}
+				for (size_t f = 0; encoded && m.Palette && f < corpus.Frames.size(); f++) {
+					encoded = apng_add_palette_frame(pEnc, (void *)&corpus.Frames[f][0], corpus.Width, corpus.Height,
+						corpus.Width * 4) == ApngError::Success;
+				}
+				for (size_t f = 0; encoded && !m.RingSlots && f < corpus.Frames.size(); f++) {
+					encoded = apng_append_frame(pEnc, (void *)&corpus.Frames[f][0], 0, 0, corpus.Width, corpus.Height,
+						corpus.Width * 4, corpus.Delay, m.Optimize) == ApngError::Success;
+				}
+				//the capture side's latency, the encoding happens on the ring's thread
+				for (size_t f = 0; encoded && m.RingSlots && f < corpus.Frames.size(); f++) {
+					double t1 = now();
+					encoded = apng_ring_push(pEnc, (void *)&corpus.Frames[f][0], corpus.Width * 4, corpus.Delay, m.Optimize) == ApngError::Success;
+					double push = now() - t1;
+					pushSeconds += push;
+					pushMax = push > pushMax ? push : pushMax;
+				}
+				if (pEnc) {
+					if (encoded) {
+						apng_write_end(pEnc);
+						encoded = apng_get_stats(pEnc, &stats) == ApngError::Success;
+					}
+					if (m.Pooled && encoded) {
+						apng_release(&pEnc);
+					}
+					else {
+						apng_destroy(&pEnc);
+					}
+				}
+				seconds += now() - t0;
+			}
+			seconds /= iterations;
+
+			vector<unsigned char> file = read_file(path);
+
+			//an edited file is checked against the frames the edit kept
+			Corpus edited;
+			if (m.Edit != NoEdit) {
+				edited = edited_corpus(corpus, m.Edit);
+			}
+			const Corpus &expected = m.Edit != NoEdit ? edited : corpus;
+
+			string error;
+			double decodeFps = 0;
+			unsigned int fileFrames = (unsigned int)expected.Frames.size() + stats.subFrames - stats.droppedFrames;
+			//a trimmed file keeps the first frame of its source as a hidden default image
+			bool valid = encoded
+				&& validate_chunks(file, expected, fileFrames, &error)
+				&& validate_libpng(path.c_str(), expected, fileFrames, m.Lossless && m.Edit != EditTrim, &error)
+				&& validate_decoder(path.c_str(), expected, fileFrames, m.Lossless ? 0 : m.NearLossless > 0 ? m.NearLossless : -1, &decodeFps, &error);
+			//a reused encoder writes what a new one does
+			if (valid && m.Pooled && file != read_file(outDir + "/" + corpus.Name + "-lossless.png")) {
+				valid = false;
+				error = "pooled encoder output differs from a new encoder's";
+			}
+			if (!encoded) error = "encoder returned an error";
+
+			long long baselineBytes = 0;
+			for (auto &e : baseline) {
+				if (e.Corpus == corpus.Name && e.Mode == mode) baselineBytes = e.Bytes;
+			}
+			double ratio = baselineBytes > 0 ? (double)file.size() / baselineBytes : 0.0;
+
+			printf("{\"corpus\":\"%s\",\"mode\":\"%s\",\"width\":%d,\"height\":%d,\"frames\":%d,"
+				"\"seconds\":%.6f,\"fps\":%.3f,\"decode_fps\":%.3f,\"bytes\":%lld,\"baseline_bytes\":%lld,\"ratio\":%.6f,"
+				"\"pixels\":%lld,\"streaming_pixels\":%lld,\"remapped\":%d,\"degraded\":%d,\"lossless_frames\":%d,\"reused_rows\":%lld,\"psnr\":%.3f,\"arena_reused\":%lld,\"arena_allocated\":%lld,\"sub_frames\":%d,\"dropped\":%d,\"push_us\":%.1f,\"push_max_us\":%.1f,\"valid\":%s,\"error\":\"%s\"}\n",
+				corpus.Name, mode, corpus.Width, corpus.Height, (int)expected.Frames.size(),
+				seconds, seconds > 0 ? expected.Frames.size() / seconds : 0.0, decodeFps,
+				(long long)file.size(), baselineBytes, ratio,
+				stats.encodedPixels, stats.streamingPixels, stats.remappedFrames, stats.degradedFrames, stats.losslessFrames, stats.reusedRows, stats.psnr,
+				stats.arenaReused, stats.arenaAllocated, stats.subFrames, stats.droppedFrames,
+				pushSeconds * 1e6 / ((double)iterations * corpus.Frames.size()), pushMax * 1e6,
+				valid ? "true" : "false", error.c_str());
+			fflush(stdout);
+
+			if (!valid || (maxRatio > 0 && ratio > maxRatio)) {
+				failed = true;
+			}
+		}
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/* Times the encoder hot paths one stage at a time on the synthetic corpora.
+ *
+ * usage: bench_stages [iterations] [corpus]
+ *
+ * Each stage is run `iterations` times on every frame of the corpus; setup
+ * work a stage depends on (e.g. the histogram for CalculateMoments) is done
+ * outside the timed region. Throughput is reported against the 32-bit input
+ * frame so all stages are comparable. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include "libapngInternal.h"
+#include "corpus.h"
+
+struct StageResult {
+	double seconds;
+	long long pixels;
+};
+
+static double now()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const Corpus &corpus, const char *stage, const StageResult &r)
+{
+	double mb = r.pixels * 4.0 / (1024.0 * 1024.0);
+	printf("%-8s %-26s %10.3f ms %10.2f MB/s %10.2f ns/px\n",
+		corpus.Name, stage,
+		r.seconds * 1000.0,
+		r.seconds > 0 ? mb / r.seconds : 0.0,
+		r.pixels > 0 ? r.seconds * 1e9 / r.pixels : 0.0);
+}
+
+static StageResult run_stage(const Corpus &corpus, int iterations,
+	const function<void(BitmapData *)> &setup, const function<void(BitmapData *)> &body)
+{
+	StageResult r = { 0, 0 };
+	vector<uint8_t> work;
+	for (int it = 0; it < iterations; it++) {
+		for (size_t f = 0; f < corpus.Frames.size(); f++) {
+			work = corpus.Frames[f];
+			BitmapData bmp;
+			bmp.Width = corpus.Width;
+			bmp.Height = corpus.Height;
+			bmp.Stride = corpus.Width * 4;
+			bmp.bpp = 4;
+			bmp.Scan0 = &work[0];
+			if (setup) setup(&bmp);
+
+			double t0 = now();
+			body(&bmp);
+			r.seconds += now() - t0;
+			r.pixels += (long long)corpus.Width * corpus.Height;
+		}
+	}
+	return r;
+}
+
+/* the quantizer stages for one histogram layout, tagged with
+ * <side>x<accumulator bits> */
+template<class TColorData>
+static void bench_quantizer(const Corpus &corpus, int iterations, const char *layout)
+{
+	char stage[64];
+
+	snprintf(stage, sizeof(stage), "BuildHistogram/%s", layout);
+	report(corpus, stage, run_stage(corpus, iterations, NULL, [](BitmapData *bmp) {
+		auto data = BuildHistogram<TColorData>(bmp);
+	}));
+
+	{
+		unique_ptr<TColorData> data;
+		snprintf(stage, sizeof(stage), "CalculateMoments/%s", layout);
+		report(corpus, stage, run_stage(corpus, iterations, [&](BitmapData *bmp) {
+			data.reset(new TColorData(BuildHistogram<TColorData>(bmp)));
+		}, [&](BitmapData *) {
+			CalculateMoments(data.get());
+		}));
+	}
+
+	{
+		unique_ptr<TColorData> data;
+		snprintf(stage, sizeof(stage), "SplitData/%s", layout);
+		report(corpus, stage, run_stage(corpus, iterations, [&](BitmapData *bmp) {
+			data.reset(new TColorData(BuildHistogram<TColorData>(bmp)));
+			CalculateMoments(data.get());
+		}, [&](BitmapData *) {
+			int colorCount = MaxColor;
+			auto cubes = SplitData(colorCount, data.get());
+		}));
+	}
+
+	{
+		unique_ptr<TColorData> data;
+		vector<Box> cubes;
+		int colorCount;
+		vector<uint8_t> indices((size_t)corpus.Width * corpus.Height);
+		IndexedBitmapData dest;
+		dest.Data.Width = corpus.Width;
+		dest.Data.Height = corpus.Height;
+		dest.Data.Stride = corpus.Width;
+		dest.Data.bpp = 1;
+		dest.Data.Scan0 = &indices[0];
+		snprintf(stage, sizeof(stage), "GetQuantizedPalette/%s", layout);
+		report(corpus, stage, run_stage(corpus, iterations, [&](BitmapData *bmp) {
+			data.reset(new TColorData(BuildHistogram<TColorData>(bmp)));
+			CalculateMoments(data.get());
+			colorCount = MaxColor;
+			cubes = SplitData(colorCount, data.get());
+		}, [&](BitmapData *bmp) {
+			auto palette = GetQuantizedPalette(colorCount, data.get(), cubes, bmp, &dest);
+		}));
+	}
+}
+
+/* one-frame thumbnail files cut from the corner of each frame, from a new
+ * encoder each and from the pool */
+static void bench_thumbnails(const Corpus &corpus, int iterations, bool pooled)
+{
+	const int side = 64;
+	const int files = 32;
+	wchar_t tmpName[] = L"bench_stages.tmp";
+	StageResult r = { 0, 0 };
+	for (int it = 0; it < iterations; it++) {
+		for (size_t f = 0; f < corpus.Frames.size(); f++) {
+			const uint8_t *pixels = &corpus.Frames[f][0];
+			double t0 = now();
+			for (int i = 0; i < files; i++) {
+				ApngEncoder *pEnc = NULL;
+				ApngError err = pooled ? apng_acquire(tmpName, side, side, &pEnc) : apng_init(tmpName, side, side, &pEnc);
+				if (err != ApngError::Success) {
+					fprintf(stderr, "failed to create encoder\n");
+					exit(1);
+				}
+				apng_append_frame(pEnc, (void *)pixels, 0, 0, side, side, corpus.Width * 4, 100, false);
+				apng_write_end(pEnc);
+				if (pooled) apng_release(&pEnc);
+				else apng_destroy(&pEnc);
+			}
+			r.seconds += now() - t0;
+			r.pixels += (long long)files * side * side;
+		}
+	}
+	report(corpus, pooled ? "thumbnail/apng_acquire" : "thumbnail/apng_init", r);
+	remove("bench_stages.tmp");
+}
+
+static void bench_corpus(const Corpus &corpus, int iterations)
+{
+	ApngEncoder *pEnc = NULL;
+	wchar_t tmpName[] = L"bench_stages.tmp";
+	if (apng_init(tmpName, corpus.Width, corpus.Height, &pEnc) != ApngError::Success
+		|| alloc_buffers(pEnc) != ApngError::Success) {
+		fprintf(stderr, "failed to create encoder\n");
+		exit(1);
+	}
+
+	report(corpus, "get_rect", run_stage(corpus, iterations, NULL, [](BitmapData *bmp) {
+		RECT rect;
+		get_rect(bmp, &rect);
+	}));
+
+	bench_quantizer<_ColorData>(corpus, iterations, "33x64");
+	bench_quantizer<_ColorData32>(corpus, iterations, "33x32");
+	bench_quantizer<_CoarseColorData32>(corpus, iterations, "17x32");
+
+	//filter search per strategy, without the rows memoized by the last run
+	static const struct { const char *Stage; FilterStrategy Strategy; int Filter; } strategies[] = {
+		{ "process_rect/min-sad", FilterStrategy::MinSad, 0 },
+		{ "process_rect/fixed-up", FilterStrategy::Fixed, 2 },
+		{ "process_rect/entropy", FilterStrategy::Entropy, 0 },
+		{ "process_rect/deflate", FilterStrategy::Deflate, 0 },
+	};
+	for (auto &s : strategies) {
+		pEnc->filterStrategy = (int)s.Strategy;
+		pEnc->fixedFilter = s.Filter;
+		report(corpus, s.Stage, run_stage(corpus, iterations, [&](BitmapData *) {
+			pEnc->rowMemo->Clear();
+		}, [&](BitmapData *bmp) {
+			process_rect(pEnc, bmp, pEnc->dest);
+		}));
+	}
+	pEnc->filterStrategy = (int)FilterStrategy::MinSad;
+
+	//the memo as an animation sees it, hits where rows repeat from the frame before, every row a hit, and off
+	report(corpus, "process_rect/memo", run_stage(corpus, iterations, NULL, [&](BitmapData *bmp) {
+		process_rect(pEnc, bmp, pEnc->dest);
+	}));
+	report(corpus, "process_rect/memo-hit", run_stage(corpus, iterations, [&](BitmapData *bmp) {
+		process_rect(pEnc, bmp, pEnc->dest);
+	}, [&](BitmapData *bmp) {
+		process_rect(pEnc, bmp, pEnc->dest);
+	}));
+	pEnc->rowMemoOff = true;
+	report(corpus, "process_rect/no-memo", run_stage(corpus, iterations, NULL, [&](BitmapData *bmp) {
+		process_rect(pEnc, bmp, pEnc->dest);
+	}));
+	pEnc->rowMemoOff = false;
+
+	report(corpus, "deflate_rect_op", run_stage(corpus, iterations, NULL, [&](BitmapData *bmp) {
+		bool filter;
+		deflate_rect_op(pEnc, bmp, &filter);
+	}));
+
+	report(corpus, "deflate_rect_fin", run_stage(corpus, iterations, [&](BitmapData *) {
+		pEnc->arena->Reset();
+	}, [&](BitmapData *bmp) {
+		unsigned int zsize;
+		deflate_rect_fin(pEnc, bmp, true, &zsize);
+	}));
+
+	apng_destroy(&pEnc);
+	remove("bench_stages.tmp");
+
+	bench_thumbnails(corpus, iterations, false);
+	bench_thumbnails(corpus, iterations, true);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 3;
+	const char *only = argc > 2 ? argv[2] : NULL;
+	if (iterations <= 0) iterations = 1;
+
+	Corpus corpora[] = {
+		MakeSpriteCorpus(8),
+		MakeUiCorpus(4),
+		MakeNoiseCorpus(2),
+	};
+
+	printf("%-8s %-26s %13s %15s %13s\n", "corpus", "stage", "time", "throughput", "cost");
+	for (auto &corpus : corpora) {
+		if (only && strcmp(only, corpus.Name) != 0) continue;
+		bench_corpus(corpus, iterations);
+	}
+	return 0;
+}
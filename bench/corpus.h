@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+/* Procedurally generated animations, so the benchmarks need no external
+ * assets. Frames are BGRA with stride = width * 4, the same layout
+ * apng_append_frame expects. Every generator is deterministic. */
+
+struct Corpus {
+	const char *Name;
+	int Width;
+	int Height;
+	int Delay;
+	vector<vector<uint8_t> > Frames;
+};
+
+struct Random {
+	uint32_t State;
+
+	Random(uint32_t seed) : State(seed ? seed : 0x9e3779b9u) {
+	}
+
+	uint32_t Next() {
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+
+	int Range(int n) {
+		return (int)(Next() % (uint32_t)n);
+	}
+};
+
+inline void put_pixel(vector<uint8_t> &frame, int width, int x, int y, uint32_t bgra)
+{
+	memcpy(&frame[(y * width + x) * 4], &bgra, 4);
+}
+
+inline void fill_rect(vector<uint8_t> &frame, int width, int height, int x0, int y0, int w, int h, uint32_t bgra)
+{
+	for (int y = y0 < 0 ? 0 : y0, y1 = y0 + h > height ? height : y0 + h; y < y1; y++) {
+		for (int x = x0 < 0 ? 0 : x0, x1 = x0 + w > width ? width : x0 + w; x < x1; x++) {
+			put_pixel(frame, width, x, y, bgra);
+		}
+	}
+}
+
+inline uint32_t make_bgra(int r, int g, int b, int a)
+{
+	return (uint32_t)b | ((uint32_t)g << 8) | ((uint32_t)r << 16) | ((uint32_t)a << 24);
+}
+
+/* A few shaded sprites with anti-aliased edges moving over a transparent
+ * canvas, the typical game-asset animation. */
+inline Corpus MakeSpriteCorpus(int frameCount, int width = 320, int height = 240)
+{
+	static const uint32_t ramp[3][4] = {
+		{ 0x20104000, 0x40308000, 0x6050c000, 0x9080ff00 },
+		{ 0x00402000, 0x00804000, 0x10c06000, 0x40ff9000 },
+		{ 0x40000040, 0x80100080, 0xc03000c0, 0xff6040ff },
+	};
+	Corpus corpus;
+	corpus.Name = "sprite";
+	corpus.Width = width;
+	corpus.Height = height;
+	corpus.Delay = 100;
+
+	const int radius = 24;
+	for (int i = 0; i < frameCount; i++) {
+		vector<uint8_t> frame(width * height * 4, 0);
+		for (int s = 0; s < 3; s++) {
+			int cx = (40 + s * 90 + i * (3 + s)) % (width - 2 * radius) + radius;
+			int cy = (60 + s * 50 + i * (2 - s)) % (height - 2 * radius) + radius;
+			if (cy < radius) cy += height - 2 * radius;
+			for (int y = cy - radius; y <= cy + radius; y++) {
+				for (int x = cx - radius; x <= cx + radius; x++) {
+					int dx = x - cx, dy = y - cy;
+					int d2 = dx * dx + dy * dy;
+					if (d2 > radius * radius) continue;
+					int shade = (dx + dy + 2 * radius) * 4 / (4 * radius + 1);
+					uint32_t color = ramp[s][shade];
+					int edge = radius * radius - d2;
+					int alpha = edge < 2 * radius ? 255 * edge / (2 * radius) : 255;
+					put_pixel(frame, width, x, y, (color & 0x00ffffffu) | ((uint32_t)alpha << 24));
+				}
+			}
+		}
+		corpus.Frames.push_back(frame);
+	}
+	return corpus;
+}
+
+/* An opaque desktop capture: flat panels, gradient title bars, dense
+ * text-like glyph runs and a scrolling list, with only a small part of the
+ * screen changing between frames. */
+inline Corpus MakeUiCorpus(int frameCount, int width = 1280, int height = 720)
+{
+	Corpus corpus;
+	corpus.Name = "ui";
+	corpus.Width = width;
+	corpus.Height = height;
+	corpus.Delay = 40;
+
+	vector<uint8_t> base(width * height * 4);
+	fill_rect(base, width, height, 0, 0, width, height, make_bgra(58, 110, 165, 255));
+	for (int w = 0; w < 3; w++) {
+		int x0 = 40 + w * 400, y0 = 60 + w * 30, ww = 380, wh = 520;
+		fill_rect(base, width, height, x0, y0, ww, wh, make_bgra(240, 240, 240, 255));
+		for (int x = 0; x < ww; x++) {
+			int v = 200 - x * 120 / ww;
+			fill_rect(base, width, height, x0 + x, y0, 1, 24, make_bgra(v / 3, v / 2, v, 255));
+		}
+		Random rnd(1234 + w);
+		for (int line = 0; line < 30; line++) {
+			int x = x0 + 8;
+			int y = y0 + 34 + line * 16;
+			while (x < x0 + ww - 16) {
+				int word = 3 + rnd.Range(8);
+				for (int c = 0; c < word && x < x0 + ww - 16; c++, x += 7) {
+					uint32_t bits = rnd.Next();
+					for (int gy = 0; gy < 9; gy++) {
+						for (int gx = 0; gx < 5; gx++) {
+							if (bits & (1u << ((gy * 5 + gx) % 32))) {
+								put_pixel(base, width, x + gx, y + gy, make_bgra(30, 30, 30, 255));
+							}
+						}
+					}
+				}
+				x += 7;
+			}
+		}
+	}
+	fill_rect(base, width, height, 0, height - 40, width, 40, make_bgra(32, 32, 40, 255));
+
+	for (int i = 0; i < frameCount; i++) {
+		vector<uint8_t> frame = base;
+		//scrolling list inside the last window
+		int x0 = 840, y0 = 150, ww = 360, wh = 400;
+		for (int row = 0; row < wh / 20; row++) {
+			int item = row + i;
+			uint32_t color = (item % 2) ? make_bgra(250, 250, 250, 255) : make_bgra(226, 232, 240, 255);
+			if (item % 7 == 0) color = make_bgra(0, 120, 215, 255);
+			fill_rect(frame, width, height, x0, y0 + row * 20, ww, 20, color);
+			fill_rect(frame, width, height, x0 + 10, y0 + row * 20 + 6, 40 + (item * 37) % 200, 8, make_bgra(40, 40, 40, 255));
+		}
+		//blinking cursor and a moving pointer
+		if (i % 2 == 0) {
+			fill_rect(frame, width, height, 300, 400, 2, 14, make_bgra(0, 0, 0, 255));
+		}
+		fill_rect(frame, width, height, 100 + i * 11 % 1000, 200 + i * 5 % 300, 12, 18, make_bgra(255, 255, 255, 255));
+		//clock in the task bar
+		fill_rect(frame, width, height, width - 80, height - 30, 60, 20, make_bgra(32 + i % 16, 32, 40, 255));
+		corpus.Frames.push_back(frame);
+	}
+	return corpus;
+}
+
+/* Uniform random opaque pixels, the worst case for every stage. */
+inline Corpus MakeNoiseCorpus(int frameCount, int width = 512, int height = 512)
+{
+	Corpus corpus;
+	corpus.Name = "noise";
+	corpus.Width = width;
+	corpus.Height = height;
+	corpus.Delay = 50;
+
+	Random rnd(42);
+	for (int i = 0; i < frameCount; i++) {
+		vector<uint8_t> frame(width * height * 4);
+		for (int p = 0, p1 = width * height; p < p1; p++) {
+			put_pixel(frame, width, p % width, p / width, rnd.Next() | 0xff000000u);
+		}
+		corpus.Frames.push_back(frame);
+	}
+	return corpus;
+}
+
+/* Smooth opaque gradients with a moving highlight and a little sensor-like
+ * noise, standing in for photographic or rendered footage. */
+inline Corpus MakeGradientCorpus(int frameCount, int width = 400, int height = 300)
+{
+	Corpus corpus;
+	corpus.Name = "gradient";
+	corpus.Width = width;
+	corpus.Height = height;
+	corpus.Delay = 33;
+
+	Random rnd(7);
+	for (int i = 0; i < frameCount; i++) {
+		vector<uint8_t> frame(width * height * 4);
+		int lx = width / 4 + i * 9 % (width / 2);
+		int ly = height / 3 + i * 4 % (height / 3);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				int dx = x - lx, dy = y - ly;
+				int light = 255 - (dx * dx + dy * dy) / 160;
+				if (light < 0) light = 0;
+				int n = rnd.Range(5) - 2;
+				int r = 40 + x * 150 / width + light / 3 + n;
+				int g = 30 + y * 120 / height + light / 4 + n;
+				int b = 90 + light / 2 + n;
+				r = r < 0 ? 0 : r > 255 ? 255 : r;
+				g = g < 0 ? 0 : g > 255 ? 255 : g;
+				b = b < 0 ? 0 : b > 255 ? 255 : b;
+				put_pixel(frame, width, x, y, make_bgra(r, g, b, 255));
+			}
+		}
+		corpus.Frames.push_back(frame);
+	}
+	return corpus;
+}
+
+/* A flat-shaded toolbar icon with a spinner, a handful of colors without
+ * anti-aliasing, the case small indexed images are written for. */
+inline Corpus MakeIconCorpus(int frameCount, int width = 96, int height = 96)
+{
+	static const int spokes[8][2] = {
+		{ 0, -3 }, { 2, -2 }, { 3, 0 }, { 2, 2 }, { 0, 3 }, { -2, 2 }, { -3, 0 }, { -2, -2 },
+	};
+	Corpus corpus;
+	corpus.Name = "icon";
+	corpus.Width = width;
+	corpus.Height = height;
+	corpus.Delay = 80;
+
+	uint32_t frameColor = make_bgra(40, 44, 52, 255);
+	uint32_t panel = make_bgra(230, 232, 236, 255);
+	uint32_t accent = make_bgra(0, 120, 215, 255);
+	uint32_t dim = make_bgra(150, 190, 230, 255);
+	uint32_t badge = make_bgra(220, 50, 47, 255);
+	int cx = width / 2, cy = height / 2, unit = width / 12;
+	for (int i = 0; i < frameCount; i++) {
+		vector<uint8_t> frame(width * height * 4, 0);
+		fill_rect(frame, width, height, unit, unit, width - 2 * unit, height - 2 * unit, frameColor);
+		fill_rect(frame, width, height, unit + 2, unit + 2, width - 2 * unit - 4, height - 2 * unit - 4, panel);
+		for (int s = 0; s < 8; s++) {
+			uint32_t color = s == i % 8 ? accent : dim;
+			fill_rect(frame, width, height, cx + spokes[s][0] * unit - unit / 2, cy + spokes[s][1] * unit - unit / 2, unit, unit, color);
+		}
+		if (i % 4 < 2) {
+			fill_rect(frame, width, height, width - 3 * unit, unit, 2 * unit, 2 * unit, badge);
+		}
+		corpus.Frames.push_back(frame);
+	}
+	return corpus;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "libapngInternal.h"
+
+#if defined(OPENMP) && defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/* Auto mode: decides per frame between the quantized and the lossless
+ * image. A frame with at most MaxColor colors goes out lossless right away,
+ * quantizing it could only lose detail. Otherwise the quantizer runs on one
+ * thread while the lossless trial streams run on a second encoder, and the
+ * quantized image is kept when its trial size is smaller and its PSNR
+ * against the source passes the limit. Only the kept image gets the final
+ * pass. */
+
+/* distinct colors up to limit + 1, all fully transparent pixels count as one */
+static int count_colors(const BitmapData *image, int limit)
+{
+	const int tableSize = 1024;
+	uint32_t table[tableSize];
+	bool used[tableSize];
+	int count = 0;
+
+	memset(used, 0, sizeof(used));
+	for (int y = 0; y < image->Height; y++) {
+		const uint32_t *pRow = (const uint32_t *)((const unsigned char *)image->Scan0 + (size_t)y * image->Stride);
+		for (int x = 0; x < image->Width; x++) {
+			uint32_t color = (pRow[x] >> 24) ? pRow[x] : 0;
+			uint32_t slot = (color * 2654435761u) >> 22;
+			while (used[slot] && table[slot] != color) {
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			if (!used[slot]) {
+				if (++count > limit) {
+					return count;
+				}
+				used[slot] = true;
+				table[slot] = color;
+			}
+		}
+	}
+	return count;
+}
+
+/* PSNR over the four channels, pixels transparent in both do not count */
+static double image_psnr(const BitmapData *source, const BitmapData *quantized)
+{
+	unsigned long long sum = 0, samples = 0;
+	for (int y = 0; y < source->Height; y++) {
+		const unsigned char *s = (const unsigned char *)source->Scan0 + (size_t)y * source->Stride;
+		const unsigned char *q = (const unsigned char *)quantized->Scan0 + (size_t)y * quantized->Stride;
+		for (int x = 0; x < source->Width; x++, s += 4, q += 4) {
+			if ((s[3] | q[3]) == 0) {
+				continue;
+			}
+			for (int c = 0; c < 4; c++) {
+				int d = s[c] - q[c];
+				sum += d * d;
+			}
+			samples += 4;
+		}
+	}
+	if (sum == 0) {
+		return INFINITY;
+	}
+	return 10.0 * log10(255.0 * 255.0 * samples / sum);
+}
+
+static ApngError get_auto_worker(ApngEncoder *pEnc, ApngEncoder **ppWorker)
+{
+	if (!pEnc->autoWorker) {
+		ApngEncoder *worker = (ApngEncoder *)calloc(1, sizeof(ApngEncoder));
+		if (!worker) {
+			return ApngError::MemoryError;
+		}
+		worker->filterStrategy = pEnc->filterStrategy;
+		worker->fixedFilter = pEnc->fixedFilter;
+		worker->rowMemoOff = pEnc->rowMemoOff;
+		init_streams(worker);
+		pEnc->autoWorker = worker;
+		ApngError err = alloc_buffers(worker, pEnc->width * 4, pEnc->height);
+		if (err != ApngError::Success) {
+			destroy_auto_worker(pEnc);
+			return err;
+		}
+	}
+
+	//the deadline of the frame being encoded
+	pEnc->autoWorker->budget = pEnc->budget;
+	pEnc->autoWorker->frameEnd = pEnc->frameEnd;
+	pEnc->autoWorker->degraded = false;
+	pEnc->autoWorker->frameX = pEnc->frameX;
+	pEnc->autoWorker->frameY = pEnc->frameY;
+	pEnc->autoWorker->rowMemo->NextFrame();
+	*ppWorker = pEnc->autoWorker;
+	return ApngError::Success;
+}
+
+void destroy_auto_worker(ApngEncoder *pEnc)
+{
+	if (pEnc->autoWorker) {
+		//shared with the encoder
+		pEnc->autoWorker->budget = NULL;
+		apng_destroy(&pEnc->autoWorker);
+	}
+}
+
+/* Replaces image with the chosen pixels, in the arena and in rgba order, and
+ * returns the filter choice of its trials. */
+ApngError auto_optimize(ApngEncoder *pEnc, BitmapData *image, bool *filter)
+{
+	BitmapData source = *image, lossless = *image, quantized = *image;
+	ApngEncoder *worker = NULL;
+	ApngError err = copy_image(pEnc, &lossless);
+	if (err == ApngError::Success) {
+		err = near_lossless(pEnc, &lossless);
+	}
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	if (count_colors(&source, MaxColor) <= MaxColor) {
+		swap_red_blue(&lossless);
+		deflate_rect_op(pEnc, &lossless, filter);
+		pEnc->stats.losslessFrames++;
+		*image = lossless;
+		return ApngError::Success;
+	}
+
+	err = get_auto_worker(pEnc, &worker);
+	if (err != ApngError::Success) {
+		return err;
+	}
+	swap_red_blue(&lossless);
+
+	ApngError quantizeErr = ApngError::Success;
+	bool isQuantized = false, keep = false, filterQuantized = true, filterLossless = true;
+	unsigned int sizeQuantized = UINT_MAX, sizeLossless = UINT_MAX;
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp parallel sections num_threads(2)
+#endif
+	{
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp section
+#endif
+		{
+			quantizeErr = OptimizeImage(pEnc, &quantized, &isQuantized);
+			if (quantizeErr == ApngError::Success && isQuantized) {
+				keep = image_psnr(&source, &quantized) >= pEnc->autoPsnr;
+				if (keep) {
+					swap_red_blue(&quantized);
+					deflate_rect_op(pEnc, &quantized, &filterQuantized, &sizeQuantized);
+				}
+			}
+		}
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp section
+#endif
+		{
+			deflate_rect_op(worker, &lossless, &filterLossless, &sizeLossless);
+		}
+	}
+
+	pEnc->degraded = pEnc->degraded || worker->degraded;
+	if (quantizeErr != ApngError::Success) {
+		return quantizeErr;
+	}
+
+	//equal estimates, or no trials in time, go lossless; both images stay in the arena
+	keep = keep && sizeQuantized < sizeLossless;
+	if (keep) {
+		*image = quantized;
+		*filter = filterQuantized;
+	}
+	else {
+		//the trials of pEnc ran on the quantized image
+		pEnc->speculated = false;
+		pEnc->stats.losslessFrames++;
+		*image = lossless;
+		*filter = filterLossless;
+	}
+	return ApngError::Success;
+}
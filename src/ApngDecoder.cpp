@@ -0,0 +1,491 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "libapngInternal.h"
+#include "ApngDecoder.h"
+
+/* Decoding: each frame's stream is inflated one row at a time into two row
+ * buffers, unfiltered against the row above, expanded to bgra and drawn on
+ * the canvas with the frame's blend op. The dispose op of a frame is applied
+ * when the next frame is drawn, so the canvas always shows the current one.
+ * A seek starts from the latest frame at or before the target that needs no
+ * earlier state: frame 0, a frame covering the canvas with blend source, or
+ * a kept keyframe, and otherwise continues from the current frame. */
+
+FrameIndex::FrameIndex(int keyframeInterval) :
+	Plays(0),
+	KeyframeInterval(keyframeInterval),
+	HasKey(false)
+{
+	memset(Key, 0, sizeof(Key));
+}
+
+FrameIndex::~FrameIndex()
+{
+	for (size_t i = 0; i < Keyframes.size(); i++) {
+		free(Keyframes[i]);
+	}
+}
+
+static bool valid_depth(int colorType, int bitDepth)
+{
+	switch (colorType) {
+	case 0: return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16;
+	case 3: return bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8;
+	case 2:
+	case 4:
+	case 6: return bitDepth == 8 || bitDepth == 16;
+	default: return false;
+	}
+}
+
+ApngError FrameIndex::Load(const wchar_t *fileName)
+{
+	ApngError err = Reader.Load(fileName);
+	if (err != ApngError::Success) {
+		return err;
+	}
+	if (Reader.Interlace != 0 || !valid_depth(Reader.ColorType, Reader.BitDepth)) {
+		return ApngError::FormatError;
+	}
+
+	bool animated = false, hasPalette = false;
+	for (int i = 0; i < 256; i++) {
+		Palette[i][0] = Palette[i][1] = Palette[i][2] = 0;
+		Palette[i][3] = 255;
+	}
+	for (size_t i = 0; i < Reader.Chunks.size(); i++) {
+		const ApngChunk &chunk = Reader.Chunks[i];
+		const unsigned char *data = chunk.Data.empty() ? NULL : &chunk.Data[0];
+		unsigned int size = (unsigned int)chunk.Data.size();
+
+		if (is_chunk(chunk, "acTL") && size == 8) {
+			animated = true;
+			Plays = (int)png_get_uint_32(data + 4);
+		}
+		else if (is_chunk(chunk, "PLTE")) {
+			hasPalette = true;
+			for (unsigned int p = 0; p < size / 3 && p < 256; p++) {
+				Palette[p][0] = data[p * 3 + 2];
+				Palette[p][1] = data[p * 3 + 1];
+				Palette[p][2] = data[p * 3];
+			}
+		}
+		else if (is_chunk(chunk, "tRNS")) {
+			if (Reader.ColorType == 3) {
+				for (unsigned int p = 0; p < size && p < 256; p++) {
+					Palette[p][3] = data[p];
+				}
+			}
+			else if (Reader.ColorType == 0 && size >= 2) {
+				HasKey = true;
+				Key[0] = png_get_uint_16(data);
+			}
+			else if (Reader.ColorType == 2 && size >= 6) {
+				HasKey = true;
+				Key[0] = png_get_uint_16(data);
+				Key[1] = png_get_uint_16(data + 2);
+				Key[2] = png_get_uint_16(data + 4);
+			}
+		}
+	}
+	if (Reader.ColorType == 3 && !hasPalette) {
+		return ApngError::FormatError;
+	}
+
+	//a plain png, or an apng read as one, is a single frame from the IDATs
+	if (!animated || Reader.FrameControls.empty()) {
+		Frame frame;
+		frame.Stream = 0;
+		frame.Info.x = frame.Info.y = 0;
+		frame.Info.width = Reader.Width;
+		frame.Info.height = Reader.Height;
+		frame.Info.delay_ms = 0;
+		frame.Info.dispose = PNG_DISPOSE_OP_NONE;
+		frame.Info.blend = PNG_BLEND_OP_SOURCE;
+		frame.Independent = true;
+		Frames.push_back(frame);
+	}
+	else {
+		Frames.resize(Reader.FrameControls.size());
+		for (size_t i = 0; i < Frames.size(); i++) {
+			const unsigned char *fcTL = &Reader.Chunks[Reader.FrameControls[i]].Data[0];
+			Frame &frame = Frames[i];
+			ApngFrameInfo &info = frame.Info;
+			unsigned int width = png_get_uint_32(fcTL + 4);
+			unsigned int height = png_get_uint_32(fcTL + 8);
+			unsigned int x = png_get_uint_32(fcTL + 12);
+			unsigned int y = png_get_uint_32(fcTL + 16);
+			int delayNum = png_get_uint_16(fcTL + 20);
+			int delayDen = png_get_uint_16(fcTL + 22);
+
+			if (width == 0 || height == 0 || x > (unsigned int)Reader.Width || y > (unsigned int)Reader.Height
+				|| width > (unsigned int)Reader.Width - x || height > (unsigned int)Reader.Height - y
+				|| fcTL[24] > PNG_DISPOSE_OP_PREVIOUS || fcTL[25] > PNG_BLEND_OP_OVER) {
+				return ApngError::FormatError;
+			}
+
+			frame.Stream = -1;
+			info.x = (int)x;
+			info.y = (int)y;
+			info.width = (int)width;
+			info.height = (int)height;
+			info.delay_ms = delayNum * 1000 / (delayDen ? delayDen : 100);
+			info.dispose = fcTL[24];
+			info.blend = fcTL[25];
+			frame.Independent = x == 0 && y == 0 && width == (unsigned int)Reader.Width && height == (unsigned int)Reader.Height
+				&& info.blend == PNG_BLEND_OP_SOURCE && info.dispose != PNG_DISPOSE_OP_PREVIOUS;
+		}
+		for (size_t s = 0; s < Reader.Streams.size(); s++) {
+			int f = Reader.Streams[s].Frame;
+			if (f >= 0 && f < (int)Frames.size() && Frames[f].Stream < 0) {
+				Frames[f].Stream = (int)s;
+			}
+		}
+		for (size_t i = 0; i < Frames.size(); i++) {
+			if (Frames[i].Stream < 0) {
+				return ApngError::FormatError;
+			}
+		}
+	}
+
+	if (KeyframeInterval <= 0) {
+		KeyframeInterval = 16;
+	}
+	Keyframes.assign((Frames.size() + KeyframeInterval - 1) / KeyframeInterval, NULL);
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_decode_init(wchar_t *fileName, int keyframeInterval, ApngDecoder **ppDec)
+{
+	ApngError err = ApngError::Success;
+	ApngDecoder *pDec = NULL;
+	size_t rowbytes;
+
+	if (!ppDec) {
+		return ApngError::ArgumentError;
+	}
+	*ppDec = NULL;
+
+	pDec = (ApngDecoder *)calloc(1, sizeof(ApngDecoder));
+	if (!pDec) {
+		return ApngError::ContextCreateFailed;
+	}
+	pDec->current = -1;
+	if (inflateInit(&pDec->zstream) != Z_OK) {
+		free(pDec);
+		return ApngError::ContextCreateFailed;
+	}
+
+	pDec->index = new (std::nothrow) FrameIndex(keyframeInterval);
+	if (!pDec->index) {
+		err = ApngError::MemoryError;
+		goto __failed;
+	}
+	err = pDec->index->Load(fileName);
+	if (err != ApngError::Success) {
+		goto __failed;
+	}
+
+	pDec->width = pDec->index->Reader.Width;
+	pDec->height = pDec->index->Reader.Height;
+	pDec->frameCount = (int)pDec->index->Frames.size();
+	pDec->numPlays = pDec->index->Plays;
+
+	rowbytes = pDec->index->Reader.RowBytes(pDec->width);
+	pDec->canvas = (unsigned char *)calloc((size_t)pDec->width * pDec->height, 4);
+	pDec->previous = (unsigned char *)malloc((size_t)pDec->width * pDec->height * 4);
+	pDec->row_buf = (unsigned char *)malloc(rowbytes + 1);
+	pDec->prev_row = (unsigned char *)malloc(rowbytes + 1);
+	pDec->pixel_row = (unsigned char *)malloc((size_t)pDec->width * 4);
+	if (!pDec->canvas || !pDec->previous || !pDec->row_buf || !pDec->prev_row || !pDec->pixel_row) {
+		err = ApngError::MemoryError;
+		goto __failed;
+	}
+
+	*ppDec = pDec;
+	return ApngError::Success;
+
+__failed:
+	apng_decode_destroy(&pDec);
+	return err;
+}
+
+APNG_API(ApngError) apng_decode_frame_info(ApngDecoder *pDec, int frame, ApngFrameInfo *pInfo)
+{
+	if (!pDec || !pInfo || frame < 0 || frame >= pDec->frameCount) {
+		return ApngError::ArgumentError;
+	}
+	*pInfo = pDec->index->Frames[frame].Info;
+	return ApngError::Success;
+}
+
+static inline void put_pixel(unsigned char *dest, int r, int g, int b, int a)
+{
+	dest[0] = (unsigned char)b;
+	dest[1] = (unsigned char)g;
+	dest[2] = (unsigned char)r;
+	dest[3] = (unsigned char)a;
+}
+
+/* converts one unfiltered row to bgra, 16-bit samples keep their high byte */
+static void expand_row(const FrameIndex &index, const unsigned char *src, int width, unsigned char *dest)
+{
+	int depth = index.Reader.BitDepth;
+	switch (index.Reader.ColorType) {
+	case 6:
+		if (depth == 8) {
+			for (int x = 0; x < width; x++, src += 4, dest += 4) {
+				put_pixel(dest, src[0], src[1], src[2], src[3]);
+			}
+		}
+		else {
+			for (int x = 0; x < width; x++, src += 8, dest += 4) {
+				put_pixel(dest, src[0], src[2], src[4], src[6]);
+			}
+		}
+		break;
+	case 4:
+		for (int x = 0, step = depth / 4; x < width; x++, src += step, dest += 4) {
+			put_pixel(dest, src[0], src[0], src[0], src[step / 2]);
+		}
+		break;
+	case 2:
+		for (int x = 0, step = depth * 3 / 8; x < width; x++, src += step, dest += 4) {
+			unsigned int r, g, b;
+			if (depth == 8) {
+				r = src[0];
+				g = src[1];
+				b = src[2];
+			}
+			else {
+				r = png_get_uint_16(src);
+				g = png_get_uint_16(src + 2);
+				b = png_get_uint_16(src + 4);
+			}
+			bool keyed = index.HasKey && r == index.Key[0] && g == index.Key[1] && b == index.Key[2];
+			if (depth == 16) {
+				r >>= 8;
+				g >>= 8;
+				b >>= 8;
+			}
+			put_pixel(dest, r, g, b, keyed ? 0 : 255);
+		}
+		break;
+	case 0:
+		for (int x = 0; x < width; x++, dest += 4) {
+			unsigned int v;
+			if (depth == 16) {
+				v = png_get_uint_16(src + x * 2);
+			}
+			else {
+				int bit = x * depth;
+				v = (src[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+			}
+			bool keyed = index.HasKey && v == index.Key[0];
+			v = depth == 16 ? v >> 8 : v * 255 / ((1 << depth) - 1);
+			put_pixel(dest, v, v, v, keyed ? 0 : 255);
+		}
+		break;
+	case 3:
+		for (int x = 0; x < width; x++, dest += 4) {
+			int bit = x * depth;
+			int p = (src[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+			memcpy(dest, index.Palette[p], 4);
+		}
+		break;
+	}
+}
+
+/* draws a bgra row over the canvas, blend op over with straight alpha */
+static void blend_over(unsigned char *dest, const unsigned char *src, int width)
+{
+	for (int x = 0; x < width; x++, src += 4, dest += 4) {
+		int sa = src[3], da = dest[3];
+		if (sa == 255 || da == 0) {
+			memcpy(dest, src, 4);
+		}
+		else if (sa != 0) {
+			int u = sa * 255;
+			int v = (255 - sa) * da;
+			int al = u + v;
+			dest[0] = (unsigned char)((src[0] * u + dest[0] * v) / al);
+			dest[1] = (unsigned char)((src[1] * u + dest[1] * v) / al);
+			dest[2] = (unsigned char)((src[2] * u + dest[2] * v) / al);
+			dest[3] = (unsigned char)(al / 255);
+		}
+	}
+}
+
+static ApngError draw_frame(ApngDecoder *pDec, int i)
+{
+	const FrameIndex &index = *pDec->index;
+	const ApngImageStream &stream = index.Reader.Streams[index.Frames[i].Stream];
+	const ApngFrameInfo &info = index.Frames[i].Info;
+	size_t rowbytes = index.Reader.RowBytes(info.width);
+	int bpp = index.Reader.FilterBpp();
+	size_t canvasStride = (size_t)pDec->width * 4;
+	unsigned char *pCanvas = pDec->canvas + info.y * canvasStride + info.x * 4;
+	unsigned char *row = pDec->row_buf, *prev = pDec->prev_row;
+	z_stream *zs = &pDec->zstream;
+
+	if (info.dispose == PNG_DISPOSE_OP_PREVIOUS) {
+		for (int y = 0; y < info.height; y++) {
+			memcpy(pDec->previous + (size_t)y * info.width * 4, pCanvas + y * canvasStride, info.width * 4);
+		}
+	}
+
+	inflateReset(zs);
+	zs->next_in = (Bytef *)(stream.Data.empty() ? NULL : &stream.Data[0]);
+	zs->avail_in = (uInt)stream.Data.size();
+	for (int y = 0; y < info.height; y++, pCanvas += canvasStride) {
+		zs->next_out = row;
+		zs->avail_out = (uInt)rowbytes + 1;
+		int r = inflate(zs, Z_NO_FLUSH);
+		if ((r != Z_OK && r != Z_STREAM_END) || zs->avail_out != 0) {
+			return ApngError::FormatError;
+		}
+
+		ApngError err = unfilter_row(row[0], row + 1, y ? prev + 1 : NULL, rowbytes, bpp);
+		if (err != ApngError::Success) {
+			return err;
+		}
+		if (info.blend == PNG_BLEND_OP_SOURCE) {
+			expand_row(index, row + 1, info.width, pCanvas);
+		}
+		else {
+			expand_row(index, row + 1, info.width, pDec->pixel_row);
+			blend_over(pCanvas, pDec->pixel_row, info.width);
+		}
+
+		unsigned char *temp = prev;
+		prev = row;
+		row = temp;
+	}
+	return ApngError::Success;
+}
+
+/* readies the canvas for the frame after i */
+static void dispose_frame(ApngDecoder *pDec, int i)
+{
+	const ApngFrameInfo &info = pDec->index->Frames[i].Info;
+	size_t canvasStride = (size_t)pDec->width * 4;
+	unsigned char *pCanvas = pDec->canvas + info.y * canvasStride + info.x * 4;
+
+	//the first frame has nothing to go back to
+	if (info.dispose == PNG_DISPOSE_OP_BACKGROUND || (info.dispose == PNG_DISPOSE_OP_PREVIOUS && i == 0)) {
+		for (int y = 0; y < info.height; y++, pCanvas += canvasStride) {
+			memset(pCanvas, 0, info.width * 4);
+		}
+	}
+	else if (info.dispose == PNG_DISPOSE_OP_PREVIOUS) {
+		for (int y = 0; y < info.height; y++, pCanvas += canvasStride) {
+			memcpy(pCanvas, pDec->previous + (size_t)y * info.width * 4, info.width * 4);
+		}
+	}
+}
+
+static ApngError seek_frame(ApngDecoder *pDec, int target)
+{
+	FrameIndex &index = *pDec->index;
+	int interval = index.KeyframeInterval;
+	size_t canvasSize = (size_t)pDec->width * pDec->height * 4;
+	int start = -1;
+
+	if (target == pDec->current) {
+		return ApngError::Success;
+	}
+
+	//going back always finds frame 0
+	int floor = target > pDec->current ? pDec->current : -1;
+	for (int i = target; i > floor; i--) {
+		if (i == 0 || index.Frames[i].Independent || (i % interval == 0 && index.Keyframes[i / interval])) {
+			start = i;
+			break;
+		}
+	}
+
+	if (start < 0) {
+		dispose_frame(pDec, pDec->current);
+		start = pDec->current + 1;
+	}
+	else if (index.Frames[start].Independent) {
+		//every pixel is drawn over
+	}
+	else if (start == 0) {
+		memset(pDec->canvas, 0, canvasSize);
+	}
+	else {
+		memcpy(pDec->canvas, index.Keyframes[start / interval], canvasSize);
+	}
+
+	for (int i = start; ; i++) {
+		//a keyframe that cannot be kept only costs a longer seek
+		if (i > 0 && i % interval == 0 && !index.Frames[i].Independent && !index.Keyframes[i / interval]) {
+			index.Keyframes[i / interval] = (unsigned char *)malloc(canvasSize);
+			if (index.Keyframes[i / interval]) {
+				memcpy(index.Keyframes[i / interval], pDec->canvas, canvasSize);
+			}
+		}
+
+		ApngError err = draw_frame(pDec, i);
+		if (err != ApngError::Success) {
+			pDec->current = -1;
+			return err;
+		}
+		pDec->current = i;
+		if (i == target) {
+			break;
+		}
+		dispose_frame(pDec, i);
+	}
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_decode_frame(ApngDecoder *pDec, int frame, void *pData, int stride)
+{
+	if (!pDec || !pData || frame < 0 || frame >= pDec->frameCount || stride < pDec->width * 4) {
+		return ApngError::ArgumentError;
+	}
+
+	ApngError err = seek_frame(pDec, frame);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	unsigned char *pRow = (unsigned char *)pData;
+	for (int y = 0; y < pDec->height; y++, pRow += stride) {
+		memcpy(pRow, pDec->canvas + (size_t)y * pDec->width * 4, pDec->width * 4);
+	}
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_decode_index(ApngDecoder *pDec)
+{
+	if (!pDec) {
+		return ApngError::ArgumentError;
+	}
+
+	//from the start, keyframes before the current frame may be missing
+	ApngError err = seek_frame(pDec, 0);
+	if (err == ApngError::Success) {
+		err = seek_frame(pDec, pDec->frameCount - 1);
+	}
+	return err;
+}
+
+APNG_API(void) apng_decode_destroy(ApngDecoder **ppDec)
+{
+	if (ppDec && *ppDec) {
+		ApngDecoder *pDec = *ppDec;
+		inflateEnd(&pDec->zstream);
+		delete pDec->index;
+		free(pDec->canvas);
+		free(pDec->previous);
+		free(pDec->row_buf);
+		free(pDec->prev_row);
+		free(pDec->pixel_row);
+		free(pDec);
+		*ppDec = NULL;
+	}
+}
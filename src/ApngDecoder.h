@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include "libapng.h"
+#include "ApngReader.h"
+
+using namespace std;
+
+/* The frames of an opened file with the canvas keyframes decoded so far.
+ * Keyframes[k] is the canvas ready for frame k * KeyframeInterval to be
+ * drawn, NULL until a decode has passed it. */
+class FrameIndex
+{
+public:
+	struct Frame {
+		int Stream; //index into Reader.Streams
+		ApngFrameInfo Info;
+		bool Independent; //covers the canvas with blend source, nothing drawn before shows
+	};
+
+	FrameIndex(int keyframeInterval);
+	~FrameIndex();
+
+	ApngError Load(const wchar_t *fileName);
+
+	ApngReader Reader;
+	vector<Frame> Frames;
+	int Plays;
+	int KeyframeInterval;
+	vector<unsigned char *> Keyframes;
+
+	//bgra palette with the tRNS alpha, the color key of gray and rgb images
+	unsigned char Palette[256][4];
+	bool HasKey;
+	unsigned int Key[3];
+
+private:
+	FrameIndex(const FrameIndex &);
+	FrameIndex &operator=(const FrameIndex &);
+};
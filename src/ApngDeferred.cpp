@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "libapngInternal.h"
+
+#if defined(OPENMP) && defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/* Deferred encode: the kept frames are written in apng_write_end. Knowing
+ * the next frame lets each frame pick the smaller of two rects:
+ *   the changed pixels, with the previous frame left in place (dispose none)
+ *   the opaque pixels, with the previous frame's rect cleared (dispose
+ *   background), which is what apng_append_frame picks on its own.
+ * The frames are then compressed in parallel and written in order. */
+
+struct FramePlan {
+	RECT rect;
+	unsigned char dispose;
+};
+
+struct Bounds {
+	int x0, y0, x1, y1;
+
+	Bounds(int width, int height) : x0(width), y0(height), x1(-1), y1(-1) {
+	}
+
+	void add(int x, int y) {
+		if (x < x0) x0 = x;
+		if (x > x1) x1 = x;
+		if (y < y0) y0 = y;
+		if (y > y1) y1 = y;
+	}
+
+	//an empty rect becomes the 1x1 frame get_rect also falls back to
+	RECT rect() const {
+		RECT r;
+		if (x0 > x1) {
+			r.x = r.y = 0;
+			r.width = r.height = 1;
+		}
+		else {
+			r.x = x0;
+			r.y = y0;
+			r.width = x1 - x0 + 1;
+			r.height = y1 - y0 + 1;
+		}
+		return r;
+	}
+};
+
+static inline long long area(const RECT &rect)
+{
+	return (long long)rect.width * rect.height;
+}
+
+//fully transparent pixels match whatever their color bytes are
+static inline bool same_pixel(uint32_t a, uint32_t b)
+{
+	return a == b || ((a | b) >> 24) == 0;
+}
+
+/* draws a kept frame onto a transparent canvas */
+static void paste_frame(const FrameCapture &capture, int i, uint32_t *canvas, int width, int height)
+{
+	const FrameCapture::Frame &frame = capture[i];
+	const unsigned char *pRow = capture.Pixels(i);
+
+	memset(canvas, 0, (size_t)width * height * 4);
+	for (int y = 0; y < frame.Height; y++) {
+		memcpy(canvas + (size_t)(frame.Y + y) * width + frame.X, pRow, frame.Width * 4);
+		pRow += frame.Width * 4;
+	}
+}
+
+/* Chooses the rect of every frame and the dispose op of the one before it,
+ * greedily in frame order. */
+static ApngError plan_frames(ApngEncoder *pEnc, const FrameCapture &capture, vector<FramePlan> &plan)
+{
+	int width = pEnc->width, height = pEnc->height;
+	size_t pixels = (size_t)width * height;
+	uint32_t *prev = (uint32_t *)malloc(pixels * 4);
+	uint32_t *cur = (uint32_t *)malloc(pixels * 4);
+	if (!prev || !cur) {
+		free(prev);
+		free(cur);
+		return ApngError::MemoryError;
+	}
+
+	plan[0].rect.x = plan[0].rect.y = 0;
+	plan[0].rect.width = width;
+	plan[0].rect.height = height;
+	pEnc->stats.streamingPixels += area(plan[0].rect);
+	paste_frame(capture, 0, prev, width, height);
+
+	for (int i = 1, i1 = capture.Count(); i < i1; i++) {
+		const RECT &last = plan[i - 1].rect;
+		Bounds kept(width, height), cleared(width, height), alone(width, height);
+
+		paste_frame(capture, i, cur, width, height);
+		for (int y = 0; y < height; y++) {
+			const uint32_t *pCur = cur + (size_t)y * width;
+			const uint32_t *pPrev = prev + (size_t)y * width;
+			bool inLastRows = y >= last.y && y < last.y + last.height;
+
+			for (int x = 0; x < width; x++) {
+				bool opaque = (pCur[x] >> 24) != 0;
+				bool changed = !same_pixel(pCur[x], pPrev[x]);
+				bool inLast = inLastRows && x >= last.x && x < last.x + last.width;
+
+				if (changed) kept.add(x, y);
+				if (inLast ? opaque : changed) cleared.add(x, y);
+				if (opaque) alone.add(x, y);
+			}
+		}
+
+		pEnc->stats.streamingPixels += area(alone.rect());
+		if (area(kept.rect()) < area(cleared.rect())) {
+			plan[i - 1].dispose = PNG_DISPOSE_OP_NONE;
+			plan[i].rect = kept.rect();
+		}
+		else {
+			plan[i - 1].dispose = PNG_DISPOSE_OP_BACKGROUND;
+			plan[i].rect = cleared.rect();
+		}
+
+		uint32_t *temp = prev;
+		prev = cur;
+		cur = temp;
+	}
+	plan[capture.Count() - 1].dispose = PNG_DISPOSE_OP_BACKGROUND;
+
+	free(prev);
+	free(cur);
+	return ApngError::Success;
+}
+
+/* an encoder with its own buffers and trial streams for one thread */
+static ApngError create_worker(const ApngEncoder *pEnc, ApngEncoder **ppWorker)
+{
+	ApngEncoder *worker = (ApngEncoder*)calloc(1, sizeof(ApngEncoder));
+	if (!worker) {
+		return ApngError::MemoryError;
+	}
+
+	worker->width = pEnc->width;
+	worker->height = pEnc->height;
+	worker->quantizeEffort = pEnc->quantizeEffort;
+	worker->reuseMeanError = pEnc->reuseMeanError;
+	worker->reuseMaxError = pEnc->reuseMaxError;
+	worker->palette = pEnc->palette;
+	worker->bitDepth = pEnc->bitDepth;
+	worker->budget = pEnc->budget;
+	worker->autoPsnr = pEnc->autoPsnr;
+	worker->filterStrategy = pEnc->filterStrategy;
+	worker->fixedFilter = pEnc->fixedFilter;
+	worker->rowMemoOff = pEnc->rowMemoOff;
+	worker->nearLosslessError = pEnc->nearLosslessError;
+	worker->nearLosslessDither = pEnc->nearLosslessDither;
+	init_streams(worker);
+
+	*ppWorker = worker;
+	return alloc_buffers(worker);
+}
+
+static void destroy_worker(ApngEncoder **ppWorker)
+{
+	if (*ppWorker) {
+		//shared with the encoder
+		(*ppWorker)->palette = NULL;
+		(*ppWorker)->budget = NULL;
+	}
+	apng_destroy(ppWorker);
+}
+
+/* crops the planned rect out of a kept frame and compresses it */
+static ApngError encode_planned(ApngEncoder *worker, const FrameCapture &capture, int i, const RECT &rect, vector<unsigned char> &encoded)
+{
+	const FrameCapture::Frame &frame = capture[i];
+	worker->arena->Reset();
+	unsigned char *pixels = (unsigned char *)worker->arena->Alloc((size_t)rect.width * rect.height * 4);
+	if (!pixels) {
+		return ApngError::MemoryError;
+	}
+	memset(pixels, 0, (size_t)rect.width * rect.height * 4);
+
+	//outside the kept frame the canvas is transparent
+	int x0 = rect.x > frame.X ? rect.x : frame.X;
+	int y0 = rect.y > frame.Y ? rect.y : frame.Y;
+	int x1 = rect.x + rect.width < frame.X + frame.Width ? rect.x + rect.width : frame.X + frame.Width;
+	int y1 = rect.y + rect.height < frame.Y + frame.Height ? rect.y + rect.height : frame.Y + frame.Height;
+	const unsigned char *source = capture.Pixels(i);
+	for (int y = y0; y < y1 && x0 < x1; y++) {
+		memcpy(pixels + ((size_t)(y - rect.y) * rect.width + (x0 - rect.x)) * 4,
+			source + ((size_t)(y - frame.Y) * frame.Width + (x0 - frame.X)) * 4,
+			(x1 - x0) * 4);
+	}
+
+	BitmapData bmpData;
+	bmpData.Width = rect.width;
+	bmpData.Height = rect.height;
+	bmpData.Stride = rect.width * 4;
+	bmpData.bpp = 4;
+	bmpData.Scan0 = pixels;
+
+	unsigned int zsize;
+	ApngError err = encode_frame(worker, &bmpData, rect.x, rect.y, frame.Optimize, &zsize);
+	if (err == ApngError::Success) {
+		encoded.assign(worker->zbuf, worker->zbuf + zsize);
+	}
+	return err;
+}
+
+ApngError flush_deferred(ApngEncoder *pEnc, FrameCapture *capture)
+{
+	ApngError err = capture->Map();
+	int count = capture->Count();
+	int threads = 1;
+	vector<FramePlan> plan;
+	vector<vector<unsigned char> > encoded;
+	vector<ApngError> errors;
+	vector<ApngEncoder *> workers;
+
+	if (err != ApngError::Success || count == 0) {
+		return err;
+	}
+	if (pEnc->budget->Cancelled()) {
+		return ApngError::Cancelled;
+	}
+
+	//one palette from every kept frame
+	if (pEnc->capturePalette) {
+		if (!pEnc->palette) {
+			QuantizeOptions options;
+			options.Effort = (QuantizeEffort)pEnc->quantizeEffort;
+			pEnc->palette = new (std::nothrow) GlobalPalette(&options);
+			if (!pEnc->palette) {
+				return ApngError::MemoryError;
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			BitmapData bmpData;
+			bmpData.Width = (*capture)[i].Width;
+			bmpData.Height = (*capture)[i].Height;
+			bmpData.Stride = bmpData.Width * 4;
+			bmpData.bpp = 4;
+			bmpData.Scan0 = (void *)capture->Pixels(i);
+			pEnc->palette->AddImage(&bmpData);
+		}
+	}
+
+	err = write_header(pEnc);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	plan.resize(count);
+	err = plan_frames(pEnc, *capture, plan);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+#if defined(OPENMP) && defined(_OPENMP)
+	threads = omp_get_max_threads() < count ? omp_get_max_threads() : count;
+#endif
+	workers.assign(threads, NULL);
+	for (int t = 0; t < threads; t++) {
+		err = create_worker(pEnc, &workers[t]);
+		if (err != ApngError::Success) {
+			goto __end;
+		}
+	}
+
+	//contiguous blocks keep palette reuse within runs of neighbouring frames
+	encoded.resize(count);
+	errors.assign(count, ApngError::Success);
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+	for (int i = 0; i < count; i++) {
+		int t = 0;
+#if defined(OPENMP) && defined(_OPENMP)
+		t = omp_get_thread_num();
+#endif
+		errors[i] = encode_planned(workers[t], *capture, i, plan[i].rect, encoded[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (errors[i] != ApngError::Success) {
+			err = errors[i];
+			goto __end;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		const RECT &rect = plan[i].rect;
+		pEnc->stats.encodedPixels += area(rect);
+		write_frame(pEnc, rect.x, rect.y, rect.width, rect.height, (*capture)[i].Delay, plan[i].dispose,
+			&encoded[i][0], (unsigned int)encoded[i].size());
+		vector<unsigned char>().swap(encoded[i]);
+	}
+
+__end:
+	for (int t = 0; t < threads; t++) {
+		if (workers[t]) {
+			pEnc->stats.remappedFrames += workers[t]->stats.remappedFrames;
+			pEnc->stats.degradedFrames += workers[t]->stats.degradedFrames;
+			pEnc->stats.losslessFrames += workers[t]->stats.losslessFrames;
+			pEnc->stats.reusedRows += workers[t]->stats.reusedRows;
+			pEnc->nearSquaredError += workers[t]->nearSquaredError;
+			pEnc->nearSamples += workers[t]->nearSamples;
+			if (workers[t]->arena) {
+				pEnc->stats.arenaReused += workers[t]->arena->ReusedBytes();
+				pEnc->stats.arenaAllocated += workers[t]->arena->AllocatedBytes();
+			}
+		}
+		destroy_worker(&workers[t]);
+	}
+	return err;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include "libapng.h"
+
+using namespace std;
+
+/* Frames kept for the deferred encode, in memory or appended to a temp file
+ * that Map() maps back before the encode. Rows are stored packed,
+ * width * 4 bytes each. */
+class FrameCapture
+{
+public:
+	struct Frame {
+		size_t Offset;
+		int X;
+		int Y;
+		int Width;
+		int Height;
+		int Delay;
+		bool Optimize;
+	};
+
+	FrameCapture(bool spill);
+	~FrameCapture();
+
+	ApngError Add(const void *pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize);
+	ApngError Map();
+	int Count() const { return frames.size(); }
+	const Frame &operator[](int i) const { return frames[i]; }
+	const unsigned char *Pixels(int i) const;
+
+private:
+	FrameCapture(const FrameCapture &);
+	FrameCapture &operator=(const FrameCapture &);
+
+	bool spill;
+	vector<Frame> frames;
+	vector<unsigned char *> buffers;
+	FILE *file;
+	size_t fileSize;
+	unsigned char *mapped;
+#ifdef _WIN32
+	void *mapping;
+#endif
+};
+
+ApngError flush_deferred(ApngEncoder *pEnc, FrameCapture *capture);
@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include "libapngInternal.h"
+#include "ApngReader.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Editing on the chunk stream: the frames of existing files are copied as
+ * they are, only the sequence numbers, the frame count in acTL and the
+ * CRCs are written again. A frame that comes to follow another one than in
+ * its file keeps its pixels when it was drawn on a transparent canvas or
+ * covers the whole canvas; the frame before it is then disposed to the
+ * background, and its own blend op becomes source when blending over a
+ * transparent canvas made no difference. Anything else is a FormatError. */
+
+struct EditSource {
+	ApngReader Reader;
+	vector<int> FrameStreams; //stream index of each frame
+	int DefaultStream; //the IDAT stream
+	vector<bool> Clear; //the canvas is transparent when frame i starts, the last entry after the last frame
+};
+
+struct AppendTarget {
+	wstring File; //the file apng_open_append read
+	wstring Temp; //written instead, next to it, a name no other append uses
+};
+
+struct EditFrame {
+	const EditSource *Source;
+	int Frame;
+	unsigned char Dispose;
+	unsigned char Blend;
+};
+
+static const unsigned char *frame_control(const EditSource &source, int frame)
+{
+	return &source.Reader.Chunks[source.Reader.FrameControls[frame]].Data[0];
+}
+
+static bool covers_canvas(const EditSource &source, int frame)
+{
+	const unsigned char *fcTL = frame_control(source, frame);
+	return png_get_uint_32(fcTL + 4) == (png_uint_32)source.Reader.Width && png_get_uint_32(fcTL + 8) == (png_uint_32)source.Reader.Height
+		&& png_get_uint_32(fcTL + 12) == 0 && png_get_uint_32(fcTL + 16) == 0;
+}
+
+static ApngError load_source(const wchar_t *fileName, EditSource *source)
+{
+	ApngReader &reader = source->Reader;
+	ApngError err = reader.Load(fileName);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	bool animated = false;
+	for (size_t i = 0; i < reader.Chunks.size(); i++) {
+		animated = animated || is_chunk(reader.Chunks[i], "acTL");
+	}
+	int count = (int)reader.FrameControls.size();
+	if (!animated || count == 0) {
+		return ApngError::FormatError;
+	}
+
+	source->FrameStreams.assign(count, -1);
+	source->DefaultStream = -1;
+	for (size_t s = 0; s < reader.Streams.size(); s++) {
+		const ApngImageStream &stream = reader.Streams[s];
+		if (stream.Frame >= 0) {
+			source->FrameStreams[stream.Frame] = (int)s;
+		}
+		if (is_chunk(reader.Chunks[stream.FirstChunk], "IDAT")) {
+			source->DefaultStream = (int)s;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (source->FrameStreams[i] < 0) {
+			return ApngError::FormatError;
+		}
+	}
+	if (source->DefaultStream < 0) {
+		return ApngError::FormatError;
+	}
+
+	//dispose previous on the first frame works like background
+	source->Clear.assign(count + 1, false);
+	source->Clear[0] = true;
+	for (int i = 0; i < count; i++) {
+		unsigned char dispose = frame_control(*source, i)[24];
+		source->Clear[i + 1] = (dispose == PNG_DISPOSE_OP_BACKGROUND && covers_canvas(*source, i))
+			|| (source->Clear[i] && (dispose == PNG_DISPOSE_OP_BACKGROUND || dispose == PNG_DISPOSE_OP_PREVIOUS));
+	}
+	return ApngError::Success;
+}
+
+static void add_frames(const EditSource &source, int first, int count, vector<EditFrame> &frames)
+{
+	for (int i = first; i < first + count; i++) {
+		const unsigned char *fcTL = frame_control(source, i);
+		EditFrame frame = { &source, i, fcTL[24], fcTL[25] };
+		frames.push_back(frame);
+	}
+}
+
+/* Sets the ops of the frames that follow another frame than in their
+ * file; endClear also clears the canvas after the last frame. */
+static ApngError plan_edit(vector<EditFrame> &frames, bool endClear)
+{
+	if (frames.empty()) {
+		return ApngError::ArgumentError;
+	}
+
+	for (size_t k = 0; k < frames.size(); k++) {
+		EditFrame &q = frames[k];
+		bool follows = k > 0
+			? frames[k - 1].Source == q.Source && frames[k - 1].Frame + 1 == q.Frame
+			: q.Frame == 0;
+		if (follows) {
+			continue;
+		}
+
+		bool clear = q.Source->Clear[q.Frame];
+		bool full = covers_canvas(*q.Source, q.Frame);
+		if (full && clear) {
+			q.Blend = PNG_BLEND_OP_SOURCE;
+			if (q.Frame == 0 && q.Dispose == PNG_DISPOSE_OP_PREVIOUS) {
+				q.Dispose = PNG_DISPOSE_OP_BACKGROUND;
+			}
+		}
+		//replaces all it is drawn on
+		if (full && q.Blend == PNG_BLEND_OP_SOURCE && q.Dispose != PNG_DISPOSE_OP_PREVIOUS) {
+			continue;
+		}
+		if (!clear) {
+			return ApngError::FormatError;
+		}
+		if (k > 0) {
+			EditFrame &p = frames[k - 1];
+			if (!p.Source->Clear[p.Frame + 1]) {
+				if (!p.Source->Clear[p.Frame] && !covers_canvas(*p.Source, p.Frame)) {
+					return ApngError::FormatError;
+				}
+				p.Dispose = PNG_DISPOSE_OP_BACKGROUND;
+			}
+		}
+	}
+
+	EditFrame &last = frames.back();
+	if (endClear && !last.Source->Clear[last.Frame + 1]) {
+		if (!last.Source->Clear[last.Frame] && !covers_canvas(*last.Source, last.Frame)) {
+			return ApngError::FormatError;
+		}
+		last.Dispose = PNG_DISPOSE_OP_BACKGROUND;
+	}
+	return ApngError::Success;
+}
+
+static void write_stream(ApngEncoder *writer, const ApngReader &reader, int stream, bool idat)
+{
+	const ApngImageStream &image = reader.Streams[stream];
+	const ApngChunk &firstChunk = reader.Chunks[image.FirstChunk];
+	for (size_t i = image.FirstChunk; i < reader.Chunks.size() && !memcmp(reader.Chunks[i].Type, firstChunk.Type, 4); i++) {
+		const ApngChunk &chunk = reader.Chunks[i];
+		size_t skip = is_chunk(chunk, "fdAT") ? 4 : 0;
+		unsigned int length = (unsigned int)(chunk.Data.size() - skip);
+		unsigned char *data = length > 0 ? (unsigned char *)&chunk.Data[skip] : NULL;
+		if (idat)
+			write_chunk(writer, "IDAT", data, length);
+		else
+			write_chunk(writer, "fdAT", data, length + 4);
+	}
+}
+
+static bool is_image_chunk(const ApngChunk &chunk)
+{
+	return is_chunk(chunk, "fcTL") || is_chunk(chunk, "IDAT") || is_chunk(chunk, "fdAT");
+}
+
+/* Writes the chunks of the first frame's file before its first frame, the
+ * frames, and with finish the chunks after its last frame and IEND. The
+ * default image is frame 0 when that is the first frame of its file,
+ * otherwise the file's default image is kept out of the animation. */
+static void write_edit(ApngEncoder *writer, const vector<EditFrame> &frames, bool finish)
+{
+	static const unsigned char png_sign[8] = { 137,  80,  78,  71,  13,  10,  26,  10 };
+	const EditSource &first = *frames[0].Source;
+	const ApngReader &reader = first.Reader;
+	bool animatedDefault = frames[0].Frame == 0 && first.FrameStreams[0] == first.DefaultStream;
+
+	fwrite(png_sign, 1, 8, writer->hFile);
+
+	size_t pos = 0;
+	for (; pos < reader.Chunks.size() && !is_image_chunk(reader.Chunks[pos]); pos++) {
+		const ApngChunk &chunk = reader.Chunks[pos];
+		if (is_chunk(chunk, "acTL") && chunk.Data.size() == 8) {
+			unsigned char buf_acTL[8];
+			png_save_uint_32(buf_acTL, (png_uint_32)frames.size()); //frames
+			memcpy(buf_acTL + 4, &chunk.Data[4], 4); //loops
+
+			writer->acTLPos = ftell(writer->hFile);
+			write_chunk(writer, "acTL", buf_acTL, 8);
+		}
+		else {
+			write_chunk(writer, chunk.Type, chunk.Data.empty() ? NULL : (unsigned char *)&chunk.Data[0], (unsigned int)chunk.Data.size());
+		}
+	}
+
+	if (!animatedDefault) {
+		write_stream(writer, reader, first.DefaultStream, true);
+	}
+
+	for (size_t k = 0; k < frames.size(); k++) {
+		const EditFrame &frame = frames[k];
+		unsigned char buf_fcTL[26];
+		memcpy(buf_fcTL, frame_control(*frame.Source, frame.Frame), 26);
+		png_save_uint_32(buf_fcTL, writer->seqIndex++);
+		buf_fcTL[24] = frame.Dispose;
+		buf_fcTL[25] = frame.Blend;
+		write_chunk(writer, "fcTL", buf_fcTL, 26);
+
+		write_stream(writer, frame.Source->Reader, frame.Source->FrameStreams[frame.Frame], k == 0 && animatedDefault);
+	}
+	writer->frameCount = (int)frames.size();
+
+	//after the last image chunk; apng_write_end adds its own Software text
+	size_t end = reader.Chunks.size();
+	while (end > 0 && !is_image_chunk(reader.Chunks[end - 1])) {
+		end--;
+	}
+	for (pos = end; pos < reader.Chunks.size(); pos++) {
+		const ApngChunk &chunk = reader.Chunks[pos];
+		bool software = is_chunk(chunk, "tEXt") && chunk.Data.size() >= 9 && !memcmp(&chunk.Data[0], "Software", 9);
+		if (is_chunk(chunk, "IEND") || (!finish && software)) {
+			continue;
+		}
+		write_chunk(writer, chunk.Type, chunk.Data.empty() ? NULL : (unsigned char *)&chunk.Data[0], (unsigned int)chunk.Data.size());
+	}
+	if (finish) {
+		write_chunk(writer, "IEND", NULL, 0);
+	}
+}
+
+static ApngError write_edit_file(const wchar_t *dstFileName, vector<EditFrame> &frames)
+{
+	ApngError err = plan_edit(frames, false);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	ApngEncoder *writer = (ApngEncoder *)calloc(1, sizeof(ApngEncoder));
+	if (!writer) {
+		return ApngError::MemoryError;
+	}
+	if (!(writer->hFile = open_file(dstFileName, "wb"))) {
+		err = ApngError::FileError;
+	}
+	else {
+		write_edit(writer, frames, true);
+		err = ferror(writer->hFile) ? ApngError::FileError : ApngError::Success;
+	}
+	apng_destroy(&writer);
+	return err;
+}
+
+APNG_API(ApngError) apng_trim(wchar_t *srcFileName, wchar_t *dstFileName, int first, int count)
+{
+	EditSource source;
+	ApngError err = load_source(srcFileName, &source);
+	if (err != ApngError::Success) {
+		return err;
+	}
+	int frameCount = (int)source.FrameStreams.size();
+	if (first < 0 || count <= 0 || first > frameCount - count) {
+		return ApngError::ArgumentError;
+	}
+
+	vector<EditFrame> frames;
+	add_frames(source, first, count, frames);
+	return write_edit_file(dstFileName, frames);
+}
+
+APNG_API(ApngError) apng_drop_frames(wchar_t *srcFileName, wchar_t *dstFileName, int first, int count)
+{
+	EditSource source;
+	ApngError err = load_source(srcFileName, &source);
+	if (err != ApngError::Success) {
+		return err;
+	}
+	int frameCount = (int)source.FrameStreams.size();
+	if (first < 0 || count <= 0 || first > frameCount - count || count == frameCount) {
+		return ApngError::ArgumentError;
+	}
+
+	vector<EditFrame> frames;
+	add_frames(source, 0, first, frames);
+	add_frames(source, first + count, frameCount - first - count, frames);
+	return write_edit_file(dstFileName, frames);
+}
+
+//IHDR, PLTE and tRNS, which every frame of the files is decoded with
+static bool same_format(const ApngReader &a, const ApngReader &b)
+{
+	static const char *types[3] = { "IHDR", "PLTE", "tRNS" };
+	for (int t = 0; t < 3; t++) {
+		const ApngChunk *chunkA = NULL, *chunkB = NULL;
+		for (size_t i = 0; i < a.Chunks.size() && !chunkA; i++) {
+			if (is_chunk(a.Chunks[i], types[t])) chunkA = &a.Chunks[i];
+		}
+		for (size_t i = 0; i < b.Chunks.size() && !chunkB; i++) {
+			if (is_chunk(b.Chunks[i], types[t])) chunkB = &b.Chunks[i];
+		}
+		if (!chunkA != !chunkB || (chunkA && chunkA->Data != chunkB->Data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+APNG_API(ApngError) apng_concat(wchar_t **srcFileNames, int fileCount, wchar_t *dstFileName)
+{
+	if (!srcFileNames || fileCount <= 0) {
+		return ApngError::ArgumentError;
+	}
+
+	vector<EditSource> sources(fileCount);
+	vector<EditFrame> frames;
+	for (int f = 0; f < fileCount; f++) {
+		ApngError err = load_source(srcFileNames[f], &sources[f]);
+		if (err != ApngError::Success) {
+			return err;
+		}
+		if (!same_format(sources[0].Reader, sources[f].Reader)) {
+			return ApngError::FormatError;
+		}
+	}
+	for (int f = 0; f < fileCount; f++) {
+		add_frames(sources[f], 0, (int)sources[f].FrameStreams.size(), frames);
+	}
+	return write_edit_file(dstFileName, frames);
+}
+
+static bool replace_file(const wchar_t *from, const wchar_t *to)
+{
+#ifdef _WIN32
+	return MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	char *pathFrom = utf8_path(from);
+	char *pathTo = utf8_path(to);
+	bool moved = pathFrom && pathTo && rename(pathFrom, pathTo) == 0;
+	free(pathFrom);
+	free(pathTo);
+	return moved;
+#endif
+}
+
+static void remove_file(const wchar_t *fileName)
+{
+#ifdef _WIN32
+	_wremove(fileName);
+#else
+	char *path = utf8_path(fileName);
+	if (path) {
+		remove(path);
+		free(path);
+	}
+#endif
+}
+
+/* A temp file next to file that did not exist before, so two appends to
+ * one file, or the leftover of an earlier run, never share it; apng_init
+ * opens it again. */
+static bool create_temp(const wstring &file, wstring *temp)
+{
+	static std::atomic<unsigned int> counter(0);
+#ifdef _WIN32
+	unsigned int pid = (unsigned int)GetCurrentProcessId();
+#else
+	unsigned int pid = (unsigned int)getpid();
+#endif
+	for (int attempt = 0; attempt < 100; attempt++) {
+		wchar_t suffix[32];
+		swprintf(suffix, 32, L".%u-%u.tmp", pid, counter.fetch_add(1));
+		*temp = file + suffix;
+		FILE *f = open_file(temp->c_str(), "wbx");
+		if (f) {
+			fclose(f);
+			return true;
+		}
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+	temp->clear();
+	return false;
+}
+
+/* Continues an 8-bit rgba animation: the frames of the file are written
+ * to the temp file before the first appended frame, or by apng_write_end. */
+APNG_API(ApngError) apng_open_append(wchar_t *fileName, ApngEncoder **ppEnc)
+{
+	if (!ppEnc) {
+		return ApngError::ArgumentError;
+	}
+
+	EditSource *source = new (std::nothrow) EditSource();
+	if (!source) {
+		return ApngError::MemoryError;
+	}
+	ApngError err = load_source(fileName, source);
+	vector<EditFrame> frames;
+	if (err == ApngError::Success && (source->Reader.BitDepth != 8 || source->Reader.ColorType != 6 || source->Reader.Interlace != 0)) {
+		err = ApngError::FormatError;
+	}
+	if (err == ApngError::Success) {
+		add_frames(*source, 0, (int)source->FrameStreams.size(), frames);
+		err = plan_edit(frames, true);
+	}
+	AppendTarget *target = NULL;
+	if (err == ApngError::Success) {
+		target = new (std::nothrow) AppendTarget();
+		err = target ? ApngError::Success : ApngError::MemoryError;
+	}
+	if (err == ApngError::Success) {
+		target->File = fileName;
+		err = create_temp(target->File, &target->Temp) ? ApngError::Success : ApngError::FileError;
+	}
+	if (err == ApngError::Success) {
+		err = apng_init(&target->Temp[0], source->Reader.Width, source->Reader.Height, ppEnc);
+	}
+	if (err != ApngError::Success) {
+		if (target && !target->Temp.empty()) {
+			remove_file(target->Temp.c_str());
+		}
+		delete source;
+		delete target;
+		return err;
+	}
+	(*ppEnc)->appendTo = source;
+	(*ppEnc)->appendTarget = target;
+	return ApngError::Success;
+}
+
+/* The frames of the file apng_open_append read, in place of write_header. */
+ApngError write_appended(ApngEncoder *pEnc)
+{
+	EditSource *source = pEnc->appendTo;
+	pEnc->appendTo = NULL;
+
+	vector<EditFrame> frames;
+	add_frames(*source, 0, (int)source->FrameStreams.size(), frames);
+	ApngError err = plan_edit(frames, true);
+	if (err == ApngError::Success) {
+		write_edit(pEnc, frames, false);
+		err = alloc_buffers(pEnc);
+	}
+	delete source;
+	return err;
+}
+
+void destroy_append_source(ApngEncoder *pEnc)
+{
+	if (pEnc->appendTo) {
+		delete pEnc->appendTo;
+		pEnc->appendTo = NULL;
+	}
+}
+
+/* apng_write_end: closes the temp file and renames it over the original,
+ * unless writing it failed; the original then stays. */
+ApngError finish_append(ApngEncoder *pEnc)
+{
+	ApngError err = pEnc->deferredError;
+	if (ferror(pEnc->hFile)) {
+		err = ApngError::FileError;
+	}
+	if (fclose(pEnc->hFile)) {
+		err = ApngError::FileError;
+	}
+	pEnc->hFile = NULL;
+	if (err == ApngError::Success && !replace_file(pEnc->appendTarget->Temp.c_str(), pEnc->appendTarget->File.c_str())) {
+		err = ApngError::FileError;
+	}
+	destroy_append_target(pEnc);
+	return err;
+}
+
+//the temp file goes, the original stays as it was
+void destroy_append_target(ApngEncoder *pEnc)
+{
+	if (!pEnc->appendTarget) {
+		return;
+	}
+	if (pEnc->hFile) {
+		fclose(pEnc->hFile);
+		pEnc->hFile = NULL;
+	}
+	remove_file(pEnc->appendTarget->Temp.c_str());
+	delete pEnc->appendTarget;
+	pEnc->appendTarget = NULL;
+}
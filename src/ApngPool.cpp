@@ -0,0 +1,98 @@
+#include <mutex>
+#include <vector>
+#include "libapngInternal.h"
+
+using namespace std;
+
+/* Idle encoders for apng_acquire. apng_reset keeps their buffers and trial
+ * streams, so a job encoding many small files pays the setup once per
+ * encoder instead of once per file. */
+
+//idle encoders kept, past that apng_release destroys them
+static const size_t EncoderPoolSize = 8;
+
+class EncoderPool
+{
+public:
+	~EncoderPool()
+	{
+		for (size_t i = 0; i < idle.size(); i++) {
+			apng_destroy(&idle[i]);
+		}
+	}
+
+	ApngEncoder *Take()
+	{
+		lock_guard<mutex> lock(sync);
+		if (idle.empty()) {
+			return NULL;
+		}
+		ApngEncoder *pEnc = idle.back();
+		idle.pop_back();
+		return pEnc;
+	}
+
+	//false when full
+	bool Give(ApngEncoder *pEnc)
+	{
+		lock_guard<mutex> lock(sync);
+		if (idle.size() >= EncoderPoolSize) {
+			return false;
+		}
+		idle.push_back(pEnc);
+		return true;
+	}
+
+private:
+	mutex sync;
+	vector<ApngEncoder *> idle;
+};
+
+static EncoderPool pool;
+
+APNG_API(ApngError) apng_acquire(wchar_t *fileName, int width, int height, ApngEncoder **ppEnc)
+{
+	if (!ppEnc)
+		return ApngError::ArgumentError;
+
+	ApngEncoder *pEnc = pool.Take();
+	if (!pEnc) {
+		return apng_init(fileName, width, height, ppEnc);
+	}
+
+	reset_options(pEnc);
+	ApngError err = apng_reset(pEnc, fileName, width, height);
+	if (err != ApngError::Success) {
+		apng_release(&pEnc);
+		return err;
+	}
+	*ppEnc = pEnc;
+	return ApngError::Success;
+}
+
+APNG_API(void) apng_release(ApngEncoder **ppEnc)
+{
+	if (!ppEnc || !*ppEnc)
+		return;
+
+	ApngEncoder *pEnc = *ppEnc;
+	*ppEnc = NULL;
+	destroy_ring(pEnc);
+	destroy_append_target(pEnc);
+	if (pEnc->hFile) {
+		fclose(pEnc->hFile);
+		pEnc->hFile = NULL;
+	}
+	//the frames of a deferred encode that never ended
+	if (pEnc->capture) {
+		delete pEnc->capture;
+		pEnc->capture = NULL;
+	}
+	//an idle encoder does not keep the quantizer cubes
+	if (pEnc->arena) {
+		pEnc->arena->Trim(arena_bytes(pEnc, false));
+	}
+	if (!pool.Give(pEnc)) {
+		apng_destroy(&pEnc);
+	}
+}
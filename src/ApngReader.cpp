@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libapngInternal.h"
+#include "ApngReader.h"
+
+#ifdef APNG_SSE2
+#include <emmintrin.h>
+#endif
+
+static unsigned int load_uint32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+bool is_chunk(const ApngChunk &chunk, const char *type)
+{
+	return memcmp(chunk.Type, type, 4) == 0;
+}
+
+ApngReader::ApngReader() :
+	Width(0),
+	Height(0),
+	BitDepth(0),
+	ColorType(0),
+	Interlace(0)
+{
+}
+
+ApngError ApngReader::Load(const wchar_t *fileName)
+{
+	FILE *f = open_file(fileName, "rb");
+	if (!f) {
+		return ApngError::FileError;
+	}
+
+	vector<unsigned char> file;
+	long length = -1;
+	if (!fseek(f, 0, SEEK_END)) {
+		length = ftell(f);
+	}
+	if (length > 0 && !fseek(f, 0, SEEK_SET)) {
+		file.resize(length);
+		if (fread(&file[0], 1, length, f) != (size_t)length) {
+			length = -1;
+		}
+	}
+	fclose(f);
+
+	if (length <= 0) {
+		return ApngError::FileError;
+	}
+	return Load(&file[0], file.size());
+}
+
+ApngError ApngReader::Load(const unsigned char *data, size_t length)
+{
+	static const unsigned char png_sign[8] = { 137,  80,  78,  71,  13,  10,  26,  10 };
+	if (length < 8 || memcmp(data, png_sign, 8) != 0) {
+		return ApngError::FormatError;
+	}
+
+	Chunks.clear();
+	Streams.clear();
+	FrameControls.clear();
+
+	size_t pos = 8;
+	bool seenIEND = false;
+	while (!seenIEND && pos + 12 <= length) {
+		unsigned int size = load_uint32(data + pos);
+		if (size > length - pos - 12) {
+			return ApngError::FormatError;
+		}
+		const unsigned char *type = data + pos + 4;
+		const unsigned char *body = data + pos + 8;
+		unsigned int crc = (unsigned int)crc32(0, type, size + 4);
+		if (crc != load_uint32(body + size)) {
+			return ApngError::FormatError;
+		}
+
+		ApngChunk chunk;
+		memcpy(chunk.Type, type, 4);
+		chunk.Data.assign(body, body + size);
+		Chunks.push_back(chunk);
+		int index = (int)Chunks.size() - 1;
+		pos += 12 + size;
+
+		if (is_chunk(chunk, "IHDR")) {
+			if (size != 13) {
+				return ApngError::FormatError;
+			}
+			Width = load_uint32(body);
+			Height = load_uint32(body + 4);
+			BitDepth = body[8];
+			ColorType = body[9];
+			Interlace = body[12];
+		}
+		else if (is_chunk(chunk, "fcTL")) {
+			if (size != 26) {
+				return ApngError::FormatError;
+			}
+			FrameControls.push_back(index);
+		}
+		else if (is_chunk(chunk, "IDAT") || is_chunk(chunk, "fdAT")) {
+			bool idat = is_chunk(chunk, "IDAT");
+			unsigned int skip = idat ? 0 : 4;
+			if (size < skip) {
+				return ApngError::FormatError;
+			}
+
+			//a default image drawn as frame 0 has its fcTL before the IDATs
+			int frame = idat && (FrameControls.empty() || FrameControls.size() > 1) ? -1 : (int)FrameControls.size() - 1;
+			if (!idat && frame < 0) {
+				return ApngError::FormatError;
+			}
+			bool sameStream = !Streams.empty()
+				&& Streams.back().Frame == frame
+				&& is_chunk(Chunks[Streams.back().FirstChunk], idat ? "IDAT" : "fdAT");
+			if (!sameStream) {
+				ApngImageStream stream;
+				stream.FirstChunk = index;
+				stream.Frame = frame;
+				stream.Width = Width;
+				stream.Height = Height;
+				if (frame >= 0) {
+					const vector<unsigned char> &fcTL = Chunks[FrameControls[frame]].Data;
+					stream.Width = load_uint32(&fcTL[4]);
+					stream.Height = load_uint32(&fcTL[8]);
+				}
+				Streams.push_back(stream);
+			}
+			Streams.back().Data.insert(Streams.back().Data.end(), body + skip, body + size);
+		}
+		else if (is_chunk(chunk, "IEND")) {
+			seenIEND = true;
+		}
+	}
+
+	if (!seenIEND || Width <= 0 || Height <= 0 || Streams.empty()) {
+		return ApngError::FormatError;
+	}
+	for (size_t i = 0; i < Streams.size(); i++) {
+		if (Streams[i].Width <= 0 || Streams[i].Height <= 0) {
+			return ApngError::FormatError;
+		}
+	}
+	return ApngError::Success;
+}
+
+int ApngReader::Channels() const
+{
+	switch (ColorType) {
+	case 2: return 3;
+	case 4: return 2;
+	case 6: return 4;
+	default: return 1;
+	}
+}
+
+int ApngReader::FilterBpp() const
+{
+	int bits = Channels() * BitDepth;
+	return bits < 8 ? 1 : bits / 8;
+}
+
+size_t ApngReader::RowBytes(int width) const
+{
+	return ((size_t)width * Channels() * BitDepth + 7) / 8;
+}
+
+ApngError ApngReader::Inflate(const ApngImageStream &stream, unsigned char *raw) const
+{
+	size_t expected = (RowBytes(stream.Width) + 1) * stream.Height;
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		return ApngError::MemoryError;
+	}
+
+	zs.next_in = (Bytef *)(stream.Data.empty() ? NULL : &stream.Data[0]);
+	zs.avail_in = (uInt)stream.Data.size();
+	zs.next_out = raw;
+	zs.avail_out = (uInt)expected;
+	int r = inflate(&zs, Z_FINISH);
+	size_t got = expected - zs.avail_out;
+	inflateEnd(&zs);
+
+	return r == Z_STREAM_END && got == expected ? ApngError::Success : ApngError::FormatError;
+}
+
+#ifdef APNG_SSE2
+/* kernels for 3 and 4 byte pixels, one pixel per step in the low lanes;
+ * the scalar loops below handle every other pixel size */
+template<int Bpp>
+static inline __m128i load_pixel(const unsigned char *p)
+{
+	int v = 0;
+	memcpy(&v, p, Bpp);
+	return _mm_cvtsi32_si128(v);
+}
+
+template<int Bpp>
+static inline void store_pixel(unsigned char *p, __m128i v)
+{
+	int x = _mm_cvtsi128_si32(v);
+	memcpy(p, &x, Bpp);
+}
+
+template<int Bpp>
+static void unfilter_sub_sse2(unsigned char *row, size_t rowbytes)
+{
+	__m128i a = _mm_setzero_si128();
+	for (size_t i = 0; i + Bpp <= rowbytes; i += Bpp) {
+		a = _mm_add_epi8(a, load_pixel<Bpp>(row + i));
+		store_pixel<Bpp>(row + i, a);
+	}
+}
+
+template<int Bpp>
+static void unfilter_avg_sse2(unsigned char *row, const unsigned char *prev, size_t rowbytes)
+{
+	//pavgb rounds up, the filter rounds down
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	for (size_t i = 0; i + Bpp <= rowbytes; i += Bpp) {
+		__m128i b = load_pixel<Bpp>(prev + i);
+		__m128i avg = _mm_avg_epu8(a, b);
+		avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), ones));
+		a = _mm_add_epi8(load_pixel<Bpp>(row + i), avg);
+		store_pixel<Bpp>(row + i, a);
+	}
+}
+
+static inline __m128i abs_epi16(__m128i x)
+{
+	__m128i negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+	return _mm_add_epi16(_mm_xor_si128(x, negative), _mm_srli_epi16(negative, 15));
+}
+
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+template<int Bpp>
+static void unfilter_paeth_sse2(unsigned char *row, const unsigned char *prev, size_t rowbytes)
+{
+	//16-bit lanes, the predictor distances need 9 bits and a sign
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero, c, d = zero;
+	for (size_t i = 0; i + Bpp <= rowbytes; i += Bpp) {
+		c = b;
+		b = _mm_unpacklo_epi8(load_pixel<Bpp>(prev + i), zero);
+		a = d;
+		d = _mm_unpacklo_epi8(load_pixel<Bpp>(row + i), zero);
+
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = _mm_add_epi16(pa, pb);
+		pa = abs_epi16(pa);
+		pb = abs_epi16(pb);
+		pc = abs_epi16(pc);
+		__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		__m128i nearest = select_si128(_mm_cmpeq_epi16(smallest, pa), a,
+			select_si128(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+		d = _mm_add_epi8(d, nearest);
+		store_pixel<Bpp>(row + i, _mm_packus_epi16(d, d));
+	}
+}
+#endif
+
+ApngError unfilter_row(int type, unsigned char *row, const unsigned char *prev, size_t rowbytes, int bpp)
+{
+	//the row above is zero for the first row
+	switch (type) {
+	case 0:
+		break;
+	case 1:
+#ifdef APNG_SSE2
+		if (bpp == 4) {
+			unfilter_sub_sse2<4>(row, rowbytes);
+			break;
+		}
+		if (bpp == 3) {
+			unfilter_sub_sse2<3>(row, rowbytes);
+			break;
+		}
+#endif
+		for (size_t i = bpp; i < rowbytes; i++) {
+			row[i] += row[i - bpp];
+		}
+		break;
+	case 2:
+		if (prev) {
+			size_t i = 0;
+#ifdef APNG_SSE2
+			for (; i + 16 <= rowbytes; i += 16) {
+				__m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+				_mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+			}
+#endif
+			for (; i < rowbytes; i++) {
+				row[i] += prev[i];
+			}
+		}
+		break;
+	case 3:
+#ifdef APNG_SSE2
+		if (prev && bpp == 4) {
+			unfilter_avg_sse2<4>(row, prev, rowbytes);
+			break;
+		}
+		if (prev && bpp == 3) {
+			unfilter_avg_sse2<3>(row, prev, rowbytes);
+			break;
+		}
+#endif
+		for (size_t i = 0; i < (size_t)bpp && i < rowbytes; i++) {
+			row[i] += (prev ? prev[i] : 0) / 2;
+		}
+		for (size_t i = bpp; i < rowbytes; i++) {
+			row[i] += ((prev ? prev[i] : 0) + row[i - bpp]) / 2;
+		}
+		break;
+	case 4:
+#ifdef APNG_SSE2
+		if (prev && bpp == 4) {
+			unfilter_paeth_sse2<4>(row, prev, rowbytes);
+			break;
+		}
+		if (prev && bpp == 3) {
+			unfilter_paeth_sse2<3>(row, prev, rowbytes);
+			break;
+		}
+#endif
+		for (size_t i = 0; i < (size_t)bpp && i < rowbytes; i++) {
+			row[i] += prev ? prev[i] : 0;
+		}
+		for (size_t i = bpp; i < rowbytes; i++) {
+			int a, b, c, pa, pb, pc, p;
+
+			a = row[i - bpp];
+			b = prev ? prev[i] : 0;
+			c = prev ? prev[i - bpp] : 0;
+			p = b - c;
+			pc = a - c;
+			pa = abs(p);
+			pb = abs(pc);
+			pc = abs(p + pc);
+			p = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+			row[i] += p;
+		}
+		break;
+	default:
+		return ApngError::FormatError;
+	}
+	return ApngError::Success;
+}
+
+ApngError unfilter_rows(unsigned char *raw, size_t rowbytes, int height, int bpp)
+{
+	unsigned char *prev = NULL;
+	for (int y = 0; y < height; y++) {
+		unsigned char *row = raw + y * (rowbytes + 1) + 1;
+		ApngError err = unfilter_row(row[-1], row, prev, rowbytes, bpp);
+		if (err != ApngError::Success) {
+			return err;
+		}
+		prev = row;
+	}
+	return ApngError::Success;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "libapng.h"
+
+using namespace std;
+
+struct ApngChunk {
+	char Type[4];
+	vector<unsigned char> Data;
+};
+
+/* The compressed data of one image: the IDAT chunks, or the fdAT chunks of
+ * one frame without their sequence numbers. Frame is the fcTL index, -1 for
+ * a default image that is not part of the animation. */
+struct ApngImageStream {
+	int FirstChunk;
+	int Frame;
+	int Width;
+	int Height;
+	vector<unsigned char> Data;
+};
+
+/* An APNG (or plain PNG) file split into its chunks, with the CRCs checked
+ * and the image streams gathered. */
+class ApngReader
+{
+public:
+	ApngReader();
+
+	ApngError Load(const wchar_t *fileName);
+	ApngError Load(const unsigned char *data, size_t length);
+
+	int Width;
+	int Height;
+	int BitDepth;
+	int ColorType;
+	int Interlace;
+	vector<ApngChunk> Chunks;
+	vector<ApngImageStream> Streams;
+	vector<int> FrameControls; //chunk index of each fcTL
+
+	int Channels() const;
+	//bytes per complete pixel for the filters, at least 1
+	int FilterBpp() const;
+	size_t RowBytes(int width) const;
+	//inflates a stream into (RowBytes + 1) * Height filtered bytes
+	ApngError Inflate(const ApngImageStream &stream, unsigned char *raw) const;
+};
+
+bool is_chunk(const ApngChunk &chunk, const char *type);
+//reverses the filter of one row in place, prev is NULL for the first row
+ApngError unfilter_row(int type, unsigned char *row, const unsigned char *prev, size_t rowbytes, int bpp);
+//reverses the png row filters in place; raw holds height rows of a type byte and rowbytes of data
+ApngError unfilter_rows(unsigned char *raw, size_t rowbytes, int height, int bpp);
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libapngInternal.h"
+#include "ApngReader.h"
+
+#if defined(OPENMP) && defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/* Recompression of an existing file: every image stream is inflated and
+ * unfiltered, then filtered and deflated again trying no filtering and the
+ * min-SAD, entropy and deflate-cost filter choices, each with the default
+ * and the filtered strategy at level 9 and the largest memLevel. The
+ * smallest result is kept, the original stream when nothing beats it. All
+ * other chunks are copied, fcTL/fdAT sequence numbers and CRCs are
+ * rewritten. */
+
+static ApngError recompress_stream(ApngEncoder *worker, const ApngReader &reader, const ApngImageStream &stream, vector<unsigned char> &encoded)
+{
+	static const int strategies[2] = { Z_DEFAULT_STRATEGY, Z_FILTERED };
+	static const FilterStrategy choices[3] = { FilterStrategy::MinSad, FilterStrategy::Entropy, FilterStrategy::Deflate };
+	size_t rowbytes = reader.RowBytes(stream.Width);
+	int bpp = reader.FilterBpp();
+	unsigned int length = (unsigned int)((rowbytes + 1) * stream.Height);
+
+	worker->arena->Reset();
+	unsigned char *raw = (unsigned char *)worker->arena->Alloc(length);
+	if (!raw) {
+		return ApngError::MemoryError;
+	}
+
+	ApngError err = reader.Inflate(stream, raw);
+	if (err == ApngError::Success) {
+		err = unfilter_rows(raw, rowbytes, stream.Height, bpp);
+	}
+
+	if (err == ApngError::Success) {
+		//the unfiltered rows stay in place, behind their type bytes
+		BitmapData image;
+		image.Width = (int)(rowbytes / bpp);
+		image.Height = stream.Height;
+		image.Stride = (int)rowbytes + 1;
+		image.bpp = bpp;
+		image.Scan0 = raw + 1;
+
+		encoded = stream.Data;
+		for (int pass = 0; pass < 4; pass++) {
+			if (pass > 0) {
+				//each choice filters every row itself, not from the memo of another
+				worker->filterStrategy = (int)choices[pass - 1];
+				worker->rowMemo->Clear();
+			}
+			filter_rows(worker, &image, pass > 0);
+			for (int s = 0; s < 2; s++) {
+				unsigned int zsize;
+				deflate_rows(worker, worker->dest, length, Z_BEST_COMPRESSION, 9, strategies[s], &zsize);
+				if (zsize < encoded.size()) {
+					encoded.assign(worker->zbuf, worker->zbuf + zsize);
+				}
+			}
+		}
+	}
+	return err;
+}
+
+static ApngError write_recompressed(ApngEncoder *writer, const ApngReader &reader, vector<vector<unsigned char> > &encoded)
+{
+	static const unsigned char png_sign[8] = { 137,  80,  78,  71,  13,  10,  26,  10 };
+	fwrite(png_sign, 1, 8, writer->hFile);
+
+	size_t stream = 0;
+	for (size_t i = 0; i < reader.Chunks.size(); i++) {
+		ApngChunk chunk = reader.Chunks[i];
+		unsigned char *data = chunk.Data.empty() ? NULL : &chunk.Data[0];
+
+		if (is_chunk(chunk, "IDAT") || is_chunk(chunk, "fdAT")) {
+			if (stream < reader.Streams.size() && reader.Streams[stream].FirstChunk == (int)i) {
+				const ApngImageStream &image = reader.Streams[stream];
+				unsigned int idat_size = (unsigned int)((reader.RowBytes(image.Width) + 1) * image.Height);
+
+				//write_IDATs picks IDAT for frame 0
+				writer->frameCount = is_chunk(chunk, "IDAT") ? 0 : 1;
+				write_IDATs(writer, &encoded[stream][0], (unsigned int)encoded[stream].size(), idat_size);
+				stream++;
+			}
+		}
+		else {
+			if (is_chunk(chunk, "fcTL")) {
+				png_save_uint_32(data, writer->seqIndex++);
+			}
+			write_chunk(writer, chunk.Type, data, (unsigned int)chunk.Data.size());
+		}
+	}
+
+	return ferror(writer->hFile) ? ApngError::FileError : ApngError::Success;
+}
+
+APNG_API(ApngError) apng_recompress(wchar_t *srcFileName, wchar_t *dstFileName, ApngStats *pStats)
+{
+	ApngReader reader;
+	ApngError err = reader.Load(srcFileName);
+	int count = 0, threads = 1;
+	size_t maxRowbytes = 0;
+	int maxHeight = 0;
+	vector<vector<unsigned char> > encoded;
+	vector<ApngError> errors;
+	vector<ApngEncoder *> workers;
+	ApngEncoder *writer = NULL;
+
+	if (err != ApngError::Success) {
+		return err;
+	}
+	if (reader.Interlace != 0) {
+		return ApngError::FormatError;
+	}
+
+	count = (int)reader.Streams.size();
+	for (int i = 0; i < count; i++) {
+		size_t rowbytes = reader.RowBytes(reader.Streams[i].Width);
+		if (rowbytes > maxRowbytes) maxRowbytes = rowbytes;
+		if (reader.Streams[i].Height > maxHeight) maxHeight = reader.Streams[i].Height;
+	}
+
+#if defined(OPENMP) && defined(_OPENMP)
+	threads = omp_get_max_threads() < count ? omp_get_max_threads() : count;
+#endif
+	workers.assign(threads, NULL);
+	for (int t = 0; t < threads; t++) {
+		workers[t] = (ApngEncoder *)calloc(1, sizeof(ApngEncoder));
+		if (!workers[t]) {
+			err = ApngError::MemoryError;
+			goto __end;
+		}
+		err = alloc_buffers(workers[t], (unsigned int)maxRowbytes, maxHeight);
+		if (err != ApngError::Success) {
+			goto __end;
+		}
+	}
+
+	encoded.resize(count);
+	errors.assign(count, ApngError::Success);
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+	for (int i = 0; i < count; i++) {
+		int t = 0;
+#if defined(OPENMP) && defined(_OPENMP)
+		t = omp_get_thread_num();
+#endif
+		errors[i] = recompress_stream(workers[t], reader, reader.Streams[i], encoded[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (errors[i] != ApngError::Success) {
+			err = errors[i];
+			goto __end;
+		}
+	}
+
+	writer = (ApngEncoder *)calloc(1, sizeof(ApngEncoder));
+	if (!writer) {
+		err = ApngError::MemoryError;
+		goto __end;
+	}
+	if (!(writer->hFile = open_file(dstFileName, "wb"))) {
+		err = ApngError::FileError;
+		goto __end;
+	}
+	err = write_recompressed(writer, reader, encoded);
+
+	if (pStats) {
+		memset(pStats, 0, sizeof(ApngStats));
+		pStats->frames = (int)reader.FrameControls.size();
+		pStats->bytes = ftell(writer->hFile);
+		for (int t = 0; t < threads; t++) {
+			pStats->arenaReused += workers[t]->arena->ReusedBytes();
+			pStats->arenaAllocated += workers[t]->arena->AllocatedBytes();
+		}
+	}
+
+__end:
+	for (int t = 0; t < threads; t++) {
+		apng_destroy(&workers[t]);
+	}
+	apng_destroy(&writer);
+	return err;
+}
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include "libapngInternal.h"
+
+#if defined(OPENMP) && defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/* Parallel trials: the unfiltered and the filtered rows are laid out first,
+ * then each trial stream deflates its copy on its own thread. In mode 2 the
+ * final pass for the filter choice of the previous frame runs on a third
+ * thread, and deflate_rect_fin keeps its stream when the trials pick the
+ * same. The streams see the same bytes as in deflate_rect_op, so the output
+ * does not change. */
+
+/* feeds the rows in blocks, false once out of time */
+static bool deflate_trial(z_stream *stream, unsigned char *rows, unsigned int length, unsigned char *out, unsigned int outSize, const Deadline &deadline)
+{
+	const unsigned int block = 64 * 1024;
+	stream->data_type = Z_BINARY;
+	stream->next_out = out;
+	stream->avail_out = outSize;
+	stream->next_in = rows;
+	for (unsigned int offset = 0; offset < length; offset += block)
+	{
+		if (deadline.Expired())
+		{
+			return false;
+		}
+		stream->avail_in = length - offset < block ? length - offset : block;
+		deflate(stream, Z_NO_FLUSH);
+	}
+	deflate(stream, Z_FINISH);
+	return true;
+}
+
+/* deflate_rect_op on threads; false when the mode is off or the caller
+ * already runs in a parallel region, nothing is done then */
+bool parallel_trials(ApngEncoder *pEnc, BitmapData *image, bool *filter, unsigned int *estimate)
+{
+#if defined(OPENMP) && defined(_OPENMP)
+	if (!pEnc->parallelTrials || omp_in_parallel())
+	{
+		return false;
+	}
+
+	Deadline deadline = encode_deadline(pEnc);
+	int rowbytes = image->Width * image->bpp;
+	unsigned int length = image->Height * (rowbytes + 1);
+
+	//unfiltered rows for the first stream, the min-SAD rows in dest for the second
+	unsigned char *dp = pEnc->trial_rows;
+	for (int y = 0; y < image->Height; y++)
+	{
+		*dp++ = 0;
+		memcpy(dp, (unsigned char *)image->Scan0 + y * image->Stride, rowbytes);
+		dp += rowbytes;
+	}
+	if (!process_rect(pEnc, image, pEnc->dest) || deadline.Expired())
+	{
+		pEnc->degraded = true;
+		*filter = false;
+		return true;
+	}
+
+	bool predicted = pEnc->lastFilter;
+	bool speculate = pEnc->parallelTrials > 1;
+	bool complete1 = false, complete2 = false;
+	unsigned int specSize = 0;
+	ApngError specErr = ApngError::Success;
+#pragma omp parallel sections num_threads(speculate ? 3 : 2)
+	{
+#pragma omp section
+		{
+			complete1 = deflate_trial(&pEnc->op_zstream1, pEnc->trial_rows, length, pEnc->trial_zbuf, pEnc->zbuf_size, deadline);
+		}
+#pragma omp section
+		{
+			complete2 = deflate_trial(&pEnc->op_zstream2, pEnc->dest, length, pEnc->trial_zbuf + pEnc->zbuf_size, pEnc->zbuf_size, deadline);
+		}
+#pragma omp section
+		{
+			if (speculate)
+			{
+				specErr = deflate_rows(pEnc, predicted ? pEnc->dest : pEnc->trial_rows, length, Z_BEST_COMPRESSION, 8,
+					predicted ? Z_FILTERED : Z_DEFAULT_STRATEGY, &specSize);
+			}
+		}
+	}
+
+	bool complete = complete1 && complete2;
+	if (!complete)
+	{
+		pEnc->degraded = true;
+	}
+	if (complete && estimate)
+	{
+		*estimate = (unsigned int)std::min(pEnc->op_zstream1.total_out, pEnc->op_zstream2.total_out);
+	}
+	*filter = complete && pEnc->op_zstream1.total_out >= pEnc->op_zstream2.total_out;
+	deflateReset(&pEnc->op_zstream1);
+	deflateReset(&pEnc->op_zstream2);
+
+	if (complete)
+	{
+		pEnc->lastFilter = *filter;
+	}
+	if (speculate && specErr == ApngError::Success && predicted == *filter)
+	{
+		pEnc->speculated = true;
+		pEnc->speculatedSize = specSize;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "libapngInternal.h"
+#include "CaptureRing.h"
+
+using namespace std;
+
+//Slot::Delay of a frame the encoder has taken, too late to merge into
+static const int Claimed = -1;
+//a sleeping side also wakes on its own after this long
+static const int WaitMs = 50;
+
+CaptureRing::CaptureRing(ApngEncoder *pEnc, RingPolicy policy) :
+	pEnc(pEnc),
+	policy(policy),
+	slotCount(0),
+	stride(pEnc->width * 4),
+	slotBytes((size_t)pEnc->width * 4 * pEnc->height),
+	pixels(NULL),
+	slots(NULL),
+	ready(NULL),
+	readyHead(0),
+	readyTail(0),
+	freeIds(NULL),
+	freeHead(0),
+	freeTail(0),
+	held(-1),
+	last(-1),
+	carried(0),
+	dropped(0),
+	error((int)ApngError::Success),
+	stopping(false),
+	encoderWaiting(false),
+	captureWaiting(false),
+	statsError(ApngError::Success),
+	running(false)
+{
+}
+
+CaptureRing::~CaptureRing()
+{
+	//the frames left are not encoded
+	int expected = (int)ApngError::Success;
+	error.compare_exchange_strong(expected, (int)ApngError::Cancelled);
+	Stop();
+	free(pixels);
+	delete[] slots;
+	delete[] ready;
+	delete[] freeIds;
+}
+
+ApngError CaptureRing::Start(int slotCount)
+{
+	this->slotCount = slotCount;
+	int scratch = policy == RingPolicy::MergeDelay ? 1 : 0;
+	pixels = (unsigned char *)malloc((slotCount + scratch) * slotBytes);
+	slots = new (std::nothrow) Slot[slotCount];
+	ready = new (std::nothrow) atomic<int>[slotCount];
+	freeIds = new (std::nothrow) int[slotCount];
+	if (!pixels || !slots || !ready || !freeIds) {
+		return ApngError::MemoryError;
+	}
+
+	for (int i = 0; i < slotCount; i++) {
+		slots[i].Delay.store(Claimed, memory_order_relaxed);
+		slots[i].Optimize = false;
+		ready[i].store(-1, memory_order_relaxed);
+		freeIds[i] = i;
+	}
+	freeHead.store(slotCount);
+	collect_stats(pEnc, &stats);
+	statsError = pEnc->deferredError;
+
+	try {
+		worker = thread(&CaptureRing::Drain, this);
+	}
+	catch (...) {
+		return ApngError::ContextCreateFailed;
+	}
+	running = true;
+	return ApngError::Success;
+}
+
+/* The oldest committed slot; the capture side calls it too, for
+ * DropOldest, and the compare-and-swap decides who gets it. */
+bool CaptureRing::PopReady(int *id)
+{
+	long long tail = readyTail.load(memory_order_acquire);
+	for (;;) {
+		if (tail >= readyHead.load(memory_order_acquire)) {
+			return false;
+		}
+		int value = ready[tail % slotCount].load(memory_order_relaxed);
+		if (readyTail.compare_exchange_weak(tail, tail + 1, memory_order_acq_rel, memory_order_acquire)) {
+			*id = value;
+			return true;
+		}
+	}
+}
+
+//never more slots committed than there are, the queue cannot overflow
+void CaptureRing::PushReady(int id)
+{
+	long long head = readyHead.load(memory_order_relaxed);
+	ready[head % slotCount].store(id, memory_order_relaxed);
+	readyHead.store(head + 1, memory_order_seq_cst);
+	if (encoderWaiting.load(memory_order_seq_cst)) {
+		lock_guard<mutex> lock(sync);
+		readyCv.notify_one();
+	}
+}
+
+bool CaptureRing::PopFree(int *id)
+{
+	long long tail = freeTail.load(memory_order_relaxed);
+	if (tail >= freeHead.load(memory_order_acquire)) {
+		return false;
+	}
+	*id = freeIds[tail % slotCount];
+	freeTail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+void CaptureRing::PushFree(int id)
+{
+	long long head = freeHead.load(memory_order_relaxed);
+	freeIds[head % slotCount] = id;
+	freeHead.store(head + 1, memory_order_seq_cst);
+	if (captureWaiting.load(memory_order_seq_cst)) {
+		lock_guard<mutex> lock(sync);
+		freeCv.notify_one();
+	}
+}
+
+/* The flag is set before the queue is checked again under the mutex and
+ * the other side reads it after publishing, so a wake-up is not lost. */
+void CaptureRing::WaitReady()
+{
+	unique_lock<mutex> lock(sync);
+	encoderWaiting.store(true, memory_order_seq_cst);
+	if (readyTail.load(memory_order_seq_cst) >= readyHead.load(memory_order_seq_cst) && !stopping.load(memory_order_seq_cst)) {
+		readyCv.wait_for(lock, chrono::milliseconds(WaitMs));
+	}
+	encoderWaiting.store(false, memory_order_relaxed);
+}
+
+void CaptureRing::WaitFree()
+{
+	unique_lock<mutex> lock(sync);
+	captureWaiting.store(true, memory_order_seq_cst);
+	if (freeTail.load(memory_order_relaxed) >= freeHead.load(memory_order_seq_cst)) {
+		freeCv.wait_for(lock, chrono::milliseconds(WaitMs));
+	}
+	captureWaiting.store(false, memory_order_relaxed);
+}
+
+/* DropOldest: the delay of a frame taken back goes to the frame after it,
+ * the oldest still queued, the way MergeDelay adds to the one before. Once
+ * the encoder has claimed that frame the next one is tried; with none left
+ * it waits for the next commit. */
+void CaptureRing::PassDelay(int delay)
+{
+	for (;;) {
+		long long tail = readyTail.load(memory_order_acquire);
+		if (tail >= readyHead.load(memory_order_relaxed)) {
+			carried += delay;
+			return;
+		}
+		//only this side pushes, so the id at tail stays put
+		int id = ready[tail % slotCount].load(memory_order_relaxed);
+		int value = slots[id].Delay.load(memory_order_relaxed);
+		while (value != Claimed) {
+			if (slots[id].Delay.compare_exchange_weak(value, value + delay, memory_order_relaxed)) {
+				return;
+			}
+		}
+	}
+}
+
+ApngError CaptureRing::Acquire(void **ppData)
+{
+	if (held >= 0) {
+		return ApngError::ArgumentError;
+	}
+	ApngError err = (ApngError)error.load(memory_order_relaxed);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	int id;
+	for (;;) {
+		if (PopFree(&id)) {
+			break;
+		}
+		if (policy == RingPolicy::DropOldest && PopReady(&id)) {
+			//popped here, the encoder never claims it
+			PassDelay(slots[id].Delay.load(memory_order_relaxed));
+			dropped.fetch_add(1, memory_order_relaxed);
+			break;
+		}
+		if (policy == RingPolicy::MergeDelay && last >= 0) {
+			id = slotCount;
+			break;
+		}
+		WaitFree();
+	}
+	held = id;
+	*ppData = pixels + (size_t)id * slotBytes;
+	return ApngError::Success;
+}
+
+ApngError CaptureRing::Commit(int delay_ms, bool optimize)
+{
+	if (held < 0 || delay_ms < 0) {
+		return ApngError::ArgumentError;
+	}
+	int id = held;
+	held = -1;
+	delay_ms += carried;
+	carried = 0;
+
+	if (id == slotCount) {
+		int delay = slots[last].Delay.load(memory_order_relaxed);
+		while (delay != Claimed) {
+			if (slots[last].Delay.compare_exchange_weak(delay, delay + delay_ms, memory_order_relaxed)) {
+				dropped.fetch_add(1, memory_order_relaxed);
+				return (ApngError)error.load(memory_order_relaxed);
+			}
+		}
+		//the encoder took the last frame meanwhile, so the frames before it are done
+		while (!PopFree(&id)) {
+			WaitFree();
+		}
+		memcpy(pixels + (size_t)id * slotBytes, pixels + (size_t)slotCount * slotBytes, slotBytes);
+	}
+
+	slots[id].Optimize = optimize;
+	slots[id].Delay.store(delay_ms, memory_order_relaxed);
+	PushReady(id);
+	last = id;
+	return (ApngError)error.load(memory_order_relaxed);
+}
+
+/* The encoder thread: frames in commit order, the slot goes back to the
+ * capture side once written. After an error the frames are skipped. */
+void CaptureRing::Drain()
+{
+	for (;;) {
+		bool stop = stopping.load(memory_order_seq_cst);
+		int id;
+		if (!PopReady(&id)) {
+			if (stop) {
+				break;
+			}
+			WaitReady();
+			continue;
+		}
+
+		int delay = slots[id].Delay.exchange(Claimed, memory_order_relaxed);
+		if (error.load(memory_order_relaxed) == (int)ApngError::Success) {
+			ApngError err = append_frame(pEnc, pixels + (size_t)id * slotBytes, 0, 0, pEnc->width, pEnc->height, stride, delay, slots[id].Optimize);
+			if (err != ApngError::Success) {
+				error.store((int)err, memory_order_relaxed);
+			}
+			lock_guard<mutex> lock(statsSync);
+			collect_stats(pEnc, &stats);
+			statsError = pEnc->deferredError;
+		}
+		PushFree(id);
+	}
+}
+
+void CaptureRing::Stop()
+{
+	if (!running) {
+		return;
+	}
+	{
+		lock_guard<mutex> lock(sync);
+		stopping.store(true, memory_order_seq_cst);
+		readyCv.notify_one();
+	}
+	worker.join();
+	running = false;
+}
+
+ApngError CaptureRing::Stats(ApngStats *pStats)
+{
+	lock_guard<mutex> lock(statsSync);
+	*pStats = stats;
+	pStats->droppedFrames += Dropped();
+	return statsError;
+}
+
+ApngError CaptureRing::Finish()
+{
+	Stop();
+	return (ApngError)error.load(memory_order_relaxed);
+}
+
+void destroy_ring(ApngEncoder *pEnc)
+{
+	if (pEnc->ring) {
+		delete pEnc->ring;
+		pEnc->ring = NULL;
+	}
+}
+
+APNG_API(ApngError) apng_ring_init(ApngEncoder *pEnc, int slots, int policy)
+{
+	if (!pEnc || pEnc->ring || slots < 2 || policy < (int)RingPolicy::Block || policy > (int)RingPolicy::MergeDelay || pEnc->frameCount > 0
+		|| pEnc->capture || pEnc->appendTo || pEnc->appendTarget)
+		return ApngError::ArgumentError;
+
+	pEnc->ring = new (std::nothrow) CaptureRing(pEnc, (RingPolicy)policy);
+	if (!pEnc->ring)
+		return ApngError::MemoryError;
+
+	ApngError err = pEnc->ring->Start(slots);
+	if (err != ApngError::Success) {
+		destroy_ring(pEnc);
+	}
+	return err;
+}
+
+APNG_API(ApngError) apng_ring_acquire(ApngEncoder *pEnc, void **ppData, int *pStride)
+{
+	if (!pEnc || !pEnc->ring || !ppData || !pStride)
+		return ApngError::ArgumentError;
+
+	*pStride = pEnc->ring->Stride();
+	return pEnc->ring->Acquire(ppData);
+}
+
+APNG_API(ApngError) apng_ring_commit(ApngEncoder *pEnc, int delay_ms, bool optimize)
+{
+	if (!pEnc || !pEnc->ring)
+		return ApngError::ArgumentError;
+
+	return pEnc->ring->Commit(delay_ms, optimize);
+}
+
+APNG_API(ApngError) apng_ring_push(ApngEncoder *pEnc, void *pData, int stride, int delay_ms, bool optimize)
+{
+	if (!pEnc || !pEnc->ring || !pData)
+		return ApngError::ArgumentError;
+
+	void *pSlot;
+	ApngError err = pEnc->ring->Acquire(&pSlot);
+	if (err != ApngError::Success) {
+		return err;
+	}
+	int rowbytes = pEnc->width * 4;
+	for (int y = 0; y < pEnc->height; y++) {
+		memcpy((unsigned char *)pSlot + (size_t)y * rowbytes, (const unsigned char *)pData + (size_t)y * stride, rowbytes);
+	}
+	return pEnc->ring->Commit(delay_ms, optimize);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "libapng.h"
+
+/* What a capture ring does when every slot holds a frame not yet encoded. */
+enum struct RingPolicy : int {
+	Block = 0,	//wait for the encoder to free a slot
+	DropOldest = 1,	//the oldest frame not yet encoded gives up its slot, its delay goes to the next frame
+	MergeDelay = 2,	//the new frame is left out and its delay added to the one before
+};
+
+/* Canvas-sized frame slots between one capture thread and a thread that
+ * encodes them. Slot ids pass through two single-producer queues, free
+ * slots to the capture side and committed ones to the encoder; the capture
+ * side may also take back the oldest committed slot, so both sides pop
+ * committed slots with a compare-and-swap. The mutex is only taken to
+ * sleep on an empty queue. Nothing is allocated after Start. */
+class CaptureRing
+{
+public:
+	CaptureRing(ApngEncoder *pEnc, RingPolicy policy);
+	//drops the frames not yet encoded
+	~CaptureRing();
+
+	ApngError Start(int slotCount);
+
+	//capture side: a slot to write one canvas into, then its frame data
+	ApngError Acquire(void **ppData);
+	ApngError Commit(int delay_ms, bool optimize);
+	int Stride() const { return stride; }
+
+	//encodes the committed frames and stops the thread
+	ApngError Finish();
+	//frames dropped or merged
+	int Dropped() const { return dropped.load(std::memory_order_relaxed); }
+	//a copy of the encoder's stats taken after its last frame, and its error
+	ApngError Stats(ApngStats *pStats);
+
+private:
+	struct Slot {
+		std::atomic<int> Delay; //Claimed once the encoder has taken the frame
+		bool Optimize;
+	};
+
+	ApngEncoder *pEnc;
+	RingPolicy policy;
+	int slotCount;
+	int stride;
+	size_t slotBytes;
+	unsigned char *pixels; //slotCount slots, then the scratch slot of MergeDelay
+	Slot *slots;
+	std::atomic<int> *ready;
+	std::atomic<long long> readyHead;
+	std::atomic<long long> readyTail;
+	int *freeIds;
+	std::atomic<long long> freeHead;
+	std::atomic<long long> freeTail;
+	int held; //acquired and not committed, -1 for none
+	int last; //committed last, -1 for none
+	int carried; //delay DropOldest found no queued frame for, added to the next commit
+	std::atomic<int> dropped;
+	std::atomic<int> error;
+	std::atomic<bool> stopping;
+	std::atomic<bool> encoderWaiting;
+	std::atomic<bool> captureWaiting;
+	std::mutex sync;
+	std::condition_variable readyCv;
+	std::condition_variable freeCv;
+	std::mutex statsSync;
+	ApngStats stats;
+	ApngError statsError;
+	std::thread worker;
+	bool running;
+
+	bool PopReady(int *id);
+	void PushReady(int id);
+	bool PopFree(int *id);
+	void PushFree(int id);
+	void PassDelay(int delay);
+	void WaitReady();
+	void WaitFree();
+	void Drain();
+	void Stop();
+
+	CaptureRing(const CaptureRing &);
+	CaptureRing &operator=(const CaptureRing &);
+};
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include "DirtyRegions.h"
+
+//the opaque pixels are found per tile first, the regions are tile-connected
+static const int TileSize = 16;
+//past this many regions the frame goes out as one rect
+static const int MaxComponents = 64;
+//an extra sub-frame costs chunk headers and a fresh deflate stream, counted
+//as the transparent pixels a merged rect may add instead
+static const long long SubFramePixelCost = 64 * 64;
+
+static inline long long rect_area(const DirtyRegions::Rect &r)
+{
+	return (long long)r.Width * r.Height;
+}
+
+static DirtyRegions::Rect rect_union(const DirtyRegions::Rect &a, const DirtyRegions::Rect &b)
+{
+	DirtyRegions::Rect r;
+	r.X = std::min(a.X, b.X);
+	r.Y = std::min(a.Y, b.Y);
+	r.Width = std::max(a.X + a.Width, b.X + b.Width) - r.X;
+	r.Height = std::max(a.Y + a.Height, b.Y + b.Height) - r.Y;
+	return r;
+}
+
+static bool rect_intersects(const DirtyRegions::Rect &a, int x0, int y0, int x1, int y1)
+{
+	return a.X < x1 && a.X + a.Width > x0 && a.Y < y1 && a.Y + a.Height > y0;
+}
+
+DirtyRegions::DirtyRegions(int maxRects) : maxRects(maxRects), tilesX(0)
+{
+}
+
+const vector<DirtyRegions::Rect> &DirtyRegions::Plan(const BitmapData *frame)
+{
+	rects.clear();
+	bounds.X = frame->Width;
+	bounds.Y = frame->Height;
+	bounds.Width = bounds.Height = 0;
+	MarkTiles(frame);
+	FindComponents(frame);
+	Merge();
+
+	if (bounds.Width == 0) {
+		//no opaque pixel, the 1x1 frame get_rect also falls back to
+		Rect r = { 0, 0, 1, 1 };
+		bounds = r;
+	}
+	if (rects.empty()) {
+		rects.push_back(bounds);
+	}
+
+	//the largest rect goes last and is disposed, the others stay on the canvas
+	size_t largest = 0;
+	for (size_t i = 1; i < rects.size(); i++) {
+		if (rect_area(rects[i]) > rect_area(rects[largest])) largest = i;
+	}
+	std::swap(rects[largest], rects.back());
+	left.assign(rects.begin(), rects.end() - 1);
+	return rects;
+}
+
+/* 1 for a tile with an opaque pixel or under a rect left on the canvas */
+void DirtyRegions::MarkTiles(const BitmapData *frame)
+{
+	tilesX = (frame->Width + TileSize - 1) / TileSize;
+	int tilesY = (frame->Height + TileSize - 1) / TileSize;
+	tiles.assign((size_t)tilesX * tilesY, 0);
+
+	for (int y = 0; y < frame->Height; y++) {
+		const unsigned char *pRow = (const unsigned char *)frame->Scan0 + (size_t)y * frame->Stride;
+		unsigned char *t = &tiles[(size_t)(y / TileSize) * tilesX];
+		for (int tx = 0; tx < tilesX; tx++) {
+			if (t[tx]) continue;
+			for (int x = tx * TileSize, x1 = std::min(x + TileSize, frame->Width); x < x1; x++) {
+				if (pRow[x * 4 + 3]) {
+					t[tx] = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < left.size(); i++) {
+		const Rect &r = left[i];
+		for (int ty = r.Y / TileSize; ty <= (r.Y + r.Height - 1) / TileSize; ty++) {
+			for (int tx = r.X / TileSize; tx <= (r.X + r.Width - 1) / TileSize; tx++) {
+				tiles[(size_t)ty * tilesX + tx] = 1;
+			}
+		}
+	}
+}
+
+/* one rect per 8-connected group of marked tiles: the opaque pixels within
+ * its tiles' bounds plus the left rects it holds */
+void DirtyRegions::FindComponents(const BitmapData *frame)
+{
+	int tilesY = tilesX > 0 ? (int)(tiles.size() / tilesX) : 0;
+	for (int start = 0, count = (int)tiles.size(); start < count; start++) {
+		if (tiles[start] != 1) continue;
+
+		int tx0 = start % tilesX, ty0 = start / tilesX, tx1 = tx0, ty1 = ty0;
+		tiles[start] = 2;
+		stack.assign(1, start);
+		while (!stack.empty()) {
+			int tile = stack.back();
+			stack.pop_back();
+			int tx = tile % tilesX, ty = tile / tilesX;
+			tx0 = std::min(tx0, tx);
+			tx1 = std::max(tx1, tx);
+			ty0 = std::min(ty0, ty);
+			ty1 = std::max(ty1, ty);
+			for (int ny = std::max(ty - 1, 0); ny <= std::min(ty + 1, tilesY - 1); ny++) {
+				for (int nx = std::max(tx - 1, 0); nx <= std::min(tx + 1, tilesX - 1); nx++) {
+					int next = ny * tilesX + nx;
+					if (tiles[next] == 1) {
+						tiles[next] = 2;
+						stack.push_back(next);
+					}
+				}
+			}
+		}
+
+		int px0 = tx0 * TileSize, py0 = ty0 * TileSize;
+		int px1 = std::min((tx1 + 1) * TileSize, frame->Width), py1 = std::min((ty1 + 1) * TileSize, frame->Height);
+		int x0 = px1, y0 = py1, x1 = px0 - 1, y1 = py0 - 1;
+		for (int y = py0; y < py1; y++) {
+			const unsigned char *pRow = (const unsigned char *)frame->Scan0 + (size_t)y * frame->Stride;
+			for (int x = px0; x < px1; x++) {
+				if (pRow[x * 4 + 3]) {
+					x0 = std::min(x0, x);
+					x1 = std::max(x1, x);
+					y0 = std::min(y0, y);
+					y1 = std::max(y1, y);
+				}
+			}
+		}
+		if (x1 >= x0) {
+			Rect opaque = { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+			bounds = bounds.Width > 0 ? rect_union(bounds, opaque) : opaque;
+		}
+		for (size_t i = 0; i < left.size(); i++) {
+			const Rect &r = left[i];
+			if (rect_intersects(r, px0, py0, px1, py1)) {
+				x0 = std::min(x0, r.X);
+				x1 = std::max(x1, r.X + r.Width - 1);
+				y0 = std::min(y0, r.Y);
+				y1 = std::max(y1, r.Y + r.Height - 1);
+			}
+		}
+
+		Rect rect = { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+		rects.push_back(rect);
+	}
+}
+
+/* Joins the pair whose union adds the fewest pixels while that costs less
+ * than another sub-frame, or while there are too many rects. */
+void DirtyRegions::Merge()
+{
+	if ((int)rects.size() > MaxComponents) {
+		for (size_t i = 1; i < rects.size(); i++) {
+			rects[0] = rect_union(rects[0], rects[i]);
+		}
+		rects.resize(1);
+	}
+
+	while (rects.size() > 1) {
+		size_t bestI = 0, bestJ = 1;
+		long long bestExtra = -1;
+		for (size_t i = 0; i < rects.size(); i++) {
+			for (size_t j = i + 1; j < rects.size(); j++) {
+				long long extra = rect_area(rect_union(rects[i], rects[j])) - rect_area(rects[i]) - rect_area(rects[j]);
+				if (bestExtra < 0 || extra < bestExtra) {
+					bestExtra = extra;
+					bestI = i;
+					bestJ = j;
+				}
+			}
+		}
+		if ((int)rects.size() <= maxRects && bestExtra >= SubFramePixelCost) {
+			break;
+		}
+		rects[bestI] = rect_union(rects[bestI], rects[bestJ]);
+		rects.erase(rects.begin() + bestJ);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include "WuQuantizer.h"
+
+using namespace std;
+
+/* Splits a frame into the rects of its separate opaque regions, written as
+ * consecutive sub-frames: all but the last with delay 0 and dispose none,
+ * the last with the frame's delay and dispose background. The canvas then
+ * still shows the earlier sub-frames when the next frame starts, so their
+ * rects are kept and the next frame's rects cover them. */
+class DirtyRegions
+{
+public:
+	struct Rect {
+		int X;
+		int Y;
+		int Width;
+		int Height;
+	};
+
+	DirtyRegions(int maxRects);
+
+	/* rects, in write order, covering the opaque pixels of a canvas-sized
+	 * frame and the sub-frames the last frame left; one rect when merging
+	 * is cheaper. Assumes they are all written. */
+	const vector<Rect> &Plan(const BitmapData *frame);
+	//of the opaque pixels of the last planned frame, the rect it would get on its own
+	const Rect &Bounds() const { return bounds; }
+	//a new animation, the canvas starts out transparent
+	void Clear() { left.clear(); }
+
+private:
+	int maxRects;
+	int tilesX;
+	vector<unsigned char> tiles;
+	vector<int> stack;
+	vector<Rect> rects;
+	vector<Rect> left;
+	Rect bounds;
+
+	void MarkTiles(const BitmapData *frame);
+	void FindComponents(const BitmapData *frame);
+	void Merge();
+};
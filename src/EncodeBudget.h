@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+
+/* The cancel flag and time limits of an encode, shared by the encoder and
+ * its deferred-mode workers; apng_cancel may set the flag from any thread.
+ * Times are steady clock milliseconds, 0 for no limit. */
+class EncodeBudget
+{
+public:
+	EncodeBudget() : FrameMs(0), EndTime(0), cancelled(false) {
+	}
+
+	static long long Now() {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+	//a new animation: not cancelled and no animation deadline, FrameMs stays
+	void Restart() {
+		EndTime = 0;
+		cancelled.store(false, std::memory_order_relaxed);
+	}
+	bool Cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+	int FrameMs;
+	long long EndTime; //animation deadline
+
+private:
+	std::atomic<bool> cancelled;
+};
+
+/* What the encode loops poll: the shared budget and the end of the frame
+ * being encoded. Expired() is also true once cancelled. */
+struct Deadline
+{
+	const EncodeBudget *Budget;
+	long long FrameEnd;
+
+	Deadline() : Budget(NULL), FrameEnd(0) {
+	}
+
+	bool Cancelled() const {
+		return Budget && Budget->Cancelled();
+	}
+
+	bool Expired() const {
+		if (!Budget) return false;
+		if (Budget->Cancelled()) return true;
+		if (!FrameEnd && !Budget->EndTime) return false;
+		long long now = EncodeBudget::Now();
+		return (FrameEnd && now >= FrameEnd) || (Budget->EndTime && now >= Budget->EndTime);
+	}
+};
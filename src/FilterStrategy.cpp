@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "FilterStrategy.h"
+
+void filter_row(int type, const unsigned char *row, const unsigned char *prev, unsigned char *out, int rowbytes, int bpp)
+{
+	switch (type)
+	{
+	case 1:
+		memcpy(out, row, bpp);
+		for (int i = bpp; i < rowbytes; i++)
+		{
+			out[i] = row[i] - row[i - bpp];
+		}
+		break;
+	case 2:
+		if (!prev)
+		{
+			memcpy(out, row, rowbytes);
+			break;
+		}
+		for (int i = 0; i < rowbytes; i++)
+		{
+			out[i] = row[i] - prev[i];
+		}
+		break;
+	case 3:
+		for (int i = 0; i < bpp; i++)
+		{
+			out[i] = row[i] - (prev ? prev[i] : 0) / 2;
+		}
+		for (int i = bpp; i < rowbytes; i++)
+		{
+			out[i] = row[i] - ((prev ? prev[i] : 0) + row[i - bpp]) / 2;
+		}
+		break;
+	case 4:
+		//without a row above paeth predicts the left byte, as sub
+		if (!prev)
+		{
+			filter_row(1, row, prev, out, rowbytes, bpp);
+			break;
+		}
+		for (int i = 0; i < bpp; i++)
+		{
+			out[i] = row[i] - prev[i];
+		}
+		for (int i = bpp; i < rowbytes; i++)
+		{
+			int a, b, c, pa, pb, pc, p;
+
+			a = row[i - bpp];
+			b = prev[i];
+			c = prev[i - bpp];
+			p = b - c;
+			pc = a - c;
+			pa = abs(p);
+			pb = abs(pc);
+			pc = abs(p + pc);
+			p = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+			out[i] = row[i] - p;
+		}
+		break;
+	default:
+		memcpy(out, row, rowbytes);
+		break;
+	}
+}
+
+double row_entropy(const unsigned char *data, int length)
+{
+	unsigned int counts[256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < length; i++)
+	{
+		counts[data[i]]++;
+	}
+
+	double bits = length > 0 ? length * log2((double)length) : 0;
+	for (int c = 0; c < 256; c++)
+	{
+		if (counts[c] > 1)
+		{
+			bits -= counts[c] * log2((double)counts[c]);
+		}
+	}
+	return bits;
+}
+
+DeflateScorer::DeflateScorer() : ready(false), windowBits(0), scratch(NULL), scratchSize(0), copying(false)
+{
+	memset(&streamBlock, 0, sizeof(streamBlock));
+	memset(&copyBlock, 0, sizeof(copyBlock));
+}
+
+DeflateScorer::~DeflateScorer()
+{
+	if (ready)
+	{
+		deflateEnd(&stream);
+	}
+	free(scratch);
+	free(streamBlock.Data);
+	free(copyBlock.Data);
+}
+
+//only while nothing lives in the block
+bool DeflateScorer::Grow(Block *block, size_t bytes)
+{
+	if (bytes <= block->Size)
+	{
+		return true;
+	}
+	free(block->Data);
+	block->Data = (unsigned char *)malloc(bytes);
+	block->Size = block->Data ? bytes : 0;
+	return block->Data != NULL;
+}
+
+voidpf DeflateScorer::Alloc(voidpf opaque, uInt items, uInt size)
+{
+	DeflateScorer *scorer = (DeflateScorer *)opaque;
+	Block *block = scorer->copying ? &scorer->copyBlock : &scorer->streamBlock;
+	size_t bytes = ((size_t)items * size + 15) & ~(size_t)15;
+	block->Needed += bytes;
+	if (bytes > block->Size - block->Used)
+	{
+		return Z_NULL;
+	}
+	void *p = block->Data + block->Used;
+	block->Used += bytes;
+	return p;
+}
+
+void DeflateScorer::Free(voidpf, voidpf)
+{
+	//the blocks are kept
+}
+
+/* A window of two rows is enough for the up, avg and paeth matches and
+ * keeps the copy per candidate small. A new window size starts a new
+ * stream, grown into its block until deflateInit2 stops running short. */
+bool DeflateScorer::Begin(int rowbytes)
+{
+	int bits = 9;
+	while (bits < 15 && (1 << bits) < 2 * (rowbytes + 1))
+	{
+		bits++;
+	}
+
+	unsigned int size = 2 * (rowbytes + 1) + 4096;
+	if (size > scratchSize)
+	{
+		free(scratch);
+		scratch = (unsigned char *)malloc(size);
+		scratchSize = scratch ? size : 0;
+		if (!scratch)
+		{
+			return false;
+		}
+	}
+
+	if (ready && bits == windowBits)
+	{
+		return deflateReset(&stream) == Z_OK;
+	}
+	if (ready)
+	{
+		deflateEnd(&stream);
+		ready = false;
+	}
+
+	stream.zalloc = Alloc;
+	stream.zfree = Free;
+	stream.opaque = this;
+	for (;;)
+	{
+		streamBlock.Used = 0;
+		streamBlock.Needed = 0;
+		int r = deflateInit2(&stream, Z_BEST_SPEED + 1, Z_DEFLATED, bits, 4, Z_FILTERED);
+		if (r == Z_OK)
+		{
+			break;
+		}
+		if (r != Z_MEM_ERROR || streamBlock.Needed <= streamBlock.Size || !Grow(&streamBlock, streamBlock.Needed))
+		{
+			return false;
+		}
+	}
+	//a copy takes what the stream took
+	if (!Grow(&copyBlock, streamBlock.Used))
+	{
+		deflateEnd(&stream);
+		return false;
+	}
+	windowBits = bits;
+	ready = true;
+	return true;
+}
+
+unsigned long DeflateScorer::Cost(const unsigned char *data, unsigned int length)
+{
+	z_stream copy;
+	copyBlock.Used = 0;
+	copying = true;
+	int r = deflateCopy(&copy, &stream);
+	copying = false;
+	if (r != Z_OK)
+	{
+		return (unsigned long)-1;
+	}
+
+	uLong before = copy.total_out;
+	copy.next_in = (Bytef *)data;
+	copy.avail_in = length;
+	do
+	{
+		copy.next_out = scratch;
+		copy.avail_out = scratchSize;
+		deflate(&copy, Z_SYNC_FLUSH);
+	} while (copy.avail_out == 0);
+
+	unsigned long cost = copy.total_out - before;
+	deflateEnd(&copy);
+	return cost;
+}
+
+void DeflateScorer::Commit(const unsigned char *data, unsigned int length)
+{
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = length;
+	do
+	{
+		//the output is never read
+		stream.next_out = scratch;
+		stream.avail_out = scratchSize;
+		deflate(&stream, Z_NO_FLUSH);
+	} while (stream.avail_in > 0 || stream.avail_out == 0);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <zlib.h>
+
+/* How process_rect picks the filter of a row. Every strategy but MinSad
+ * stands in for the whole-frame trial deflates, which are then skipped. */
+enum struct FilterStrategy : int {
+	MinSad = 0,	//smallest sum of absolute values, then the two trial deflates
+	Fixed = 1,	//one filter type for every row
+	Entropy = 2,	//smallest Shannon entropy of the filtered bytes
+	Deflate = 3,	//fewest bytes added to a deflate stream of the rows chosen so far
+};
+
+/* writes row filtered with type (0-4) to out; prev is NULL above the first
+ * row, read as zeros */
+void filter_row(int type, const unsigned char *row, const unsigned char *prev, unsigned char *out, int rowbytes, int bpp);
+
+/* bits to code the bytes with their own order-0 distribution */
+double row_entropy(const unsigned char *data, int length);
+
+/* A fast deflate stream fed with the chosen rows; Cost compresses a
+ * candidate on a copy of it, flushed, and returns the bytes that adds. The
+ * encoder keeps one: Begin resets the stream, and the stream and its copies
+ * live in two blocks that only grow for a wider rect than any before. */
+class DeflateScorer
+{
+public:
+	DeflateScorer();
+	~DeflateScorer();
+
+	bool Begin(int rowbytes);
+	unsigned long Cost(const unsigned char *data, unsigned int length);
+	void Commit(const unsigned char *data, unsigned int length);
+
+private:
+	//zlib's allocations, bumped through; Needed counts what was asked for
+	struct Block {
+		unsigned char *Data;
+		size_t Size;
+		size_t Used;
+		size_t Needed;
+	};
+
+	z_stream stream;
+	bool ready;
+	int windowBits;
+	unsigned char *scratch;
+	unsigned int scratchSize;
+	Block streamBlock;
+	Block copyBlock;
+	bool copying; //deflateCopy allocates from copyBlock
+
+	static bool Grow(Block *block, size_t bytes);
+	static voidpf Alloc(voidpf opaque, uInt items, uInt size);
+	static void Free(voidpf opaque, voidpf address);
+
+	DeflateScorer(const DeflateScorer &);
+	DeflateScorer &operator=(const DeflateScorer &);
+};
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include "FrameArena.h"
+
+static const size_t Alignment = 16;
+
+static size_t align_up(size_t bytes)
+{
+	return (bytes + Alignment - 1) & ~(Alignment - 1);
+}
+
+FrameArena::FrameArena() : base(NULL), capacity(0), used(0), spill(NULL), spilled(0), reused(0), allocated(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+	FreeSpill();
+	free(base);
+}
+
+/* grows the block to at least bytes; only between frames */
+bool FrameArena::Reserve(size_t bytes)
+{
+	bytes = align_up(bytes);
+	if (bytes <= capacity) {
+		return true;
+	}
+	if (used > 0 || spill) {
+		return false;
+	}
+	free(base);
+	capacity = 0;
+	base = (unsigned char *)malloc(bytes);
+	if (!base) {
+		return false;
+	}
+	capacity = bytes;
+	allocated += bytes;
+	return true;
+}
+
+/* ends the frame like Reset, without keeping what it spilled; a larger
+ * block is allocated again at bytes */
+void FrameArena::Trim(size_t bytes)
+{
+	FreeSpill();
+	used = 0;
+	bytes = align_up(bytes);
+	if (bytes >= capacity) {
+		return;
+	}
+	free(base);
+	base = NULL;
+	capacity = 0;
+	Reserve(bytes);
+}
+
+void *FrameArena::Alloc(size_t bytes)
+{
+	bytes = align_up(bytes > 0 ? bytes : 1);
+	if (base && bytes <= capacity - used) {
+		void *p = base + used;
+		used += bytes;
+		reused += bytes;
+		return p;
+	}
+
+	//a header the size of the alignment links the block in
+	unsigned char *block = (unsigned char *)malloc(Alignment + bytes);
+	if (!block) {
+		return NULL;
+	}
+	*(void **)block = spill;
+	spill = block;
+	spilled += bytes;
+	allocated += bytes;
+	return block + Alignment;
+}
+
+void FrameArena::Reset()
+{
+	if (spill) {
+		//one block for everything the last frame took
+		size_t peak = capacity + spilled;
+		FreeSpill();
+		used = 0;
+		free(base);
+		base = NULL;
+		capacity = 0;
+		Reserve(peak);
+	}
+	used = 0;
+}
+
+void FrameArena::FreeSpill()
+{
+	while (spill) {
+		void *next = *(void **)spill;
+		free(spill);
+		spill = next;
+	}
+	spilled = 0;
+}
+
+voidpf FrameArena::ZAlloc(voidpf opaque, uInt items, uInt size)
+{
+	return ((FrameArena *)opaque)->Alloc((size_t)items * size);
+}
+
+void FrameArena::ZFree(voidpf, voidpf)
+{
+	//released with the frame
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <zlib.h>
+
+/* Scratch memory for the buffers of one frame: the cropped copy, the index
+ * plane and palette, the expanded quantized image, the quantizer cubes and
+ * the state of the final deflate stream. Alloc bumps through one block and
+ * nothing is freed before Reset, called when the next frame starts. What a
+ * frame needs past the block comes from extra blocks, which Reset folds
+ * into one block, so once the largest frame has been seen a frame does not
+ * touch the heap. One thread at a time. */
+class FrameArena
+{
+public:
+	FrameArena();
+	~FrameArena();
+
+	bool Reserve(size_t bytes);
+	//Reset that cuts the block back to bytes, for an encoder that goes idle
+	void Trim(size_t bytes);
+	//16-byte aligned, NULL when out of memory
+	void *Alloc(size_t bytes);
+	void Reset();
+
+	long long ReusedBytes() const { return reused; }
+	long long AllocatedBytes() const { return allocated; }
+	void ClearCounters() { reused = allocated = 0; }
+
+	//zalloc and zfree of a z_stream whose opaque is the arena
+	static voidpf ZAlloc(voidpf opaque, uInt items, uInt size);
+	static void ZFree(voidpf opaque, voidpf address);
+
+private:
+	unsigned char *base;
+	size_t capacity;
+	size_t used;
+	void *spill; //extra blocks of this frame, each starts with the next one
+	size_t spilled;
+	long long reused;
+	long long allocated;
+
+	void FreeSpill();
+
+	FrameArena(const FrameArena &);
+	FrameArena &operator=(const FrameArena &);
+};
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ApngDeferred.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+FrameCapture::FrameCapture(bool spill) :
+	spill(spill),
+	file(NULL),
+	fileSize(0),
+	mapped(NULL)
+#ifdef _WIN32
+	, mapping(NULL)
+#endif
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+	if (mapped) {
+#ifdef _WIN32
+		UnmapViewOfFile(mapped);
+#else
+		munmap(mapped, fileSize);
+#endif
+	}
+#ifdef _WIN32
+	if (mapping) {
+		CloseHandle((HANDLE)mapping);
+	}
+#endif
+	if (file) {
+		fclose(file);
+	}
+	for (size_t i = 0; i < buffers.size(); i++) {
+		free(buffers[i]);
+	}
+}
+
+ApngError FrameCapture::Add(const void *pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize)
+{
+	Frame frame;
+	frame.Offset = 0;
+	frame.X = x;
+	frame.Y = y;
+	frame.Width = width;
+	frame.Height = height;
+	frame.Delay = delay_ms;
+	frame.Optimize = optimize;
+
+	size_t rowbytes = (size_t)width * 4;
+	const unsigned char *pRow = (const unsigned char *)pData;
+
+	if (spill) {
+		if (mapped) {
+			return ApngError::ArgumentError;
+		}
+		if (!file && !(file = tmpfile())) {
+			return ApngError::FileError;
+		}
+		frame.Offset = fileSize;
+		for (int row = 0; row < height; row++) {
+			if (fwrite(pRow, 1, rowbytes, file) != rowbytes) {
+				return ApngError::FileError;
+			}
+			pRow += stride;
+		}
+		fileSize += rowbytes * height;
+	}
+	else {
+		unsigned char *pixels = (unsigned char *)malloc(rowbytes * height);
+		if (!pixels) {
+			return ApngError::MemoryError;
+		}
+		for (int row = 0; row < height; row++) {
+			memcpy(pixels + row * rowbytes, pRow, rowbytes);
+			pRow += stride;
+		}
+		buffers.push_back(pixels);
+	}
+
+	frames.push_back(frame);
+	return ApngError::Success;
+}
+
+/* Maps the spilled frames back in, read only. Adding frames afterwards is
+ * not supported. */
+ApngError FrameCapture::Map()
+{
+	if (!spill || mapped || fileSize == 0) {
+		return ApngError::Success;
+	}
+	if (fflush(file)) {
+		return ApngError::FileError;
+	}
+
+#ifdef _WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		return ApngError::FileError;
+	}
+	mapped = (unsigned char *)MapViewOfFile((HANDLE)mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	void *view = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	mapped = view == MAP_FAILED ? NULL : (unsigned char *)view;
+#endif
+	return mapped ? ApngError::Success : ApngError::FileError;
+}
+
+const unsigned char *FrameCapture::Pixels(int i) const
+{
+	return spill ? mapped + frames[i].Offset : buffers[i];
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libapngInternal.h"
+
+#ifdef APNG_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Near-lossless mode: the color channels of a frame written as rgba are
+ * rounded to multiples of q, the largest power of two whose rounding stays
+ * within the error limit, so the low bits deflate cannot match on are
+ * gone. Alpha is kept exact, it decides the frame rects. */
+
+static const unsigned char bayer[4][4] = {
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 },
+};
+
+static int posterize_step(int maxError)
+{
+	int q = 1;
+	while (q * 2 <= maxError + 1) {
+		q *= 2;
+	}
+	return q;
+}
+
+/* Adds a threshold and masks the low bits: q / 2 rounds to the nearest
+ * multiple, the Bayer matrix gives ordered dithering. Values past the last
+ * multiple saturate to it. The 16 bytes cover pixels x % 4 = 0..3. */
+static unsigned long long posterize_ordered(BitmapData *image, int q, bool ordered)
+{
+	unsigned long long sqError = 0;
+	unsigned char t[16], mask[16];
+	int n = image->Width * 4;
+
+	for (int y = 0; y < image->Height; y++) {
+		unsigned char *p = (unsigned char *)image->Scan0 + (size_t)y * image->Stride;
+		for (int i = 0; i < 16; i++) {
+			bool alpha = (i & 3) == 3;
+			t[i] = alpha ? 0 : (unsigned char)(ordered ? bayer[y & 3][i >> 2] * q / 16 : q / 2);
+			mask[i] = alpha ? 0xff : (unsigned char)~(q - 1);
+		}
+
+		int i = 0;
+#ifdef APNG_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i tv = _mm_loadu_si128((const __m128i *)t);
+		__m128i mv = _mm_loadu_si128((const __m128i *)mask);
+		__m128i acc = zero;
+		for (; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			__m128i r = _mm_and_si128(_mm_adds_epu8(v, tv), mv);
+			_mm_storeu_si128((__m128i *)(p + i), r);
+
+			__m128i d = _mm_or_si128(_mm_subs_epu8(v, r), _mm_subs_epu8(r, v));
+			__m128i lo = _mm_unpacklo_epi8(d, zero);
+			__m128i hi = _mm_unpackhi_epi8(d, zero);
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+		}
+		unsigned int lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sqError += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+		for (; i < n; i++) {
+			int v = p[i];
+			int r = v + t[i & 15];
+			r = (r > 255 ? 255 : r) & mask[i & 15];
+			p[i] = (unsigned char)r;
+			sqError += (unsigned long long)((v - r) * (v - r));
+		}
+	}
+	return sqError;
+}
+
+/* Floyd-Steinberg over the color channels. Each value goes to the multiple
+ * of q just below it, or just above it when that is still within maxError,
+ * so the limit holds whatever error arrives. */
+static ApngError posterize_diffused(FrameArena *arena, BitmapData *image, int q, int maxError, unsigned long long *sqError)
+{
+	//sixteenths of the error, a pixel of margin on both sides
+	size_t rowErrors = ((size_t)image->Width + 2) * 3;
+	int *errors = (int *)arena->Alloc(2 * rowErrors * sizeof(int));
+	if (!errors) {
+		return ApngError::MemoryError;
+	}
+	memset(errors, 0, rowErrors * sizeof(int));
+
+	for (int y = 0; y < image->Height; y++) {
+		unsigned char *p = (unsigned char *)image->Scan0 + (size_t)y * image->Stride;
+		int *cur = errors + (y & 1) * rowErrors + 3;
+		int *next = errors + ((y + 1) & 1) * rowErrors + 3;
+		memset(next - 3, 0, rowErrors * sizeof(int));
+
+		for (int x = 0; x < image->Width; x++, p += 4) {
+			for (int c = 0; c < 3; c++) {
+				int v = p[c];
+				int want = v + cur[x * 3 + c] / 16;
+				int lo = v & ~(q - 1), hi = lo + q;
+				int r = hi <= 255 && hi - v <= maxError && want >= lo + q / 2 ? hi : lo;
+				int e = want - r;
+				e = e < -q ? -q : e > q ? q : e;
+
+				cur[(x + 1) * 3 + c] += e * 7;
+				next[(x - 1) * 3 + c] += e * 3;
+				next[x * 3 + c] += e * 5;
+				next[(x + 1) * 3 + c] += e;
+
+				p[c] = (unsigned char)r;
+				*sqError += (unsigned long long)((v - r) * (v - r));
+			}
+		}
+	}
+	return ApngError::Success;
+}
+
+/* Posterizes a bgra frame the encoder owns and counts its error for the
+ * stats; does nothing unless the mode is on. */
+ApngError near_lossless(ApngEncoder *pEnc, BitmapData *image)
+{
+	if (pEnc->nearLosslessError <= 0 || image->bpp != 4) {
+		return ApngError::Success;
+	}
+
+	int q = posterize_step(pEnc->nearLosslessError);
+	unsigned long long sqError = 0;
+	if (q > 1) {
+		if (pEnc->nearLosslessDither == 2) {
+			ApngError err = posterize_diffused(pEnc->arena, image, q, pEnc->nearLosslessError, &sqError);
+			if (err != ApngError::Success) {
+				return err;
+			}
+		}
+		else {
+			sqError = posterize_ordered(image, q, pEnc->nearLosslessDither == 1);
+		}
+	}
+	pEnc->nearSquaredError += sqError;
+	pEnc->nearSamples += 3ull * image->Width * image->Height;
+	return ApngError::Success;
+}
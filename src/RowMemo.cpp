@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "RowMemo.h"
+
+RowMemo::RowMemo() : rows(NULL), stride(0), frame(0)
+{
+}
+
+RowMemo::~RowMemo()
+{
+	free(rows);
+}
+
+/* entries for height rows of up to rowbytes bytes */
+bool RowMemo::Alloc(unsigned int rowbytes, unsigned int height)
+{
+	Entry empty;
+	memset(&empty, 0, sizeof(empty));
+	stride = (size_t)rowbytes + 1;
+	rows = (unsigned char *)malloc(stride * height);
+	if (!rows) {
+		return false;
+	}
+	try {
+		entries.assign(height, empty);
+	}
+	catch (const std::bad_alloc &) {
+		return false;
+	}
+	return true;
+}
+
+void RowMemo::Clear()
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		entries[i].Bpp = 0;
+	}
+}
+
+/* 64-bit multiply-xorshift over 8-byte words */
+uint64_t RowMemo::Hash(const unsigned char *row, size_t length)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t h = length * k;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+		memcpy(&w, row + i, 8);
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+	if (i < length) {
+		uint64_t w = 0;
+		memcpy(&w, row + i, length - i);
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+	h *= 0xbf58476d1ce4e5b9ull;
+	return h ^ (h >> 32);
+}
+
+unsigned char *RowMemo::Find(int x, int y, int bpp, int rowbytes, uint64_t hash, uint64_t prevHash, bool top, bool *fromEarlierFrame) const
+{
+	if (y < 0 || (size_t)y >= entries.size() || (size_t)rowbytes >= stride) {
+		return NULL;
+	}
+	const Entry &e = entries[y];
+	if (e.Bpp != bpp || e.X != x || e.Rowbytes != rowbytes || e.Hash != hash || e.Top != top || (!top && e.PrevHash != prevHash)) {
+		return NULL;
+	}
+	*fromEarlierFrame = e.Frame != frame;
+	return rows + y * stride;
+}
+
+void RowMemo::Store(int x, int y, int bpp, int rowbytes, uint64_t hash, uint64_t prevHash, bool top, const unsigned char *filtered)
+{
+	if (y < 0 || (size_t)y >= entries.size() || (size_t)rowbytes >= stride) {
+		return;
+	}
+	Entry &e = entries[y];
+	e.Hash = hash;
+	e.PrevHash = prevHash;
+	e.X = x;
+	e.Rowbytes = rowbytes;
+	e.Bpp = bpp;
+	e.Top = top;
+	e.Frame = frame;
+	memcpy(rows + y * stride, filtered, rowbytes + 1);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/* The filtered bytes last chosen at each canvas row. A row whose bytes and
+ * the bytes of the row above it hash the same as the entry at its position
+ * gets those filtered bytes back instead of running the five filters
+ * again; the trial and the final pass of a frame share the entries too. */
+class RowMemo
+{
+public:
+	RowMemo();
+	~RowMemo();
+
+	bool Alloc(unsigned int rowbytes, unsigned int height);
+	void NextFrame() { frame++; }
+	void Clear();
+
+	static uint64_t Hash(const unsigned char *row, size_t length);
+
+	//filter type byte first, NULL when the row changed; fromEarlierFrame tells a hit from another frame
+	unsigned char *Find(int x, int y, int bpp, int rowbytes, uint64_t hash, uint64_t prevHash, bool top, bool *fromEarlierFrame) const;
+	void Store(int x, int y, int bpp, int rowbytes, uint64_t hash, uint64_t prevHash, bool top, const unsigned char *filtered);
+	//the filtered bytes last found or stored at canvas row y
+	unsigned char *Row(int y) const { return rows + y * stride; }
+
+private:
+	struct Entry {
+		uint64_t Hash;
+		uint64_t PrevHash;
+		int X;
+		int Rowbytes;
+		int Bpp; //0 for no entry
+		bool Top; //first row of its rect, filtered without the row above
+		unsigned int Frame;
+	};
+
+	vector<Entry> entries;
+	unsigned char *rows;
+	size_t stride;
+	unsigned int frame;
+
+	RowMemo(const RowMemo &);
+	RowMemo &operator=(const RowMemo &);
+};
@@ -1,222 +1,523 @@
 #include <math.h>
+#include <string.h>
 #include <algorithm>
+#include <queue>
 #include "WuQuantizer.h"
+#include "FrameArena.h"
 
+#if defined(OPENMP) && defined(_OPENMP)
+#include <omp.h>
+#endif
 
-typedef ColorData<MaxSideIndex> _ColorData;
-typedef LookupData<SideSize> _LookupData;
+/* Moments of a box up to each candidate cut position along one axis */
+template<int side>
+struct AxisProjection
+{
+	int Count;
+	uint8_t Position[side];
+	int64_t Alpha[side];
+	int64_t Red[side];
+	int64_t Green[side];
+	int64_t Blue[side];
+	int64_t Weight[side];
+};
+
+template<class TColorData>
+bool Cut(const TColorData * data, Box & first, Box & second);
+template<class TColorData>
+CubeCut Maximize(const TColorData * data, const Box &cube, int direction, AxisProjection<TColorData::SideSize> &projection);
+
+template<class TColorData>
+void Project(const TColorData *data, const Box &cube, int direction, AxisProjection<TColorData::SideSize> &projection);
+
+template<typename T, int _1, int _2, int _3>
+int64_t Volume(const Box &cube, T(*moment)[_1][_2][_3]);
+
+template<class TColorData>
+float CalculateVariance(const TColorData *data, const Box &cube);
+
+template<class TColorData>
+void AccumulateHistogram(const BitmapData *sourceImage, TColorData &colorData, const Deadline *deadline = NULL, FrameArena *arena = NULL);
+
+#if defined(OPENMP) && defined(_OPENMP)
+template<class TColorData>
+void BuildHistogramParallel(const BitmapData *sourceImage, TColorData &colorData, const Deadline *deadline, FrameArena *arena);
+
+struct HistogramEntry {
+	PixelIndex Index;
+	Pixel Value;
+};
+
+//rows of a band of the parallel histogram, one band per thread and round
+static int HistogramBandRows(int width)
+{
+	return max(1, HistogramRoundPixels / width);
+}
 
-_ColorData BuildHistogram(const BitmapData *sourceImage);
-void CalculateMoments(const _ColorData *data);
-vector<Box> SplitData(int &colorCount, const _ColorData *data);
-bool Cut(const _ColorData * data, Box & first, Box & second);
-QuantizedPalette GetQuantizedPalette(int colorCount, _ColorData *data, const vector<Box> &cubes);
-void ProcessImagePixels(const BitmapData *sourceImage, const QuantizedPalette *palette, const IndexedBitmapData *destImage);
+//the staging of the parallel histogram: the bands of one round and the end of each owner's run in them
+static size_t HistogramStagingBytes(int width, int threads)
+{
+	return (size_t)HistogramBandRows(width) * width * threads * sizeof(HistogramEntry) + (size_t)threads * threads * sizeof(int);
+}
+#endif
 
-CubeCut Maximize(const _ColorData * data, const Box &cube, int direction, uint8_t first, uint8_t last, int64_t wholeAlpha, int64_t wholeRed, int64_t wholeGreen, int64_t wholeBlue, int64_t wholeWeight);
+template<class TColorData>
+vector<Lookup> BuildLookups(const vector<Box> &cubes, const TColorData *data);
 
-template<int _1, int _2, int _3>
-int64_t Volume(const Box &cube, int64_t(*moment)[_1][_2][_3]);
+struct ColorSums
+{
+	uint64_t Alpha;
+	uint64_t Red;
+	uint64_t Green;
+	uint64_t Blue;
+	uint32_t Count;
+};
+
+struct MappingError
+{
+	uint64_t Sum;
+	uint32_t Max;
+	uint64_t SumLimit;
+	uint32_t MaxLimit;
+};
 
-template<int _1, int _2, int _3>
-float VolumeFloat(const Box &cube, float(*moment)[_1][_2][_3]);
+template<int shift>
+bool MapPixels(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const vector<Lookup> &lookups, uint8_t transparentIndex, ColorSums *sums, MappingError *error = NULL);
 
-template<int _1, int _2, int _3>
-int64_t Top(const Box &cube, int direction, int position, int64_t(*moment)[_1][_2][_3]);
+template<int shift>
+void MapAllPixels(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const vector<Lookup> &lookups, uint8_t transparentIndex, ColorSums *sums);
 
-template<int _1, int _2, int _3>
-int64_t Bottom(const Box &cube, int direction, int64_t(*moment)[_1][_2][_3]);
+/* the last palette entry is kept for the transparent color */
+template<class TColorData>
+int Quantize(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const QuantizeOptions *options)
+{
+	const Deadline *deadline = options ? &options->Limit : NULL;
+	auto colorCount = min(destImage->ColorCount, MaxColor);
+	//an arena out of memory leaves the cubes to the heap
+	void *storage = options && options->Arena ? options->Arena->Alloc(TColorData::Bytes()) : NULL;
+	TColorData data(storage);
+	AccumulateHistogram(sourceImage, data, deadline, options ? options->Arena : NULL);
+	if (deadline && deadline->Expired())
+		return 0;
+	CalculateMoments(&data);
+	auto cubes = SplitData(colorCount, &data);
+	auto palette = GetQuantizedPalette(colorCount, &data, cubes, sourceImage, destImage);
+	memcpy(destImage->Palette, &palette.Colors[0], palette.Colors.size() * sizeof(Pixel));
+	return palette.Colors.size();
+}
 
-float CalculateVariance(const _ColorData *data, const Box &cube);
+/* Picks the histogram granularity from the effort and the accumulator width
+ * from the pixel count: a 17^4 cube with 32-bit sums is ~2.3 MB against
+ * ~52 MB for the full 33^4 int64_t one. */
+int __stdcall QuantizeImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const QuantizeOptions *options)
+{
+	QuantizeEffort effort = options ? options->Effort : QuantizeEffort::Auto;
+	int64_t pixelCount = (int64_t)sourceImage->Width * sourceImage->Height;
+	bool coarse = effort == QuantizeEffort::Fast
+		|| (effort == QuantizeEffort::Auto && pixelCount <= CoarseHistogramPixelLimit);
+	bool narrow = pixelCount <= NarrowAccumulatorPixelLimit;
+
+	if (coarse) {
+		if (narrow) return Quantize<_CoarseColorData32>(sourceImage, destImage, options);
+		else return Quantize<_CoarseColorData>(sourceImage, destImage, options);
+	}
+	else {
+		if (narrow) return Quantize<_ColorData32>(sourceImage, destImage, options);
+		else return Quantize<_ColorData>(sourceImage, destImage, options);
+	}
+}
 
-_LookupData BuildLookups(const vector<Box> &cubes, const _ColorData *data);
+size_t __stdcall QuantizeArenaBytes(int width, int height, const QuantizeOptions *options)
+{
+	QuantizeEffort effort = options ? options->Effort : QuantizeEffort::Auto;
+	int64_t pixelCount = (int64_t)width * height;
+	bool coarse = effort == QuantizeEffort::Fast
+		|| (effort == QuantizeEffort::Auto && pixelCount <= CoarseHistogramPixelLimit);
+	bool narrow = pixelCount <= NarrowAccumulatorPixelLimit;
+	size_t bytes = coarse ? (narrow ? _CoarseColorData32::Bytes() : _CoarseColorData::Bytes())
+		: (narrow ? _ColorData32::Bytes() : _ColorData::Bytes());
+
+#if defined(OPENMP) && defined(_OPENMP)
+	if (pixelCount >= ParallelHistogramThreshold && omp_get_max_threads() > 1)
+		bytes += HistogramStagingBytes(width, omp_get_max_threads());
+#endif
+	return bytes;
+}
 
+/* The limits are RGBA distances in 8-bit levels; they are compared squared,
+ * the mean one against the whole frame up front so the mapping can stop at
+ * the first pixel that makes the frame fail. */
+bool __stdcall RemapImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const RemapLimits *limits)
+{
+	if (destImage->ColorCount < 1) return false;
 
-void __stdcall QuantizeImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage)
+	vector<Lookup> lookups(destImage->ColorCount - 1);
+	for (int i = 0, i1 = lookups.size(); i < i1; i++)
+	{
+		const Pixel &color = destImage->Palette[i];
+		lookups[i].Alpha = color.Alpha;
+		lookups[i].Red = color.Red;
+		lookups[i].Green = color.Green;
+		lookups[i].Blue = color.Blue;
+	}
+
+	MappingError error;
+	error.Sum = 0;
+	error.Max = 0;
+	error.SumLimit = (uint64_t)limits->MeanError * limits->MeanError * sourceImage->Width * sourceImage->Height;
+	error.MaxLimit = limits->MaxError > 0 ? (uint32_t)(limits->MaxError * limits->MaxError) : UINT32_MAX;
+
+	return MapPixels<0>(sourceImage, destImage, lookups, (uint8_t)(destImage->ColorCount - 1), NULL, &error);
+}
+
+/* right shift from an 8-bit channel to a histogram index */
+constexpr int IndexShift(int granularity)
 {
-	auto colorCount = MaxColor;
-	auto data = BuildHistogram(sourceImage);
-	CalculateMoments(&data);
-	auto cubes = SplitData(colorCount, &data);
-	auto palette = GetQuantizedPalette(colorCount, &data, cubes);
-	ProcessImagePixels(sourceImage, &palette, destImage);
+	return granularity >= 256 ? 0 : 1 + IndexShift(granularity * 2);
 }
 
-_ColorData BuildHistogram(const BitmapData *sourceImage) {
-	_ColorData colorData;
+template<int shift>
+inline bool ReadPixel(const uint8_t *value, PixelIndex &index, Pixel &pixel)
+{
+	uint8_t indexAlpha = ((value[Alpha] >> shift) + 1);
+	uint8_t indexRed = ((value[Red] >> shift) + 1);
+	uint8_t indexGreen = ((value[Green] >> shift) + 1);
+	uint8_t indexBlue = ((value[Blue] >> shift) + 1);
+	uint8_t pixelAlpha = value[Alpha];
+	bool counted = false;
+
+	int alpha = value[Alpha];
+	if (alpha > AlphaThreshold)
+	{
+		if (alpha < 255)
+		{
+			//var alpha = value[Alpha] + (value[Alpha] % 70);
+			alpha = (alpha + 8) & 0xf0;
+			int a = (alpha > 255 ? 255 : alpha);
+			pixelAlpha = a;
+			indexAlpha = ((a >> shift) + 1);
+		}
+		counted = true;
+	}
+
+	index = PixelIndex(indexAlpha, indexRed, indexGreen, indexBlue);
+	pixel = Pixel(pixelAlpha, value[Red], value[Green], value[Blue]);
+	return counted;
+}
+
+template<class TColorData>
+inline void AddToHistogram(TColorData &colorData, const PixelIndex &index, const Pixel &pixel)
+{
+	uint8_t indexAlpha = index.PixelValue.Alpha;
+	uint8_t indexRed = index.PixelValue.Red;
+	uint8_t indexGreen = index.PixelValue.Green;
+	uint8_t indexBlue = index.PixelValue.Blue;
+
+	colorData.Weights[indexAlpha][indexRed][indexGreen][indexBlue]++;
+	colorData.MomentsRed[indexAlpha][indexRed][indexGreen][indexBlue] += pixel.Red;
+	colorData.MomentsGreen[indexAlpha][indexRed][indexGreen][indexBlue] += pixel.Green;
+	colorData.MomentsBlue[indexAlpha][indexRed][indexGreen][indexBlue] += pixel.Blue;
+	colorData.MomentsAlpha[indexAlpha][indexRed][indexGreen][indexBlue] += pixel.Alpha;
+	colorData.Moments[indexAlpha][indexRed][indexGreen][indexBlue] += (pixel.Alpha * pixel.Alpha) +
+		(pixel.Red * pixel.Red) +
+		(pixel.Green * pixel.Green) +
+		(pixel.Blue * pixel.Blue);
+}
+
+template<class TColorData>
+TColorData BuildHistogram(const BitmapData *sourceImage, const Deadline *deadline) {
+	TColorData colorData;
+	AccumulateHistogram(sourceImage, colorData, deadline);
+	return colorData;
+}
+
+/* Adds the counted pixels of one image to an existing histogram. Once the
+ * deadline expires the rows left are not read, every 16th row polls it. */
+template<class TColorData>
+void AccumulateHistogram(const BitmapData *sourceImage, TColorData &colorData, const Deadline *deadline, FrameArena *arena) {
 	const BitmapData *data = sourceImage;
 
 	int byteLength = data->Stride < 0 ? -data->Stride : data->Stride;
-	const int byteCount = max(1, BitDepth >> 3);
 	int offset = 0;
 
-	size_t bufferSize = byteLength * sourceImage->Height;
-	//uint8_t *buffer = new uint8_t[bufferSize];
-	uint8_t value[byteCount] = { 0 };
-
-	//memcpy_s(buffer, bufferSize, sourceImage->Scan0, sourceImage->Height * sourceImage->Stride);
 	uint8_t *buffer = static_cast<uint8_t*>(sourceImage->Scan0);
 
-	colorData.QuantizedPixels.reserve(sourceImage->Width * sourceImage->Height);
-	colorData.Pixels.reserve(sourceImage->Width * sourceImage->Height);
+#if defined(OPENMP) && defined(_OPENMP)
+	if (sourceImage->Width * sourceImage->Height >= ParallelHistogramThreshold && omp_get_max_threads() > 1)
+	{
+		BuildHistogramParallel(sourceImage, colorData, deadline, arena);
+		return;
+	}
+#endif
 
 	for (int y = 0, y1 = sourceImage->Height, x1 = sourceImage->Width; y < y1; y++)
 	{
+		if (deadline && y > 0 && (y & 15) == 0 && deadline->Expired())
+			break;
+
 		int index = 0;
 		for (int x = 0; x < x1; x++)
 		{
 			int indexOffset = index >> 3;
+			PixelIndex pixelIndex;
+			Pixel pixel;
 
-			for (int valueIndex = 0; valueIndex < byteCount; valueIndex++)
-				value[valueIndex] = buffer[offset + valueIndex + indexOffset];
+			if (ReadPixel<IndexShift(TColorData::Granularity)>(buffer + offset + indexOffset, pixelIndex, pixel))
+			{
+				AddToHistogram(colorData, pixelIndex, pixel);
+			}
+			index += BitDepth;
+		}
+		offset += byteLength;
+	}
+}
 
-			uint8_t indexAlpha = ((value[Alpha] >> 3) + 1);
-			uint8_t indexRed = ((value[Red] >> 3) + 1);
-			uint8_t indexGreen = ((value[Green] >> 3) + 1);
-			uint8_t indexBlue = ((value[Blue] >> 3) + 1);
+#if defined(OPENMP) && defined(_OPENMP)
+/* Rounds of row bands, one band per thread, with a barrier between the two
+ * passes. Each thread reads its band twice, to count the pixels of each
+ * owner thread, a hash of the bin, and to put them in order by owner; then
+ * each thread adds the pixels of its own bins from every band. The sums
+ * are exact in any order. Only one round is staged, so the staging is
+ * bounded by the threads and HistogramRoundPixels, not the frame, and is
+ * taken from the arena when there is one. The deadline is polled once per
+ * round. */
+template<class TColorData>
+void BuildHistogramParallel(const BitmapData *sourceImage, TColorData &colorData, const Deadline *deadline, FrameArena *arena)
+{
+	int byteLength = sourceImage->Stride < 0 ? -sourceImage->Stride : sourceImage->Stride;
+	const uint8_t *buffer = static_cast<const uint8_t*>(sourceImage->Scan0);
+	int width = sourceImage->Width;
+	int height = sourceImage->Height;
+	int threads = omp_get_max_threads();
+	int bandRows = HistogramBandRows(width);
+	size_t capacity = (size_t)bandRows * width;
+	//per thread its band sorted by owner, then the end of each owner's run in it
+	vector<unsigned char> heap;
+	void *storage = arena ? arena->Alloc(HistogramStagingBytes(width, threads)) : NULL;
+	if (!storage)
+	{
+		heap.resize(HistogramStagingBytes(width, threads));
+		storage = &heap[0];
+	}
+	HistogramEntry *staging = static_cast<HistogramEntry *>(storage);
+	int *ends = reinterpret_cast<int *>(staging + capacity * threads);
+	bool expired = false;
+
+#pragma omp parallel num_threads(threads)
+	{
+		int count = omp_get_num_threads();
+		int thread = omp_get_thread_num();
+		HistogramEntry *sorted = &staging[capacity * thread];
+		int *end = &ends[(size_t)thread * threads];
 
-			int alpha = value[Alpha];
-			if (alpha > AlphaThreshold)
+		for (int y0 = 0; y0 < height; y0 += bandRows * count)
+		{
+			//its barrier also keeps the bands of the last round until every owner is done
+#pragma omp single
+			expired = deadline && y0 > 0 && deadline->Expired();
+			if (expired)
+				break;
+
+			int b0 = min(height, y0 + bandRows * thread);
+			int b1 = min(height, b0 + bandRows);
+			for (int owner = 0; owner < count; owner++)
+				end[owner] = 0;
+			for (int y = b0; y < b1; y++)
+			{
+				const uint8_t *row = buffer + (size_t)y * byteLength;
+				for (int x = 0; x < width; x++)
+				{
+					HistogramEntry entry;
+					if (ReadPixel<IndexShift(TColorData::Granularity)>(row + x * 4, entry.Index, entry.Value))
+						end[((entry.Index.Value * 2654435761u) >> 16) % count]++;
+				}
+			}
+			//counts to starts, which the second read moves on to the ends
+			for (int owner = 0, start = 0; owner < count; owner++)
+			{
+				int size = end[owner];
+				end[owner] = start;
+				start += size;
+			}
+			for (int y = b0; y < b1; y++)
 			{
-				if (alpha < 255)
+				const uint8_t *row = buffer + (size_t)y * byteLength;
+				for (int x = 0; x < width; x++)
 				{
-					//var alpha = value[Alpha] + (value[Alpha] % 70);
-					alpha = (alpha + 8) & 0xf0;
-					int a = (alpha > 255 ? 255 : alpha);
-					value[Alpha] = a;
-					indexAlpha = ((a >> 3) + 1);
+					HistogramEntry entry;
+					if (ReadPixel<IndexShift(TColorData::Granularity)>(row + x * 4, entry.Index, entry.Value))
+						sorted[end[((entry.Index.Value * 2654435761u) >> 16) % count]++] = entry;
 				}
+			}
 
-				colorData.Weights[indexAlpha][indexRed][indexGreen][indexBlue]++;
-				colorData.MomentsRed[indexAlpha][indexRed][indexGreen][indexBlue] += value[Red];
-				colorData.MomentsGreen[indexAlpha][indexRed][indexGreen][indexBlue] += value[Green];
-				colorData.MomentsBlue[indexAlpha][indexRed][indexGreen][indexBlue] += value[Blue];
-				colorData.MomentsAlpha[indexAlpha][indexRed][indexGreen][indexBlue] += value[Alpha];
-				colorData.Moments[indexAlpha][indexRed][indexGreen][indexBlue] += (value[Alpha] * value[Alpha]) +
-					(value[Red] * value[Red]) +
-					(value[Green] * value[Green]) +
-					(value[Blue] * value[Blue]);
+#pragma omp barrier
+			for (int source = 0; source < count; source++)
+			{
+				const HistogramEntry *band = &staging[capacity * source];
+				const int *sourceEnd = &ends[(size_t)source * threads];
+				for (int i = thread > 0 ? sourceEnd[thread - 1] : 0; i < sourceEnd[thread]; i++)
+					AddToHistogram(colorData, band[i].Index, band[i].Value);
 			}
-			colorData.QuantizedPixels.push_back(PixelIndex(indexAlpha, indexRed, indexGreen, indexBlue));
-			colorData.Pixels.push_back(Pixel(value[Alpha], value[Red], value[Green], value[Blue]));
-			index += BitDepth;
 		}
-		offset += byteLength;
 	}
-	return colorData;
 }
+#endif
+
+/* 4D prefix sums computed as separable cumulative sums, in place and one
+ * (alpha, red) plane at a time: blue and green within the plane, then the
+ * running sum of the slice's earlier red planes and, when given, the
+ * finished plane of the previous alpha slice are added. Row and plane
+ * additions run over the contiguous blue axis and vectorize, and everything
+ * a plane needs is still in cache. Integer sums are exact, so the result
+ * does not depend on the order of accumulation. */
+template<typename T, int side>
+void PrefixSumSlice(T(*slice)[side][side], const T(*previousSlice)[side][side])
+{
+	T redSum[side * side] = { 0 };
 
-void CalculateMoments(const _ColorData *data) {
+	for (int redIndex = 1; redIndex < side; ++redIndex)
+	{
+		for (int greenIndex = 1; greenIndex < side; ++greenIndex)
+		{
+			T *line = slice[redIndex][greenIndex];
+			const T *above = slice[redIndex][greenIndex - 1];
 
-	auto xarea = new int64_t[SideSize][SideSize][SideSize];
-	auto xareaAlpha = new int64_t[SideSize][SideSize][SideSize];
-	auto xareaRed = new int64_t[SideSize][SideSize][SideSize];
-	auto xareaGreen = new int64_t[SideSize][SideSize][SideSize];
-	auto xareaBlue = new int64_t[SideSize][SideSize][SideSize];
-	auto xarea2 = new float[SideSize][SideSize][SideSize];
+			for (int blueIndex = 2; blueIndex < side; ++blueIndex)
+				line[blueIndex] += line[blueIndex - 1];
+			for (int blueIndex = 1; blueIndex < side; ++blueIndex)
+				line[blueIndex] += above[blueIndex];
+		}
 
-	for (int alphaIndex = 1; alphaIndex <= MaxSideIndex; ++alphaIndex)
-	{
-		memset(xarea, 0, sizeof(int64_t)*SideSize*SideSize*SideSize);
-		memset(xareaAlpha, 0, sizeof(int64_t)*SideSize*SideSize*SideSize);
-		memset(xareaRed, 0, sizeof(int64_t)*SideSize*SideSize*SideSize);
-		memset(xareaGreen, 0, sizeof(int64_t)*SideSize*SideSize*SideSize);
-		memset(xareaBlue, 0, sizeof(int64_t)*SideSize*SideSize*SideSize);
-		memset(xarea2, 0, sizeof(float)*SideSize*SideSize*SideSize);
-
-		for (int redIndex = 1; redIndex <= MaxSideIndex; ++redIndex)
+		T *plane = slice[redIndex][0];
+		if (previousSlice)
 		{
-			int64_t area[SideSize] = { 0 };
-			int64_t areaAlpha[SideSize] = { 0 };
-			int64_t areaRed[SideSize] = { 0 };
-			int64_t areaGreen[SideSize] = { 0 };
-			int64_t areaBlue[SideSize] = { 0 };
-			float area2[SideSize] = { 0 };
-			for (int greenIndex = 1; greenIndex <= MaxSideIndex; ++greenIndex)
+			const T *previous = previousSlice[redIndex][0];
+			for (int i = side; i < side * side; ++i)
 			{
-				int64_t line = 0;
-				int64_t lineAlpha = 0;
-				int64_t lineRed = 0;
-				int64_t lineGreen = 0;
-				int64_t lineBlue = 0;
-				float line2 = 0.0f;
-				for (int blueIndex = 1; blueIndex <= MaxSideIndex; ++blueIndex)
-				{
-					
-					line += data->Weights[alphaIndex][redIndex][greenIndex][blueIndex];
-					lineAlpha += data->MomentsAlpha[alphaIndex][redIndex][greenIndex][blueIndex];
-					lineRed += data->MomentsRed[alphaIndex][redIndex][greenIndex][blueIndex];
-					lineGreen += data->MomentsGreen[alphaIndex][redIndex][greenIndex][blueIndex];
-					lineBlue += data->MomentsBlue[alphaIndex][redIndex][greenIndex][blueIndex];
-					line2 += data->Moments[alphaIndex][redIndex][greenIndex][blueIndex];
-
-					area[blueIndex] += line;
-					areaAlpha[blueIndex] += lineAlpha;
-					areaRed[blueIndex] += lineRed;
-					areaGreen[blueIndex] += lineGreen;
-					areaBlue[blueIndex] += lineBlue;
-					area2[blueIndex] += line2;
-
-					xarea[redIndex][greenIndex][blueIndex] = xarea[redIndex - 1][greenIndex][blueIndex] + area[blueIndex];
-					xareaAlpha[redIndex][greenIndex][blueIndex] = xareaAlpha[redIndex - 1][greenIndex][blueIndex] + areaAlpha[blueIndex];
-					xareaRed[redIndex][greenIndex][blueIndex] = xareaRed[redIndex - 1][greenIndex][blueIndex] + areaRed[blueIndex];
-					xareaGreen[redIndex][greenIndex][blueIndex] = xareaGreen[redIndex - 1][greenIndex][blueIndex] + areaGreen[blueIndex];
-					xareaBlue[redIndex][greenIndex][blueIndex] = xareaBlue[redIndex - 1][greenIndex][blueIndex] + areaBlue[blueIndex];
-					xarea2[redIndex][greenIndex][blueIndex] = xarea2[redIndex - 1][greenIndex][blueIndex] + area2[blueIndex];
-
-					data->Weights[alphaIndex][redIndex][greenIndex][blueIndex] = data->Weights[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xarea[redIndex][greenIndex][blueIndex];
-					data->MomentsAlpha[alphaIndex][redIndex][greenIndex][blueIndex] = data->MomentsAlpha[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xareaAlpha[redIndex][greenIndex][blueIndex];
-					data->MomentsRed[alphaIndex][redIndex][greenIndex][blueIndex] = data->MomentsRed[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xareaRed[redIndex][greenIndex][blueIndex];
-					data->MomentsGreen[alphaIndex][redIndex][greenIndex][blueIndex] = data->MomentsGreen[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xareaGreen[redIndex][greenIndex][blueIndex];
-					data->MomentsBlue[alphaIndex][redIndex][greenIndex][blueIndex] = data->MomentsBlue[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xareaBlue[redIndex][greenIndex][blueIndex];
-					data->Moments[alphaIndex][redIndex][greenIndex][blueIndex] = data->Moments[alphaIndex - 1][redIndex][greenIndex][blueIndex] + xarea2[redIndex][greenIndex][blueIndex];
-				}
+				redSum[i] += plane[i];
+				plane[i] = redSum[i] + previous[i];
 			}
 		}
+		else
+		{
+			const T *previous = slice[redIndex - 1][0];
+			for (int i = side; i < side * side; ++i)
+				plane[i] += previous[i];
+		}
 	}
+}
 
-	delete[] xarea;
-	delete[] xareaAlpha;
-	delete[] xareaRed;
-	delete[] xareaGreen;
-	delete[] xareaBlue;
-	delete[] xarea2;
+template<typename T, int side>
+void PrefixSumAlpha(T(*moment)[side][side][side], int redIndex)
+{
+	for (int alphaIndex = 2; alphaIndex < side; ++alphaIndex)
+	{
+		T *plane = moment[alphaIndex][redIndex][0];
+		const T *previous = moment[alphaIndex - 1][redIndex][0];
+		for (int i = side; i < side * side; ++i)
+			plane[i] += previous[i];
+	}
+}
+
+template<class TColorData>
+void CalculateMoments(const TColorData *data) {
+	typedef typename TColorData::ValueType T;
+	const int side = TColorData::SideSize;
+	T(*moments[])[side][side][side] = {
+		data->Weights,
+		data->MomentsAlpha,
+		data->MomentsRed,
+		data->MomentsGreen,
+		data->MomentsBlue,
+	};
+	//plus data->Moments, which is always 64-bit
+	const int momentCount = sizeof(moments) / sizeof(moments[0]);
+	const int arrayCount = momentCount + 1;
+
+#if defined(OPENMP) && defined(_OPENMP)
+	if (omp_get_max_threads() > arrayCount)
+	{
+		//enough threads to go wide: alpha slices in parallel, then the alpha
+		//axis in parallel over red planes. Costs a second pass over memory.
+#pragma omp parallel for schedule(dynamic)
+		for (int alphaIndex = 1; alphaIndex < side; ++alphaIndex)
+		{
+			for (int m = 0; m < momentCount; m++)
+				PrefixSumSlice<T, side>(moments[m][alphaIndex], NULL);
+			PrefixSumSlice<int64_t, side>(data->Moments[alphaIndex], NULL);
+		}
+
+#pragma omp parallel for schedule(dynamic)
+		for (int redIndex = 1; redIndex < side; ++redIndex)
+		{
+			for (int m = 0; m < momentCount; m++)
+				PrefixSumAlpha<T, side>(moments[m], redIndex);
+			PrefixSumAlpha<int64_t, side>(data->Moments, redIndex);
+		}
+		return;
+	}
+#endif
+
+	//single pass over memory, the moment arrays are independent
+#pragma omp parallel for schedule(dynamic)
+	for (int m = 0; m < arrayCount; m++)
+	{
+		for (int alphaIndex = 1; alphaIndex < side; ++alphaIndex)
+		{
+			if (m < momentCount)
+				PrefixSumSlice<T, side>(moments[m][alphaIndex], moments[m][alphaIndex - 1]);
+			else
+				PrefixSumSlice<int64_t, side>(data->Moments[alphaIndex], data->Moments[alphaIndex - 1]);
+		}
+	}
 }
 
 
-vector<Box> SplitData(int &colorCount, const _ColorData *data) {
+struct BoxVariance
+{
+	float Variance;
+	int Index;
+
+	//max-heap order: larger variance first, lower index on ties, the same
+	//box the linear scan over the variances would pick
+	bool operator<(const BoxVariance &other) const
+	{
+		return Variance < other.Variance || (Variance == other.Variance && Index > other.Index);
+	}
+};
+
+//at most colorCount - 1 boxes, the last palette entry is the transparent color
+template<class TColorData>
+vector<Box> SplitData(int &colorCount, const TColorData *data) {
 	--colorCount;
 	int next = 0;
-	float volumeVariance[MaxColor] = { 0 };
+	priority_queue<BoxVariance> variances;
 	Box cubes[MaxColor] = { 0 };
-	cubes[0].AlphaMaximum = MaxSideIndex;
-	cubes[0].RedMaximum = MaxSideIndex;
-	cubes[0].GreenMaximum = MaxSideIndex;
-	cubes[0].BlueMaximum = MaxSideIndex;
+	cubes[0].AlphaMaximum = TColorData::Granularity;
+	cubes[0].RedMaximum = TColorData::Granularity;
+	cubes[0].GreenMaximum = TColorData::Granularity;
+	cubes[0].BlueMaximum = TColorData::Granularity;
 	for (auto cubeIndex = 1; cubeIndex < colorCount; ++cubeIndex)
 	{
 		if (Cut(data, cubes[next], cubes[cubeIndex]))
 		{
-			volumeVariance[next] = cubes[next].Size > 1 ? CalculateVariance(data, cubes[next]) : 0.0f;
-			volumeVariance[cubeIndex] = cubes[cubeIndex].Size > 1 ? CalculateVariance(data, cubes[cubeIndex]) : 0.0f;
+			//boxes without a positive variance are never split again
+			float variance = cubes[next].Size > 1 ? CalculateVariance(data, cubes[next]) : 0.0f;
+			if (variance > 0.0f) variances.push(BoxVariance{ variance, next });
+			variance = cubes[cubeIndex].Size > 1 ? CalculateVariance(data, cubes[cubeIndex]) : 0.0f;
+			if (variance > 0.0f) variances.push(BoxVariance{ variance, cubeIndex });
 		}
 		else
 		{
-			volumeVariance[next] = 0.0f;
 			cubeIndex--;
 		}
 
-		next = 0;
-		auto temp = volumeVariance[0];
-
-		for (auto index = 1; index <= cubeIndex; ++index)
+		if (!variances.empty())
 		{
-			if (volumeVariance[index] <= temp) continue;
-			temp = volumeVariance[index];
-			next = index;
+			next = variances.top().Index;
+			variances.pop();
+			continue;
 		}
-
-		if (temp > 0.0) continue;
 		colorCount = cubeIndex + 1;
 		break;
 	}
@@ -224,24 +525,21 @@ vector<Box> SplitData(int &colorCount, const _ColorData *data) {
 	return vector<Box>(cubes, cubes + colorCount);
 }
 
-bool Cut(const _ColorData *data, Box &first, Box &second)
+template<class TColorData>
+bool Cut(const TColorData *data, Box &first, Box &second)
 {
 	int direction;
-	auto wholeAlpha = Volume(first, data->MomentsAlpha);
-	auto wholeRed = Volume(first, data->MomentsRed);
-	auto wholeGreen = Volume(first, data->MomentsGreen);
-	auto wholeBlue = Volume(first, data->MomentsBlue);
-	auto wholeWeight = Volume(first, data->Weights);
-	
-	auto maxAlpha = Maximize(data, first, Alpha, (uint8_t)(first.AlphaMinimum + 1), first.AlphaMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-	auto maxRed = Maximize(data, first, Red, (uint8_t)(first.RedMinimum + 1), first.RedMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-	auto maxGreen = Maximize(data, first, Green, (uint8_t)(first.GreenMinimum + 1), first.GreenMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-	auto maxBlue = Maximize(data, first, Blue, (uint8_t)(first.BlueMinimum + 1), first.BlueMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
+	AxisProjection<TColorData::SideSize> projection;
+
+	auto maxAlpha = Maximize(data, first, Alpha, projection);
+	auto maxRed = Maximize(data, first, Red, projection);
+	auto maxGreen = Maximize(data, first, Green, projection);
+	auto maxBlue = Maximize(data, first, Blue, projection);
 
 	if ((maxAlpha.Value >= maxRed.Value) && (maxAlpha.Value >= maxGreen.Value) && (maxAlpha.Value >= maxBlue.Value))
 	{
 		direction = Alpha;
-		if (maxAlpha.Position == NULL) return false;
+		if (maxAlpha.Position == 0) return false;
 	}
 	else if ((maxRed.Value >= maxAlpha.Value) && (maxRed.Value >= maxGreen.Value) && (maxRed.Value >= maxBlue.Value))
 		direction = Red;
@@ -295,205 +593,170 @@ bool Cut(const _ColorData *data, Box &first, Box &second)
 	return true;
 }
 
-CubeCut Maximize(const _ColorData *data, const Box &cube, int direction, uint8_t first, uint8_t last, int64_t wholeAlpha, int64_t wholeRed, int64_t wholeGreen, int64_t wholeBlue, int64_t wholeWeight)
+/* The moments of a box up to a position along one axis are the four
+ * positive minus the four negative corner lines of the other three axes
+ * (inclusion-exclusion). The
+ * axis constants double as the exponent of the index stride, so the
+ * offsets are shared by all five moment arrays. */
+template<int side>
+void CornerOffsets(const Box &cube, int direction, size_t *plus, size_t *minus)
 {
-	auto bottomAlpha = Bottom(cube, direction, data->MomentsAlpha);
-	auto bottomRed = Bottom(cube, direction, data->MomentsRed);
-	auto bottomGreen = Bottom(cube, direction, data->MomentsGreen);
-	auto bottomBlue = Bottom(cube, direction, data->MomentsBlue);
-	auto bottomWeight = Bottom(cube, direction, data->Weights);
-
-	auto result = 0.0f;
-	uint8_t cutPoint = 0;
-	bool hasCutPoint = false;
+	const size_t stride[4] = { 1, side, side * side, (size_t)side * side * side };
+	const uint8_t minimum[4] = { cube.BlueMinimum, cube.GreenMinimum, cube.RedMinimum, cube.AlphaMinimum };
+	const uint8_t maximum[4] = { cube.BlueMaximum, cube.GreenMaximum, cube.RedMaximum, cube.AlphaMaximum };
 
-	for (auto position = first; position < last; ++position)
+	for (int corner = 0; corner < 8; corner++)
 	{
-		auto halfAlpha = bottomAlpha + Top(cube, direction, position, data->MomentsAlpha);
-		auto halfRed = bottomRed + Top(cube, direction, position, data->MomentsRed);
-		auto halfGreen = bottomGreen + Top(cube, direction, position, data->MomentsGreen);
-		auto halfBlue = bottomBlue + Top(cube, direction, position, data->MomentsBlue);
-		auto halfWeight = bottomWeight + Top(cube, direction, position, data->Weights);
-
-		if (halfWeight == 0) continue;
-
-		auto halfDistance = halfAlpha * halfAlpha + halfRed * halfRed + halfGreen * halfGreen + halfBlue * halfBlue;
-		auto temp = halfDistance / halfWeight;
-
-		halfAlpha = wholeAlpha - halfAlpha;
-		halfRed = wholeRed - halfRed;
-		halfGreen = wholeGreen - halfGreen;
-		halfBlue = wholeBlue - halfBlue;
-		halfWeight = wholeWeight - halfWeight;
-
-		if (halfWeight != 0)
+		size_t offset = 0;
+		bool negative = false;
+		for (int axis = 0, bit = 0; axis < 4; axis++)
 		{
-			halfDistance = halfAlpha * halfAlpha + halfRed * halfRed + halfGreen * halfGreen + halfBlue * halfBlue;
-			temp += halfDistance / halfWeight;
-
-			if (temp > result)
-			{
-				result = static_cast<float>(temp);
-				cutPoint = position;
-				hasCutPoint = true;
-			}
+			if (axis == direction) continue;
+			bool upper = (corner >> bit++) & 1;
+			offset += (upper ? maximum[axis] : minimum[axis]) * stride[axis];
+			negative ^= !upper;
 		}
+		if (negative) *minus++ = offset;
+		else *plus++ = offset;
 	}
-
-	return CubeCut(cutPoint, hasCutPoint, result);
 }
 
-template<int _1, int _2, int _3>
-int64_t Volume(const Box &cube, int64_t(* moment)[_1][_2][_3])
-{
-	return (moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] -
-		moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] -
-		moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] +
-		moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum] -
-		moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] +
-		moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] +
-		moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] -
-		moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-
-		(moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
-			moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] -
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum] -
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
-}
-
-template<int _1, int _2, int _3>
-float VolumeFloat(const Box &cube, float (*moment)[_1][_2][_3])
-{
-	return (moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] -
-		moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] -
-		moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] +
-		moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum] -
-		moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] +
-		moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] +
-		moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] -
-		moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-
-		(moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
-			moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] -
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum] -
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
-}
-
-template<int _1, int _2, int _3>
-int64_t Top(const Box &cube, int direction, int position, int64_t (*moment)[_1][_2][_3])
+#define PROJECT_CORNERS(values, i) \
+	((int64_t)values[i + plus[0]] + values[i + plus[1]] + values[i + plus[2]] + values[i + plus[3]] \
+		- values[i + minus[0]] - values[i + minus[1]] - values[i + minus[2]] - values[i + minus[3]])
+
+/* Fills the 1D prefix arrays of the box along one axis: the sums at the
+ * box minimum and at every position whose slab holds pixels.
+ * Weights are never negative, so a slab that adds no weight adds nothing
+ * to any moment and the position repeats the previous entry's sums; it
+ * can neither be cut at with an empty half nor score higher than the
+ * position before it, and is left out. */
+template<class TColorData>
+void Project(const TColorData *data, const Box &cube, int direction, AxisProjection<TColorData::SideSize> &projection)
 {
-	switch (direction)
+	const int side = TColorData::SideSize;
+	const size_t step = direction == Blue ? 1 : direction == Green ? side : direction == Red ? side * side : (size_t)side * side * side;
+	const uint8_t minimum[4] = { cube.BlueMinimum, cube.GreenMinimum, cube.RedMinimum, cube.AlphaMinimum };
+	const uint8_t maximum[4] = { cube.BlueMaximum, cube.GreenMaximum, cube.RedMaximum, cube.AlphaMaximum };
+	size_t plus[4], minus[4];
+	CornerOffsets<side>(cube, direction, plus, minus);
+
+	const typename TColorData::ValueType *alpha = &data->MomentsAlpha[0][0][0][0];
+	const typename TColorData::ValueType *red = &data->MomentsRed[0][0][0][0];
+	const typename TColorData::ValueType *green = &data->MomentsGreen[0][0][0][0];
+	const typename TColorData::ValueType *blue = &data->MomentsBlue[0][0][0][0];
+	const typename TColorData::ValueType *weight = &data->Weights[0][0][0][0];
+
+	int count = 0;
+	int64_t previous = 0;
+	for (int position = minimum[direction]; position <= maximum[direction]; ++position)
 	{
-	case Alpha:
-		return (moment[position][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] -
-			moment[position][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] -
-			moment[position][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] +
-			moment[position][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-			(moment[position][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
-				moment[position][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] -
-				moment[position][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-				moment[position][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
-
-	case Red:
-		return (moment[cube.AlphaMaximum][position][cube.GreenMaximum][cube.BlueMaximum] -
-			moment[cube.AlphaMaximum][position][cube.GreenMinimum][cube.BlueMaximum] -
-			moment[cube.AlphaMinimum][position][cube.GreenMaximum][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][position][cube.GreenMinimum][cube.BlueMaximum]) -
-			(moment[cube.AlphaMaximum][position][cube.GreenMaximum][cube.BlueMinimum] -
-				moment[cube.AlphaMaximum][position][cube.GreenMinimum][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][position][cube.GreenMaximum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][position][cube.GreenMinimum][cube.BlueMinimum]);
-
-	case Green:
-		return (moment[cube.AlphaMaximum][cube.RedMaximum][position][cube.BlueMaximum] -
-			moment[cube.AlphaMaximum][cube.RedMinimum][position][cube.BlueMaximum] -
-			moment[cube.AlphaMinimum][cube.RedMaximum][position][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][cube.RedMinimum][position][cube.BlueMaximum]) -
-			(moment[cube.AlphaMaximum][cube.RedMaximum][position][cube.BlueMinimum] -
-				moment[cube.AlphaMaximum][cube.RedMinimum][position][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][cube.RedMaximum][position][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMinimum][position][cube.BlueMinimum]);
-
-	case Blue:
-		return (moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][position] -
-			moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][position] -
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][position] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][position]) -
-			(moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][position] -
-				moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][position] -
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][position] +
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][position]);
-
-	default:
-		return 0;
+		size_t i = position * step;
+		int64_t sum = PROJECT_CORNERS(weight, i);
+		if (count > 0 && sum == previous) continue;
+
+		projection.Position[count] = (uint8_t)position;
+		projection.Weight[count] = previous = sum;
+		projection.Alpha[count] = PROJECT_CORNERS(alpha, i);
+		projection.Red[count] = PROJECT_CORNERS(red, i);
+		projection.Green[count] = PROJECT_CORNERS(green, i);
+		projection.Blue[count] = PROJECT_CORNERS(blue, i);
+		count++;
 	}
+	projection.Count = count;
 }
 
-template<int _1, int _2, int _3>
-int64_t Bottom(const Box &cube, int direction, int64_t (*moment)[_1][_2][_3])
+#undef PROJECT_CORNERS
+
+/* Scores the candidate cut positions along one axis from the projection.
+ * The half sums and distances are plain array loops the compiler
+ * vectorizes; the integer divisions and the float comparison are exactly
+ * those of the per-position search, so the chosen cut does not change. */
+template<class TColorData>
+CubeCut Maximize(const TColorData *data, const Box &cube, int direction, AxisProjection<TColorData::SideSize> &projection)
 {
-	switch (direction)
+	const int side = TColorData::SideSize;
+	const uint8_t maximum[4] = { cube.BlueMaximum, cube.GreenMaximum, cube.RedMaximum, cube.AlphaMaximum };
+
+	Project(data, cube, direction, projection);
+
+	//entry 0 is the bottom, the last entry has the sums of the whole box
+	const int count = projection.Count;
+	const int64_t *alpha = projection.Alpha, *red = projection.Red, *green = projection.Green, *blue = projection.Blue, *weight = projection.Weight;
+	int64_t wholeAlpha = alpha[count - 1] - alpha[0];
+	int64_t wholeRed = red[count - 1] - red[0];
+	int64_t wholeGreen = green[count - 1] - green[0];
+	int64_t wholeBlue = blue[count - 1] - blue[0];
+	int64_t wholeWeight = weight[count - 1] - weight[0];
+
+	int64_t halfDistance[side], otherDistance[side], halfWeight[side], otherWeight[side];
+	for (int k = 1; k < count; ++k)
 	{
-	case Alpha:
-		return (-moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] -
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-			(-moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
+		int64_t halfAlpha = alpha[k] - alpha[0];
+		int64_t halfRed = red[k] - red[0];
+		int64_t halfGreen = green[k] - green[0];
+		int64_t halfBlue = blue[k] - blue[0];
+		int64_t otherAlpha = wholeAlpha - halfAlpha;
+		int64_t otherRed = wholeRed - halfRed;
+		int64_t otherGreen = wholeGreen - halfGreen;
+		int64_t otherBlue = wholeBlue - halfBlue;
+
+		halfDistance[k] = halfAlpha * halfAlpha + halfRed * halfRed + halfGreen * halfGreen + halfBlue * halfBlue;
+		otherDistance[k] = otherAlpha * otherAlpha + otherRed * otherRed + otherGreen * otherGreen + otherBlue * otherBlue;
+		halfWeight[k] = weight[k] - weight[0];
+		otherWeight[k] = wholeWeight - halfWeight[k];
+	}
 
-	case Red:
-		return (-moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] -
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-			(-moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
-				moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
+	auto result = 0.0f;
+	uint8_t cutPoint = 0;
+	bool hasCutPoint = false;
 
-	case Green:
-		return (-moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum] +
-			moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] -
-			moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
-			(-moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-				moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
+	for (int k = 1; k < count && projection.Position[k] < maximum[direction]; ++k)
+	{
+		if (halfWeight[k] == 0 || otherWeight[k] == 0) continue;
 
-	case Blue:
-		return (-moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] +
-			moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] -
-			moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]) -
-			(-moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] -
-				moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
-
-	default:
-		return 0;
+		int64_t temp = halfDistance[k] / halfWeight[k] + otherDistance[k] / otherWeight[k];
+		if (temp > result)
+		{
+			result = static_cast<float>(temp);
+			cutPoint = projection.Position[k];
+			hasCutPoint = true;
+		}
 	}
+
+	return CubeCut(cutPoint, hasCutPoint, result);
 }
 
-float CalculateVariance(const _ColorData *data, const Box &cube)
+template<typename T, int _1, int _2, int _3>
+int64_t Volume(const Box &cube, T(* moment)[_1][_2][_3])
+{
+	return ((int64_t)moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] -
+		(int64_t)moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] -
+		(int64_t)moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] +
+		(int64_t)moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum] -
+		(int64_t)moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMaximum] +
+		(int64_t)moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMaximum] +
+		(int64_t)moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMaximum] -
+		(int64_t)moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMaximum]) -
+
+		((int64_t)moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
+			(int64_t)moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMaximum][cube.BlueMinimum] -
+			(int64_t)moment[cube.AlphaMaximum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] +
+			(int64_t)moment[cube.AlphaMinimum][cube.RedMaximum][cube.GreenMinimum][cube.BlueMinimum] -
+			(int64_t)moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
+			(int64_t)moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMaximum][cube.BlueMinimum] +
+			(int64_t)moment[cube.AlphaMaximum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum] -
+			(int64_t)moment[cube.AlphaMinimum][cube.RedMinimum][cube.GreenMinimum][cube.BlueMinimum]);
+}
+
+template<class TColorData>
+float CalculateVariance(const TColorData *data, const Box &cube)
 {
 	float volumeAlpha = static_cast<float>(Volume(cube, data->MomentsAlpha));
 	float volumeRed = static_cast<float>(Volume(cube, data->MomentsRed));
 	float volumeGreen = static_cast<float>(Volume(cube, data->MomentsGreen));
 	float volumeBlue = static_cast<float>(Volume(cube, data->MomentsBlue));
-	float volumeMoment = static_cast<float>(VolumeFloat(cube, data->Moments));
+	float volumeMoment = static_cast<float>(Volume(cube, data->Moments));
 	float volumeWeight = static_cast<float>(Volume(cube, data->Weights));
 
 	float distance = volumeAlpha * volumeAlpha + volumeRed * volumeRed + volumeGreen * volumeGreen + volumeBlue * volumeBlue;
@@ -503,105 +766,186 @@ float CalculateVariance(const _ColorData *data, const Box &cube)
 	return isnan(result) ? 0.0f : result;
 }
 
-QuantizedPalette GetQuantizedPalette(int colorCount, _ColorData *data, const vector<Box> &cubes)
+/* Maps the source onto the box colors, writing the 8-bit indices straight
+ * into the destination; the palette entries are then the means of the
+ * pixels mapped to them, followed by the transparent entry. */
+template<class TColorData>
+QuantizedPalette GetQuantizedPalette(int colorCount, const TColorData *data, const vector<Box> &cubes, const BitmapData *sourceImage, const IndexedBitmapData *destImage)
 {
-	int imageSize = data->Pixels.size();
 	auto lookups = BuildLookups(cubes, data);
+	vector<ColorSums> sums(colorCount + 1, ColorSums());
+	QuantizedPalette palette;
+
+	MapAllPixels<IndexShift(TColorData::Granularity)>(sourceImage, destImage, lookups, (uint8_t)colorCount, &sums[0]);
 
-	for (auto index = 0; index < imageSize; ++index)
+	for (auto paletteIndex = 0; paletteIndex < colorCount; paletteIndex++)
 	{
-		auto indexParts = data->QuantizedPixels[index];
-		data->QuantizedPixels[index] = PixelIndex(lookups.Tags
-			[indexParts.PixelValue.Alpha][indexParts.PixelValue.Red][indexParts.PixelValue.Green][indexParts.PixelValue.Blue]);
+		ColorSums &sum = sums[paletteIndex];
+		if (sum.Count > 0)
+		{
+			sum.Alpha /= sum.Count;
+			sum.Red /= sum.Count;
+			sum.Green /= sum.Count;
+			sum.Blue /= sum.Count;
+		}
+
+		auto color = Pixel(sum.Alpha, sum.Red, sum.Green, sum.Blue);
+		palette.Colors.push_back(color);
 	}
+	palette.Colors.push_back(Pixel(0, 0, 0, 0));
 
-	auto alphas = new uint64_t[colorCount + 1]{ 0 };
-	auto reds = new uint64_t[colorCount + 1]{ 0 };
-	auto greens = new uint64_t[colorCount + 1]{ 0 };
-	auto blues = new uint64_t[colorCount + 1]{ 0 };
-	auto sums = new uint32_t[colorCount + 1]{ 0 };
-	QuantizedPalette palette(imageSize);
+	return palette;
+}
 
+/* Maps every pixel to its nearest lookup color and writes the 8-bit index;
+ * pixels at or below the alpha threshold get transparentIndex. When sums
+ * is given, the mapped pixels are accumulated per index. When error is
+ * given, the squared distances are summed and the mapping stops, returning
+ * false, as soon as the sum or one distance passes its limit. */
+template<int shift>
+bool MapPixels(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const vector<Lookup> &lookups, uint8_t transparentIndex, ColorSums *sums, MappingError *error)
+{
+	const int lookupCount = lookups.size();
+	int sourceByteLength = sourceImage->Stride < 0 ? -sourceImage->Stride : sourceImage->Stride;
+	int targetByteLength = destImage->Data.Stride < 0 ? -destImage->Data.Stride : destImage->Data.Stride;
+
+	for (int y = 0, y1 = sourceImage->Height, x1 = sourceImage->Width; y < y1; y++)
 	{
-		for (int i = 0; i < imageSize; i++)
+		const uint8_t *source = static_cast<const uint8_t*>(sourceImage->Scan0) + (size_t)y * sourceByteLength;
+		uint8_t *target = static_cast<uint8_t*>(destImage->Data.Scan0) + (size_t)y * targetByteLength;
+
+		//runs of one color are common, the previous pixel's match is reused
+		uint32_t lastValue = 0;
+		uint32_t lastMatch = transparentIndex;
+		uint32_t lastDistance = 0;
+		bool hasLast = false;
+
+		for (int x = 0; x < x1; x++)
 		{
-			const Pixel &pixel = data->Pixels[i];
-			palette.PixelIndex[i] = -1;
+			PixelIndex index;
+			Pixel pixel;
+			ReadPixel<shift>(source + x * 4, index, pixel);
 			if (pixel.Alpha <= AlphaThreshold)
+			{
+				target[x] = transparentIndex;
 				continue;
+			}
 
-			auto match = data->QuantizedPixels[i];
-			auto bestMatch = match.Value;
-			uint32_t bestDistance = 100000000;
-
-			for (int j = 0, j1 = lookups.Lookups.size(); j < j1; j++)
+			uint32_t value;
+			memcpy(&value, source + x * 4, 4);
+			uint32_t bestMatch = 0;
+			if (hasLast && value == lastValue)
 			{
-				auto deltaAlpha = pixel.Alpha - lookups.Lookups[j].Alpha;
-				auto deltaRed = pixel.Red - lookups.Lookups[j].Red;
-				auto deltaGreen = pixel.Green - lookups.Lookups[j].Green;
-				auto deltaBlue = pixel.Blue - lookups.Lookups[j].Blue;
+				bestMatch = lastMatch;
+			}
+			else
+			{
+				uint32_t bestDistance = 100000000;
+
+				for (int j = 0; j < lookupCount; j++)
+				{
+					auto deltaAlpha = pixel.Alpha - lookups[j].Alpha;
+					auto deltaRed = pixel.Red - lookups[j].Red;
+					auto deltaGreen = pixel.Green - lookups[j].Green;
+					auto deltaBlue = pixel.Blue - lookups[j].Blue;
 
-				auto distance = deltaAlpha * deltaAlpha + deltaRed * deltaRed + deltaGreen * deltaGreen + deltaBlue * deltaBlue;
+					auto distance = deltaAlpha * deltaAlpha + deltaRed * deltaRed + deltaGreen * deltaGreen + deltaBlue * deltaBlue;
 
-				if (distance >= bestDistance) continue;
+					if (distance >= bestDistance) continue;
 
-				bestDistance = distance;
-				bestMatch = j;
+					bestDistance = distance;
+					bestMatch = j;
+				}
+
+				lastValue = value;
+				lastMatch = bestMatch;
+				lastDistance = bestDistance;
+				hasLast = true;
 			}
 
-			palette.PixelIndex[i] = bestMatch;
+			target[x] = (uint8_t)bestMatch;
 
-			alphas[bestMatch] += pixel.Alpha;
-			reds[bestMatch] += pixel.Red;
-			greens[bestMatch] += pixel.Green;
-			blues[bestMatch] += pixel.Blue;
-			sums[bestMatch]++;
+			if (error)
+			{
+				error->Sum += lastDistance;
+				if (lastDistance > error->Max) error->Max = lastDistance;
+				if (error->Sum > error->SumLimit || lastDistance > error->MaxLimit) return false;
+			}
+
+			if (sums)
+			{
+				sums[bestMatch].Alpha += pixel.Alpha;
+				sums[bestMatch].Red += pixel.Red;
+				sums[bestMatch].Green += pixel.Green;
+				sums[bestMatch].Blue += pixel.Blue;
+				sums[bestMatch].Count++;
+			}
 		}
 	}
+	return true;
+}
 
-	for (auto paletteIndex = 0; paletteIndex < colorCount; paletteIndex++)
+/* MapPixels without an error limit. Large images are cut into one band of
+ * rows per thread, each with its own sums added up at the end; the run of
+ * one color MapPixels reuses ends with the row, so the indices and the
+ * integer sums are the same as from one pass. */
+template<int shift>
+void MapAllPixels(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const vector<Lookup> &lookups, uint8_t transparentIndex, ColorSums *sums)
+{
+#if defined(OPENMP) && defined(_OPENMP)
+	if (sourceImage->Width * sourceImage->Height >= ParallelMappingThreshold && omp_get_max_threads() > 1)
 	{
-		if (sums[paletteIndex] > 0)
+		int sourceByteLength = sourceImage->Stride < 0 ? -sourceImage->Stride : sourceImage->Stride;
+		int targetByteLength = destImage->Data.Stride < 0 ? -destImage->Data.Stride : destImage->Data.Stride;
+		int height = sourceImage->Height;
+		//the lookups and the transparent entry, as in the sums given
+		size_t sumCount = lookups.size() + 1;
+
+#pragma omp parallel
 		{
-			alphas[paletteIndex] = alphas[paletteIndex] / sums[paletteIndex];
-			reds[paletteIndex] = reds[paletteIndex] / sums[paletteIndex];
-			greens[paletteIndex] = greens[paletteIndex] / sums[paletteIndex];
-			blues[paletteIndex] = blues[paletteIndex] / sums[paletteIndex];
+			int threads = omp_get_num_threads();
+			int thread = omp_get_thread_num();
+			int y0 = (int)((int64_t)height * thread / threads);
+			int y1 = (int)((int64_t)height * (thread + 1) / threads);
+
+			BitmapData band = *sourceImage;
+			band.Height = y1 - y0;
+			band.Scan0 = static_cast<uint8_t*>(sourceImage->Scan0) + (size_t)y0 * sourceByteLength;
+			IndexedBitmapData bandTarget = *destImage;
+			bandTarget.Data.Height = y1 - y0;
+			bandTarget.Data.Scan0 = static_cast<uint8_t*>(destImage->Data.Scan0) + (size_t)y0 * targetByteLength;
+
+			vector<ColorSums> bandSums(sums ? sumCount : 0, ColorSums());
+			MapPixels<shift>(&band, &bandTarget, lookups, transparentIndex, sums ? &bandSums[0] : NULL);
+
+			if (sums)
+			{
+#pragma omp critical
+				for (size_t i = 0; i < sumCount; i++)
+				{
+					sums[i].Alpha += bandSums[i].Alpha;
+					sums[i].Red += bandSums[i].Red;
+					sums[i].Green += bandSums[i].Green;
+					sums[i].Blue += bandSums[i].Blue;
+					sums[i].Count += bandSums[i].Count;
+				}
+			}
 		}
-
-		auto color = Pixel(alphas[paletteIndex], reds[paletteIndex], greens[paletteIndex], blues[paletteIndex]);
-		palette.Colors.push_back(color);
+		return;
 	}
-	palette.Colors.push_back(Pixel(0, 0, 0, 0));
-
-	delete[] alphas;
-	delete[] reds;
-	delete[] greens;
-	delete[] blues;
-	delete[] sums;
+#endif
 
-	return palette;
+	MapPixels<shift>(sourceImage, destImage, lookups, transparentIndex, sums);
 }
 
-_LookupData BuildLookups(const vector<Box> &cubes, const _ColorData *data)
+template<class TColorData>
+vector<Lookup> BuildLookups(const vector<Box> &cubes, const TColorData *data)
 {
-	_LookupData lookups;
+	vector<Lookup> lookups;
 
 	for (int i = 0, i1 = cubes.size(); i < i1; i++)
 	{
 		const Box& cube = cubes[i];
-		for (auto alphaIndex = (uint8_t)(cube.AlphaMinimum + 1); alphaIndex <= cube.AlphaMaximum; ++alphaIndex)
-		{
-			for (auto redIndex = (uint8_t)(cube.RedMinimum + 1); redIndex <= cube.RedMaximum; ++redIndex)
-			{
-				for (auto greenIndex = (uint8_t)(cube.GreenMinimum + 1); greenIndex <= cube.GreenMaximum; ++greenIndex)
-				{
-					for (auto blueIndex = (uint8_t)(cube.BlueMinimum + 1); blueIndex <= cube.BlueMaximum; ++blueIndex)
-						lookups.Tags[alphaIndex][redIndex][greenIndex][blueIndex] = lookups.Lookups.size();
-				}
-			}
-		}
-
 		auto weight = Volume(cube, data->Weights);
 
 		if (weight <= 0) continue;
@@ -612,42 +956,83 @@ _LookupData BuildLookups(const vector<Box> &cubes, const _ColorData *data)
 		lookup.Red = (int)(Volume(cube, data->MomentsRed) / weight);
 		lookup.Green = (int)(Volume(cube, data->MomentsGreen) / weight);
 		lookup.Blue = (int)(Volume(cube, data->MomentsBlue) / weight);
-		lookups.Lookups.push_back(lookup);
+		lookups.push_back(lookup);
 	}
 
 	return lookups;
 }
 
-void ProcessImagePixels(const BitmapData *sourceImage, const QuantizedPalette *palette, const IndexedBitmapData *destImage) {
-	memcpy_s(destImage->Palette, destImage->ColorCount * sizeof(Pixel), &palette->Colors[0], palette->Colors.size() * sizeof(Pixel));
+GlobalPalette::GlobalPalette(const QuantizeOptions *options) :
+	fineData(NULL),
+	coarseData(NULL),
+	built(false)
+{
+	QuantizeEffort effort = options ? options->Effort : QuantizeEffort::Auto;
+	//the summed pixel count is unknown up front, so Auto keeps the fine cube
+	if (effort == QuantizeEffort::Fast) coarseData = new _CoarseColorData();
+	else fineData = new _ColorData();
+}
 
-	const uint8_t targetBitDepth = 8;
-	auto targetByteLength = destImage->Data.Stride < 0 ? -destImage->Data.Stride : destImage->Data.Stride;
-	const int targetByteCount = max(1, targetBitDepth >> 3);
-	auto targetSize = targetByteLength * destImage->Data.Height;
-	auto targetOffset = 0;
-	//auto targetBuffer = new byte[targetSize];
-	uint8_t *targetBuffer = static_cast<uint8_t*>(destImage->Data.Scan0);
-	uint8_t targetValue[targetByteCount] = { 0 };
-	auto pixelIndex = 0;
+GlobalPalette::~GlobalPalette()
+{
+	delete fineData;
+	delete coarseData;
+}
 
-	for (int y = 0, y1 = destImage->Data.Height, x1 = destImage->Data.Width; y < y1; y++)
-	{
-		auto targetIndex = 0;
-		for (auto x = 0; x < x1; x++)
-		{
-			auto targetIndexOffset = targetIndex >> 3;
-			targetValue[0] = (uint8_t)(palette->PixelIndex[pixelIndex] == -1 ? palette->Colors.size() - 1 : palette->PixelIndex[pixelIndex]);
-			pixelIndex++;
+void GlobalPalette::AddImage(const BitmapData *sourceImage)
+{
+	if (built) return;
+	if (coarseData) AccumulateHistogram(sourceImage, *coarseData);
+	else AccumulateHistogram(sourceImage, *fineData);
+}
 
-			for (auto valueIndex = 0; valueIndex < targetByteCount; valueIndex++)
-				targetBuffer[targetOffset + valueIndex + targetIndexOffset] = targetValue[valueIndex];
+/* Writes the box colors followed by the transparent entry and returns the
+ * entry count; maxColors includes the transparent entry. */
+int GlobalPalette::Build(Pixel *palette, int maxColors)
+{
+	if (built || maxColors < 2) return 0;
+	int count = coarseData ? Build(coarseData, palette, maxColors) : Build(fineData, palette, maxColors);
+
+	//the moments replace the histogram, keep only the lookups
+	delete fineData;
+	delete coarseData;
+	fineData = NULL;
+	coarseData = NULL;
+	built = true;
+	return count;
+}
 
-			targetIndex += targetBitDepth;
-		}
+template<class TColorData>
+int GlobalPalette::Build(TColorData *data, Pixel *palette, int maxColors)
+{
+	int colorCount = min(maxColors, MaxColor);
+	CalculateMoments(data);
+	auto cubes = SplitData(colorCount, data);
+	lookups = BuildLookups(cubes, data);
 
-		targetOffset += targetByteLength;
+	int count = 0;
+	for (auto &lookup : lookups)
+	{
+		palette[count++] = Pixel(lookup.Alpha, lookup.Red, lookup.Green, lookup.Blue);
 	}
+	palette[count++] = Pixel(0, 0, 0, 0);
+	return count;
+}
+
+void GlobalPalette::MapImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage) const
+{
+	//mapping reads the pixel values only, the index shift does not matter
+	uint8_t transparentIndex = (uint8_t)lookups.size();
+	MapAllPixels<IndexShift(MaxSideIndex)>(sourceImage, destImage, lookups, transparentIndex, NULL);
+}
+
+#define INSTANTIATE_QUANTIZER(TColorData) \
+	template TColorData BuildHistogram<TColorData>(const BitmapData *sourceImage, const Deadline *deadline); \
+	template void CalculateMoments<TColorData>(const TColorData *data); \
+	template vector<Box> SplitData<TColorData>(int &colorCount, const TColorData *data); \
+	template QuantizedPalette GetQuantizedPalette<TColorData>(int colorCount, const TColorData *data, const vector<Box> &cubes, const BitmapData *sourceImage, const IndexedBitmapData *destImage);
 
-	//Marshal.Copy(targetBuffer, 0, targetData.Scan0, targetSize);
-}
\ No newline at end of file
+INSTANTIATE_QUANTIZER(_ColorData)
+INSTANTIATE_QUANTIZER(_ColorData32)
+INSTANTIATE_QUANTIZER(_CoarseColorData)
+INSTANTIATE_QUANTIZER(_CoarseColorData32)
@@ -2,6 +2,11 @@
 
 #include <stdint.h>
 #include "quartTypes.h"
+#include "EncodeBudget.h"
+
+#ifndef _WIN32
+#define __stdcall
+#endif
 
 const int AlphaThreshold = 10;
 const int MaxColor = 256;
@@ -11,7 +16,17 @@ const int Green = 1;
 const int Blue = 0;
 const int SideSize = 33;
 const int MaxSideIndex = 32;
+const int CoarseSideIndex = 16;
 const int BitDepth = 32;
+const int ParallelHistogramThreshold = 256 * 256;
+//pixels each thread stages per round of the parallel histogram
+const int HistogramRoundPixels = 65536;
+//frames from this size are mapped to their palette and expanded in row bands, one per thread
+const int ParallelMappingThreshold = 256 * 256;
+//frames up to this size get the 17^4 histogram under QuantizeEffort::Auto
+const int CoarseHistogramPixelLimit = 320 * 240;
+//largest pixel count whose first-order moments fit in int32_t
+const int64_t NarrowAccumulatorPixelLimit = INT32_MAX / 255;
 
 struct BitmapData {
 	int Width;
@@ -27,6 +42,76 @@ struct IndexedBitmapData {
 	int ColorCount;
 };
 
-void __stdcall QuantizeImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage);
+enum struct QuantizeEffort : int {
+	Auto = 0,	//coarse histogram for small frames, fine otherwise
+	Fast = 1,	//16 levels per channel
+	Best = 2,	//32 levels per channel
+};
+
+class FrameArena;
+
+struct QuantizeOptions {
+	QuantizeEffort Effort;
+	Deadline Limit;	//the histogram keeps the rows read so far once it expires
+	FrameArena *Arena;	//backs the histogram cubes when set, else the heap
+
+	QuantizeOptions() : Effort(QuantizeEffort::Auto), Arena(NULL) {
+	}
+};
+
+struct RemapLimits {
+	int MeanError;	//root mean square RGBA distance over the frame
+	int MaxError;	//largest distance of one pixel, 0 for no limit
+};
 
+/* writes up to destImage->ColorCount entries, the last one transparent,
+ * and returns how many were used; 0 when options->Limit expired first */
+int __stdcall QuantizeImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const QuantizeOptions *options = NULL);
+/* the most QuantizeImage takes from options->Arena for an image of this
+ * size: the cubes and the staging of the parallel histogram */
+size_t __stdcall QuantizeArenaBytes(int width, int height, const QuantizeOptions *options = NULL);
+/* maps onto the existing destImage->Palette (last entry transparent); false
+ * when the error passes the limits, the indices are then incomplete */
+bool __stdcall RemapImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage, const RemapLimits *limits);
 
+typedef ColorData<MaxSideIndex> _ColorData;
+typedef ColorData<MaxSideIndex, int32_t> _ColorData32;
+typedef ColorData<CoarseSideIndex> _CoarseColorData;
+typedef ColorData<CoarseSideIndex, int32_t> _CoarseColorData32;
+
+/* the stages are instantiated for the four ColorData types above */
+template<class TColorData>
+TColorData BuildHistogram(const BitmapData *sourceImage, const Deadline *deadline = NULL);
+template<class TColorData>
+void CalculateMoments(const TColorData *data);
+template<class TColorData>
+vector<Box> SplitData(int &colorCount, const TColorData *data);
+template<class TColorData>
+QuantizedPalette GetQuantizedPalette(int colorCount, const TColorData *data, const vector<Box> &cubes, const BitmapData *sourceImage, const IndexedBitmapData *destImage);
+
+/* One palette for a whole animation: the histograms of all added images are
+ * summed and the cuts are searched once, so each frame only pays the mapping.
+ * Entry Build() - 1 is the transparent color. */
+class GlobalPalette
+{
+public:
+	GlobalPalette(const QuantizeOptions *options = NULL);
+	~GlobalPalette();
+
+	void AddImage(const BitmapData *sourceImage);
+	int Build(Pixel *palette, int maxColors);
+	void MapImage(const BitmapData *sourceImage, const IndexedBitmapData *destImage) const;
+	bool IsBuilt() const { return built; }
+
+private:
+	GlobalPalette(const GlobalPalette &);
+	GlobalPalette &operator=(const GlobalPalette &);
+
+	template<class TColorData>
+	int Build(TColorData *data, Pixel *palette, int maxColors);
+
+	_ColorData *fineData;
+	_CoarseColorData *coarseData;
+	vector<Lookup> lookups;
+	bool built;
+};
@@ -1,25 +1,18 @@
-#include "libapng.h"
-#include "WuQuantizer.h"
+#include "libapngInternal.h"
+#include "CaptureRing.h"
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <new>
 #include <png.h>
 #include <zlib.h>
 
-struct RECT {
-	int x, y, width, height;
-};
-
 #pragma region Constants
-
-#pragma endregion
-
-#pragma region Function Declarations
-
-void write_chunk(ApngEncoder *enc, const char *name, unsigned char *data, unsigned int length);
-void write_IDATs(ApngEncoder *enc, unsigned char *data, unsigned int length, unsigned int idat_size);
-void get_rect(const BitmapData *bmpData, RECT *rect);
-void process_rect(ApngEncoder *pEnc, BitmapData *image, unsigned char *dest);
-ApngError OptimizeImage(BitmapData *bmpData);
-void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter);
-void deflate_rect_fin(ApngEncoder *pEnc, BitmapData *image, bool filter, unsigned int *zsize);
+//the state of a final deflate stream, 15-bit window and memLevel 9, with room to spare
+static const size_t DeflateStateBytes = 512 * 1024;
 #pragma endregion
 
 
@@ -32,7 +25,7 @@ APNG_API(ApngError) apng_init(wchar_t *fileName, int width, int height, ApngEnco
 		goto __failed;
 	}
 
-	if (_wfopen_s(&pEnc->hFile, fileName, L"wb")) {
+	if (!(pEnc->hFile = open_file(fileName, "wb"))) {
 		err = ApngError::FileError;
 		goto __failed;
 	}
@@ -44,17 +37,13 @@ APNG_API(ApngError) apng_init(wchar_t *fileName, int width, int height, ApngEnco
 	pEnc->acTLPos = -1;
 
 	//zlib init
-	pEnc->op_zstream1.data_type = Z_BINARY;
-	pEnc->op_zstream1.zalloc = Z_NULL;
-	pEnc->op_zstream1.zfree = Z_NULL;
-	pEnc->op_zstream1.opaque = Z_NULL;
-	auto r1 = deflateInit2(&pEnc->op_zstream1, Z_BEST_SPEED + 1, 8, 15, 8, Z_DEFAULT_STRATEGY);
+	init_streams(pEnc);
 
-	pEnc->op_zstream2.data_type = Z_BINARY;
-	pEnc->op_zstream2.zalloc = Z_NULL;
-	pEnc->op_zstream2.zfree = Z_NULL;
-	pEnc->op_zstream2.opaque = Z_NULL;
-	auto r2 = deflateInit2(&pEnc->op_zstream2, Z_BEST_SPEED + 1, 8, 15, 8, Z_FILTERED);
+	pEnc->budget = new (std::nothrow) EncodeBudget();
+	if (!pEnc->budget) {
+		err = ApngError::ContextCreateFailed;
+		goto __failed;
+	}
 
 	*ppEnc = pEnc;
 	return ApngError::Success;
@@ -65,7 +54,148 @@ __failed:
 	return err;
 }
 
+/* Context, stats and the shared palette or deferred mode go; the other
+ * options, the buffers and the trial streams stay. */
+APNG_API(ApngError) apng_reset(ApngEncoder *pEnc, wchar_t *fileName, int width, int height)
+{
+	if (!pEnc || width <= 0 || height <= 0)
+		return ApngError::ArgumentError;
+
+	destroy_ring(pEnc);
+	destroy_append_target(pEnc);
+	if (pEnc->hFile) {
+		fclose(pEnc->hFile);
+	}
+	if (!(pEnc->hFile = open_file(fileName, "wb"))) {
+		return ApngError::FileError;
+	}
+
+	pEnc->width = width;
+	pEnc->height = height;
+	pEnc->frameCount = 0;
+	pEnc->seqIndex = 0;
+	pEnc->acTLPos = -1;
+	pEnc->deferredError = ApngError::Success;
+	memset(&pEnc->stats, 0, sizeof(ApngStats));
+	pEnc->frameEnd = 0;
+
+	//built from the frames of the last animation
+	if (pEnc->palette) {
+		delete pEnc->palette;
+		pEnc->palette = NULL;
+	}
+	if (pEnc->capture) {
+		delete pEnc->capture;
+		pEnc->capture = NULL;
+	}
+	pEnc->capturePalette = false;
+	destroy_append_source(pEnc);
+	pEnc->budget->Restart();
+
+	pEnc->reusePaletteSize = 0;
+	pEnc->degraded = false;
+	pEnc->lastFilter = true;
+	pEnc->speculated = false;
+	pEnc->nearSquaredError = 0;
+	pEnc->nearSamples = 0;
+	if (pEnc->arena) {
+		pEnc->arena->ClearCounters();
+	}
+	if (pEnc->regions) {
+		pEnc->regions->Clear();
+	}
+	deflateReset(&pEnc->op_zstream1);
+	deflateReset(&pEnc->op_zstream2);
+
+	//the lossless trials of the auto mode run on the whole canvas
+	if (pEnc->autoWorker && (pEnc->autoWorker->bufferRowbytes < (unsigned int)width * 4 || pEnc->autoWorker->bufferHeight < (unsigned int)height)) {
+		destroy_auto_worker(pEnc);
+	}
+	else if (pEnc->autoWorker) {
+		pEnc->autoWorker->rowMemo->Clear();
+	}
+	return ApngError::Success;
+}
+
+/* back to the options apng_init sets */
+void reset_options(ApngEncoder *pEnc)
+{
+	pEnc->quantizeEffort = (int)QuantizeEffort::Auto;
+	pEnc->reuseMeanError = 0;
+	pEnc->reuseMaxError = 0;
+	pEnc->budget->FrameMs = 0;
+	pEnc->autoPsnr = 0;
+	pEnc->parallelTrials = 0;
+	pEnc->filterStrategy = (int)FilterStrategy::MinSad;
+	pEnc->fixedFilter = 0;
+	pEnc->nearLosslessError = 0;
+	pEnc->nearLosslessDither = 0;
+	pEnc->rowMemoOff = false;
+	if (pEnc->regions) {
+		delete pEnc->regions;
+		pEnc->regions = NULL;
+	}
+}
+
+/* compresses one rect of a frame and writes it */
+static ApngError append_rect(ApngEncoder *pEnc, BitmapData *bmpData, int x, int y, int delay_ms, unsigned char dispose, bool optimize)
+{
+	unsigned int zsize;
+	pEnc->arena->Reset();
+	//the quantizer cubes in the block too; out of memory they come from the heap
+	if (optimize) {
+		pEnc->arena->Reserve(arena_bytes(pEnc, true));
+	}
+	ApngError err = encode_frame(pEnc, bmpData, x, y, optimize, &zsize);
+	if (err != ApngError::Success) {
+		return err;
+	}
+
+	pEnc->stats.encodedPixels += (long long)bmpData->Width * bmpData->Height;
+	write_frame(pEnc, x, y, bmpData->Width, bmpData->Height, delay_ms, dispose, pEnc->zbuf, zsize);
+	return ApngError::Success;
+}
+
+/* Sub-frame mode: the rects the planner picks, the earlier ones with delay 0
+ * and dispose none. They still blend with source, a rect may cover one the
+ * last frame left on the canvas. */
+static ApngError append_regions(ApngEncoder *pEnc, BitmapData *frame, int x, int y, int delay_ms, bool optimize)
+{
+	if (x != 0 || y != 0 || frame->Width != pEnc->width || frame->Height != pEnc->height) {
+		return ApngError::ArgumentError;
+	}
+
+	const vector<DirtyRegions::Rect> &rects = pEnc->regions->Plan(frame);
+	for (size_t i = 0; i < rects.size(); i++) {
+		const DirtyRegions::Rect &r = rects[i];
+		bool last = i + 1 == rects.size();
+		BitmapData bmpData = *frame;
+		bmpData.Width = r.Width;
+		bmpData.Height = r.Height;
+		bmpData.Scan0 = (unsigned char*)frame->Scan0 + r.Y * frame->Stride + r.X * frame->bpp;
+
+		ApngError err = append_rect(pEnc, &bmpData, r.X, r.Y, last ? delay_ms : 0, last ? PNG_DISPOSE_OP_BACKGROUND : PNG_DISPOSE_OP_NONE, optimize);
+		if (err != ApngError::Success) {
+			return err;
+		}
+	}
+
+	pEnc->stats.subFrames += (int)rects.size() - 1;
+	const DirtyRegions::Rect &bounds = pEnc->regions->Bounds();
+	pEnc->stats.streamingPixels += (long long)bounds.Width * bounds.Height;
+	return ApngError::Success;
+}
+
 APNG_API(ApngError) apng_append_frame(ApngEncoder *pEnc, void* pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize)
+{
+	//the ring's thread appends its frames
+	if (pEnc->ring) {
+		return ApngError::ArgumentError;
+	}
+	return append_frame(pEnc, pData, x, y, width, height, stride, delay_ms, optimize);
+}
+
+ApngError append_frame(ApngEncoder *pEnc, void* pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize)
 {
 	/* references:
 	 * https://wiki.mozilla.org/APNG_Specification
@@ -73,120 +203,711 @@ APNG_API(ApngError) apng_append_frame(ApngEncoder *pEnc, void* pData, int x, int
 	 */
 	ApngError err = ApngError::Success;
 
-	if (pEnc->frameCount == 0)
+	if (pEnc->budget->Cancelled()) {
+		return ApngError::Cancelled;
+	}
+
+	if (pEnc->frameCount == 0 && !pEnc->appendTo && (!pEnc->capture || pEnc->capture->Count() == 0))
 	{
 		if (!(x == 0 && y == 0 && width == pEnc->width && height == pEnc->height))
 		{
 			return ApngError::ArgumentError;
 		}
+	}
+
+	if (pEnc->capture) {
+		if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > pEnc->width || y + height > pEnc->height) {
+			return ApngError::ArgumentError;
+		}
+		return pEnc->capture->Add(pData, x, y, width, height, stride, delay_ms, optimize);
+	}
 
-		//png sign
-		{
-			static const unsigned char png_sign[8] = { 137,  80,  78,  71,  13,  10,  26,  10 };
-			fwrite(png_sign, 1, 8, pEnc->hFile);
+	if (pEnc->appendTo)
+	{
+		err = write_appended(pEnc);
+		if (err != ApngError::Success) {
+			return err;
 		}
+	}
 
-		//IHDR
-		{
-			unsigned char buf_IHDR[13];
-			png_save_uint_32(buf_IHDR, pEnc->width);
-			png_save_uint_32(buf_IHDR + 4, pEnc->height);
-			buf_IHDR[8] = 8; //color depth
-			buf_IHDR[9] = 6; //color type, 6=rgba
-			buf_IHDR[10] = 0; //compression
-			buf_IHDR[11] = 0; //filter
-			buf_IHDR[12] = 0; //interlace
+	if (pEnc->frameCount == 0)
+	{
+		err = write_header(pEnc);
+		if (err != ApngError::Success) {
+			return err;
+		}
+	}
 
-			write_chunk(pEnc, "IHDR", buf_IHDR, 13);
+	BitmapData bmpData;
+	bmpData.Width = width;
+	bmpData.Height = height;
+	bmpData.Stride = stride;
+	bmpData.bpp = 4;
+	bmpData.Scan0 = pData;
+
+	if (pEnc->frameCount > 0 && pEnc->regions) {
+		return append_regions(pEnc, &bmpData, x, y, delay_ms, optimize);
+	}
+
+	if (pEnc->frameCount > 0) {
+		RECT rect;
+		get_rect(&bmpData, &rect);
+
+		x += rect.x;
+		y += rect.y;
+		bmpData.Width = rect.width;
+		bmpData.Height = rect.height;
+		bmpData.Scan0 = (unsigned char*)pData + rect.y * bmpData.Stride + rect.x * bmpData.bpp;		
+	}
+
+	pEnc->stats.streamingPixels += (long long)bmpData.Width * bmpData.Height;
+	return append_rect(pEnc, &bmpData, x, y, delay_ms, PNG_DISPOSE_OP_BACKGROUND, optimize);
+}
+
+APNG_API(void) apng_write_end(ApngEncoder *pEnc)
+{
+	//capture ring, encode the frames still waiting
+	if (pEnc->ring) {
+		ApngError err = pEnc->ring->Finish();
+		pEnc->stats.droppedFrames += pEnc->ring->Dropped();
+		destroy_ring(pEnc);
+		if (err != ApngError::Success && err != ApngError::Cancelled) {
+			pEnc->deferredError = err;
+		}
+	}
+
+	//deferred mode, encode the kept frames
+	if (pEnc->capture) {
+		FrameCapture *capture = pEnc->capture;
+		pEnc->capture = NULL;
+		pEnc->deferredError = flush_deferred(pEnc, capture);
+		delete capture;
+		if (pEnc->deferredError != ApngError::Success) {
+			return;
 		}
+	}
 
-		//acTL
-		{
+	//apng_open_append without frames, the file as it was
+	if (pEnc->appendTo) {
+		pEnc->deferredError = write_appended(pEnc);
+		if (pEnc->deferredError != ApngError::Success) {
+			return;
+		}
+	}
+
+	//fix acTL
+	bool acTLFixed = false;
+	if (pEnc->acTLPos > -1 && pEnc->frameCount > 0) {
+		if (!fseek(pEnc->hFile, pEnc->acTLPos, SEEK_SET)) {
 			unsigned char buf_acTL[8];
-			png_save_uint_32(buf_acTL, 0); //frames
+			png_save_uint_32(buf_acTL, pEnc->frameCount); //frames
 			png_save_uint_32(buf_acTL + 4, 0); //loops
 
 			pEnc->acTLPos = ftell(pEnc->hFile);
 			write_chunk(pEnc, "acTL", buf_acTL, 8);
+			acTLFixed = true;
+		}
+	}
+
+	//write end
+	if (!acTLFixed || !fseek(pEnc->hFile, 0, SEEK_END)) {
+		static unsigned char buf_tEXt[33] = { 83, 111, 102, 116, 119, 97, 114, 101, 0, 108, 105, 98, 97, 112, 110, 103, 32, 102, 111, 114, 32, 87, 122, 67, 111, 109, 112, 97, 114, 101, 114, 82, 50 };
+		write_chunk(pEnc, "tEXt", buf_tEXt, 33);
+
+		write_chunk(pEnc, "IEND", NULL, 0);
+	}
+	pEnc->stats.bytes = ftell(pEnc->hFile);
+
+	//apng_open_append, the complete file replaces the original
+	if (pEnc->appendTarget) {
+		ApngError err = finish_append(pEnc);
+		if (err != ApngError::Success) {
+			pEnc->deferredError = err;
+		}
+	}
+}
+
+APNG_API(void) apng_destroy(ApngEncoder **ppEnc)
+{
+	if (!ppEnc)
+		return;
+
+	ApngEncoder *pEnc = *ppEnc;
+	if (pEnc) {
+		destroy_ring(pEnc);
+		destroy_append_target(pEnc);
+		if (pEnc->hFile) {
+			fclose(pEnc->hFile);
+		}
+		free_buffers(pEnc);
+		if (pEnc->reusePalette) {
+			free(pEnc->reusePalette);
+		}
+		if (pEnc->palette) {
+			delete pEnc->palette;
+		}
+		if (pEnc->capture) {
+			delete pEnc->capture;
+		}
+		destroy_auto_worker(pEnc);
+		destroy_append_source(pEnc);
+		if (pEnc->regions) {
+			delete pEnc->regions;
+		}
+		if (pEnc->scorer) {
+			delete pEnc->scorer;
+		}
+		if (pEnc->budget) {
+			delete pEnc->budget;
+		}
+		deflateEnd(&pEnc->op_zstream1);
+		deflateEnd(&pEnc->op_zstream2);
+		free(pEnc);
+	}
+	*ppEnc = NULL;
+}
+
+APNG_API(ApngError) apng_set_quantize_effort(ApngEncoder *pEnc, int effort)
+{
+	if (!pEnc || effort < (int)QuantizeEffort::Auto || effort > (int)QuantizeEffort::Best || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->quantizeEffort = effort;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_palette_reuse(ApngEncoder *pEnc, int meanError, int maxError)
+{
+	if (!pEnc || meanError < 0 || maxError < 0 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->reuseMeanError = meanError;
+	pEnc->reuseMaxError = maxError;
+	pEnc->reusePaletteSize = 0;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_deferred(ApngEncoder *pEnc, int mode, bool globalPalette)
+{
+	if (!pEnc || mode < 0 || mode > 2 || pEnc->frameCount > 0 || pEnc->ring || pEnc->appendTo || (pEnc->capture && pEnc->capture->Count() > 0)
+		|| (mode > 0 && pEnc->regions))
+		return ApngError::ArgumentError;
+
+	if (pEnc->capture) {
+		delete pEnc->capture;
+		pEnc->capture = NULL;
+	}
+	if (mode > 0) {
+		pEnc->capture = new (std::nothrow) FrameCapture(mode == 2);
+		if (!pEnc->capture)
+			return ApngError::MemoryError;
+	}
+	pEnc->capturePalette = mode > 0 && globalPalette;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_time_budget(ApngEncoder *pEnc, int frameMs, int totalMs)
+{
+	if (!pEnc || frameMs < 0 || totalMs < 0 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->budget->FrameMs = frameMs;
+	pEnc->budget->EndTime = totalMs > 0 ? EncodeBudget::Now() + totalMs : 0;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_auto_optimize(ApngEncoder *pEnc, double minPsnr)
+{
+	if (!pEnc || !(minPsnr >= 0) || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->autoPsnr = minPsnr;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_parallel_trials(ApngEncoder *pEnc, int mode)
+{
+	if (!pEnc || mode < 0 || mode > 2 || pEnc->frameCount > 0 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->parallelTrials = mode;
+	pEnc->lastFilter = true;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_filter_strategy(ApngEncoder *pEnc, int strategy, int fixedFilter)
+{
+	if (!pEnc || strategy < 0 || strategy > (int)FilterStrategy::Deflate || fixedFilter < 0 || fixedFilter > 4 || pEnc->frameCount > 0 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->filterStrategy = strategy;
+	pEnc->fixedFilter = fixedFilter;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_row_memo(ApngEncoder *pEnc, bool enabled)
+{
+	if (!pEnc || pEnc->frameCount > 0 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->rowMemoOff = !enabled;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_near_lossless(ApngEncoder *pEnc, int maxError, int dither)
+{
+	if (!pEnc || maxError < 0 || maxError > 127 || dither < 0 || dither > 2 || pEnc->ring)
+		return ApngError::ArgumentError;
+
+	pEnc->nearLosslessError = maxError;
+	pEnc->nearLosslessDither = dither;
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_set_sub_frames(ApngEncoder *pEnc, int maxRegions)
+{
+	if (!pEnc || maxRegions < 0 || pEnc->frameCount > 0 || pEnc->ring || (maxRegions > 1 && pEnc->capture))
+		return ApngError::ArgumentError;
+
+	if (pEnc->regions) {
+		delete pEnc->regions;
+		pEnc->regions = NULL;
+	}
+	if (maxRegions > 1) {
+		pEnc->regions = new (std::nothrow) DirtyRegions(maxRegions);
+		if (!pEnc->regions)
+			return ApngError::MemoryError;
+	}
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_cancel(ApngEncoder *pEnc)
+{
+	if (!pEnc)
+		return ApngError::ArgumentError;
+
+	pEnc->budget->Cancel();
+	return ApngError::Success;
+}
+
+APNG_API(ApngError) apng_get_stats(ApngEncoder *pEnc, ApngStats *pStats)
+{
+	if (!pEnc || !pStats)
+		return ApngError::ArgumentError;
+
+	//the ring's thread is encoding, a copy it took after its last frame
+	if (pEnc->ring) {
+		return pEnc->ring->Stats(pStats);
+	}
+	collect_stats(pEnc, pStats);
+	return pEnc->deferredError;
+}
+
+void collect_stats(ApngEncoder *pEnc, ApngStats *pStats)
+{
+	*pStats = pEnc->stats;
+	pStats->frames = pEnc->frameCount - pEnc->stats.subFrames;
+	if (pEnc->nearSquaredError > 0) {
+		pStats->psnr = 10.0 * log10(255.0 * 255.0 * pEnc->nearSamples / pEnc->nearSquaredError);
+	}
+	if (pEnc->arena) {
+		pStats->arenaReused += pEnc->arena->ReusedBytes();
+		pStats->arenaAllocated += pEnc->arena->AllocatedBytes();
+	}
+}
+
+APNG_API(ApngError) apng_add_palette_frame(ApngEncoder *pEnc, void* pData, int width, int height, int stride)
+{
+	if (!pEnc || !pData || width <= 0 || height <= 0 || pEnc->frameCount > 0 || pEnc->ring || pEnc->appendTo)
+		return ApngError::ArgumentError;
+
+	if (!pEnc->palette) {
+		QuantizeOptions options;
+		options.Effort = (QuantizeEffort)pEnc->quantizeEffort;
+		pEnc->palette = new (std::nothrow) GlobalPalette(&options);
+		if (!pEnc->palette)
+			return ApngError::MemoryError;
+	}
+
+	BitmapData bmpData;
+	bmpData.Width = width;
+	bmpData.Height = height;
+	bmpData.Stride = stride;
+	bmpData.bpp = 4;
+	bmpData.Scan0 = pData;
+	pEnc->palette->AddImage(&bmpData);
+	return ApngError::Success;
+}
+
+
+#ifndef _WIN32
+/* wchar_t is utf-32 here, encoded as utf-8; free the result */
+char *utf8_path(const wchar_t *fileName)
+{
+	size_t len = wcslen(fileName);
+	char *path = (char *)malloc(len * 4 + 1);
+	if (!path) {
+		return NULL;
+	}
+	char *p = path;
+	for (size_t i = 0; i < len; i++) {
+		unsigned int c = (unsigned int)fileName[i];
+		if (c < 0x80) {
+			*p++ = (char)c;
+		}
+		else if (c < 0x800) {
+			*p++ = (char)(0xc0 | (c >> 6));
+			*p++ = (char)(0x80 | (c & 0x3f));
 		}
+		else if (c < 0x10000) {
+			*p++ = (char)(0xe0 | (c >> 12));
+			*p++ = (char)(0x80 | ((c >> 6) & 0x3f));
+			*p++ = (char)(0x80 | (c & 0x3f));
+		}
+		else {
+			*p++ = (char)(0xf0 | (c >> 18));
+			*p++ = (char)(0x80 | ((c >> 12) & 0x3f));
+			*p++ = (char)(0x80 | ((c >> 6) & 0x3f));
+			*p++ = (char)(0x80 | (c & 0x3f));
+		}
+	}
+	*p = 0;
+	return path;
+}
+#endif
 
-		unsigned int rowbytes = pEnc->width * 4;
-		unsigned int idat_size = (rowbytes + 1) * height;
-		unsigned int zbuf_size = idat_size + ((idat_size + 7) >> 3) + ((idat_size + 63) >> 6) + 11;
-
-		pEnc->idat_size = idat_size;
-		pEnc->zbuf_size = zbuf_size;
-
-		pEnc->zbuf = (unsigned char *)malloc(zbuf_size);
-		pEnc->dest = (unsigned char *)malloc(idat_size);
-		pEnc->row_buf = (unsigned char *)malloc(rowbytes + 1);
-		pEnc->sub_row = (unsigned char *)malloc(rowbytes + 1);
-		pEnc->up_row = (unsigned char *)malloc(rowbytes + 1);
-		pEnc->avg_row = (unsigned char *)malloc(rowbytes + 1);
-		pEnc->paeth_row = (unsigned char *)malloc(rowbytes + 1);
-
-		if (!pEnc->zbuf
-			|| !pEnc->dest
-			|| !pEnc->row_buf
-			|| !pEnc->sub_row
-			|| !pEnc->up_row
-			|| !pEnc->avg_row
-			|| !pEnc->paeth_row) {
+FILE *open_file(const wchar_t *fileName, const char *mode)
+{
+	FILE *f = NULL;
+#ifdef _WIN32
+	wchar_t wmode[8];
+	int i = 0;
+	for (; mode[i] && i < 7; i++) {
+		wmode[i] = mode[i];
+	}
+	wmode[i] = 0;
+	if (_wfopen_s(&f, fileName, wmode)) {
+		return NULL;
+	}
+#else
+	char *path = utf8_path(fileName);
+	if (!path) {
+		return NULL;
+	}
+	f = fopen(path, mode);
+	free(path);
+#endif
+	return f;
+}
+
+/* the two trial streams deflate_rect_op compares */
+void init_streams(ApngEncoder *pEnc)
+{
+	pEnc->op_zstream1.data_type = Z_BINARY;
+	pEnc->op_zstream1.zalloc = Z_NULL;
+	pEnc->op_zstream1.zfree = Z_NULL;
+	pEnc->op_zstream1.opaque = Z_NULL;
+	deflateInit2(&pEnc->op_zstream1, Z_BEST_SPEED + 1, 8, 15, 8, Z_DEFAULT_STRATEGY);
+
+	pEnc->op_zstream2.data_type = Z_BINARY;
+	pEnc->op_zstream2.zalloc = Z_NULL;
+	pEnc->op_zstream2.zfree = Z_NULL;
+	pEnc->op_zstream2.opaque = Z_NULL;
+	deflateInit2(&pEnc->op_zstream2, Z_BEST_SPEED + 1, 8, 15, 8, Z_FILTERED);
+}
+
+/* The arena block for a canvas-sized frame: the copy, index plane, palette,
+ * expanded image and final deflate state, and with optimize the quantizer
+ * cubes and histogram staging. */
+size_t arena_bytes(const ApngEncoder *pEnc, bool optimize)
+{
+	size_t pixels = (size_t)pEnc->width * pEnc->height;
+	size_t bytes = 9 * pixels + 4 * MaxColor + DeflateStateBytes;
+	if (optimize) {
+		QuantizeOptions options;
+		options.Effort = (QuantizeEffort)pEnc->quantizeEffort;
+		bytes += QuantizeArenaBytes(pEnc->width, pEnc->height, &options);
+	}
+	return bytes;
+}
+
+/* The buffers of an encoder that writes frames: the arena starts out with
+ * the lossless arena_bytes, and a block grown by optimized frames of an
+ * earlier animation is cut back to it. An encoder reset for a canvas its
+ * buffers still hold keeps them. */
+ApngError alloc_buffers(ApngEncoder *pEnc)
+{
+	unsigned int rowbytes = pEnc->width * 4;
+	ApngError err = ApngError::Success;
+	if (!pEnc->zbuf
+		|| rowbytes > pEnc->bufferRowbytes
+		|| (unsigned int)pEnc->height > pEnc->bufferHeight
+		|| (pEnc->parallelTrials && !pEnc->trial_rows)) {
+		free_buffers(pEnc);
+		err = alloc_buffers(pEnc, rowbytes, pEnc->height);
+	}
+	else {
+		pEnc->rowMemo->Clear();
+	}
+
+	//write_IDATs sizes the zlib window from the canvas
+	pEnc->idat_size = (rowbytes + 1) * pEnc->height;
+	pEnc->arena->Trim(arena_bytes(pEnc, false));
+	if (err == ApngError::Success && !pEnc->arena->Reserve(arena_bytes(pEnc, false))) {
+		err = ApngError::MemoryError;
+	}
+	return err;
+}
+
+/* releases what alloc_buffers allocated */
+void free_buffers(ApngEncoder *pEnc)
+{
+	if (pEnc->zbuf) {
+		free(pEnc->zbuf);
+		pEnc->zbuf = NULL;
+	}
+	if (pEnc->dest) {
+		free(pEnc->dest);
+		pEnc->dest = NULL;
+	}
+	if (pEnc->row_buf) {
+		free(pEnc->row_buf);
+		pEnc->row_buf = NULL;
+	}
+	if (pEnc->sub_row) {
+		free(pEnc->sub_row);
+		pEnc->sub_row = NULL;
+	}
+	if (pEnc->up_row) {
+		free(pEnc->up_row);
+		pEnc->up_row = NULL;
+	}
+	if (pEnc->avg_row) {
+		free(pEnc->avg_row);
+		pEnc->avg_row = NULL;
+	}
+	if (pEnc->paeth_row) {
+		free(pEnc->paeth_row);
+		pEnc->paeth_row = NULL;
+	}
+	if (pEnc->trial_rows) {
+		free(pEnc->trial_rows);
+		pEnc->trial_rows = NULL;
+	}
+	if (pEnc->trial_zbuf) {
+		free(pEnc->trial_zbuf);
+		pEnc->trial_zbuf = NULL;
+	}
+	if (pEnc->rowMemo) {
+		delete pEnc->rowMemo;
+		pEnc->rowMemo = NULL;
+	}
+	if (pEnc->arena) {
+		delete pEnc->arena;
+		pEnc->arena = NULL;
+	}
+}
+
+/* row and stream buffers for frames up to rowbytes x height */
+ApngError alloc_buffers(ApngEncoder *pEnc, unsigned int rowbytes, unsigned int height)
+{
+	unsigned int idat_size = (rowbytes + 1) * height;
+	unsigned int zbuf_size = idat_size + ((idat_size + 7) >> 3) + ((idat_size + 63) >> 6) + 11;
+
+	pEnc->idat_size = idat_size;
+	pEnc->zbuf_size = zbuf_size;
+	pEnc->bufferRowbytes = rowbytes;
+	pEnc->bufferHeight = height;
+
+	pEnc->zbuf = (unsigned char *)malloc(zbuf_size);
+	pEnc->dest = (unsigned char *)malloc(idat_size);
+	pEnc->row_buf = (unsigned char *)malloc(rowbytes + 1);
+	pEnc->sub_row = (unsigned char *)malloc(rowbytes + 1);
+	pEnc->up_row = (unsigned char *)malloc(rowbytes + 1);
+	pEnc->avg_row = (unsigned char *)malloc(rowbytes + 1);
+	pEnc->paeth_row = (unsigned char *)malloc(rowbytes + 1);
+	pEnc->rowMemo = new (std::nothrow) RowMemo();
+	pEnc->arena = new (std::nothrow) FrameArena();
+
+	if (!pEnc->zbuf
+		|| !pEnc->dest
+		|| !pEnc->row_buf
+		|| !pEnc->sub_row
+		|| !pEnc->up_row
+		|| !pEnc->avg_row
+		|| !pEnc->paeth_row
+		|| !pEnc->rowMemo
+		|| !pEnc->rowMemo->Alloc(rowbytes, height)
+		|| !pEnc->arena) {
+		return ApngError::MemoryError;
+	}
+
+	if (pEnc->parallelTrials) {
+		pEnc->trial_rows = (unsigned char *)malloc(idat_size);
+		pEnc->trial_zbuf = (unsigned char *)malloc(2 * (size_t)zbuf_size);
+		if (!pEnc->trial_rows || !pEnc->trial_zbuf) {
 			return ApngError::MemoryError;
 		}
+	}
+
+	pEnc->row_buf[0] = 0;
+	pEnc->sub_row[0] = 1;
+	pEnc->up_row[0] = 2;
+	pEnc->avg_row[0] = 3;
+	pEnc->paeth_row[0] = 4;
+	return ApngError::Success;
+}
+
+/* Signature, IHDR, acTL and, with a shared palette, PLTE/tRNS. */
+ApngError write_header(ApngEncoder *pEnc)
+{
+	//png sign
+	{
+		static const unsigned char png_sign[8] = { 137,  80,  78,  71,  13,  10,  26,  10 };
+		fwrite(png_sign, 1, 8, pEnc->hFile);
+	}
+
+	//shared palette, built from the declared frames
+	Pixel palette[MaxColor];
+	int colorCount = 0;
+	if (pEnc->palette) {
+		colorCount = pEnc->palette->Build(palette, MaxColor);
+	}
+
+	//the fewest bits per index that hold the palette
+	pEnc->bitDepth = 8;
+	if (pEnc->palette && colorCount > 0) {
+		pEnc->bitDepth = colorCount <= 2 ? 1 : colorCount <= 4 ? 2 : colorCount <= 16 ? 4 : 8;
+	}
+
+	//IHDR
+	{
+		unsigned char buf_IHDR[13];
+		png_save_uint_32(buf_IHDR, pEnc->width);
+		png_save_uint_32(buf_IHDR + 4, pEnc->height);
+		buf_IHDR[8] = (unsigned char)pEnc->bitDepth; //color depth
+		buf_IHDR[9] = pEnc->palette ? 3 : 6; //color type, 3=indexed, 6=rgba
+		buf_IHDR[10] = 0; //compression
+		buf_IHDR[11] = 0; //filter
+		buf_IHDR[12] = 0; //interlace
+
+		write_chunk(pEnc, "IHDR", buf_IHDR, 13);
+	}
+
+	//acTL
+	{
+		unsigned char buf_acTL[8];
+		png_save_uint_32(buf_acTL, 0); //frames
+		png_save_uint_32(buf_acTL + 4, 0); //loops
+
+		pEnc->acTLPos = ftell(pEnc->hFile);
+		write_chunk(pEnc, "acTL", buf_acTL, 8);
+	}
 
-		pEnc->row_buf[0] = 0;
-		pEnc->sub_row[0] = 1;
-		pEnc->up_row[0] = 2;
-		pEnc->avg_row[0] = 3;
-		pEnc->paeth_row[0] = 4;
+	//PLTE, tRNS
+	if (pEnc->palette) {
+		write_palette(pEnc, palette, colorCount);
 	}
 
-	BitmapData bmpData;
-	bmpData.Width = width;
-	bmpData.Height = height;
-	bmpData.Stride = stride;
-	bmpData.bpp = 4;
-	bmpData.Scan0 = pData;
+	return alloc_buffers(pEnc);
+}
 
-	if (pEnc->frameCount > 0) {
-		RECT rect;
-		get_rect(&bmpData, &rect);
+/* Quantizes, maps or copies the frame rect at x, y and compresses it into
+ * pEnc->zbuf. bmpData keeps its size; the working copies come from
+ * pEnc->arena, which the caller resets per frame. */
+ApngError encode_frame(ApngEncoder *pEnc, BitmapData *bmpData, int x, int y, bool optimize, unsigned int *zsize)
+{
+	BitmapData image = *bmpData;
+	ApngError err = ApngError::Success;
+	bool filter;
 
-		x += rect.x;
-		y += rect.y;
-		bmpData.Width = rect.width;
-		bmpData.Height = rect.height;
-		bmpData.Scan0 = (unsigned char*)pData + rect.y * bmpData.Stride + rect.x * bmpData.bpp;		
+	pEnc->frameX = x;
+	pEnc->frameY = y;
+	pEnc->speculated = false;
+	pEnc->rowMemo->NextFrame();
+	pEnc->degraded = false;
+	pEnc->frameEnd = pEnc->budget && pEnc->budget->FrameMs > 0 ? EncodeBudget::Now() + pEnc->budget->FrameMs : 0;
+
+	//out of time, the frame goes out lossless
+	if (optimize && !pEnc->palette && encode_deadline(pEnc).Expired()) {
+		optimize = false;
+		pEnc->degraded = true;
 	}
 
-	if (optimize) {
-		ApngError err = OptimizeImage(&bmpData);
+	if (optimize && !pEnc->palette && pEnc->autoPsnr > 0) {
+		//picks the image and runs its trials
+		err = auto_optimize(pEnc, &image, &filter);
 		if (err != ApngError::Success) {
 			return err;
 		}
 	}
 	else {
-		unsigned char *pixels = (unsigned char *)malloc(bmpData.Width * bmpData.Height * bmpData.bpp);
-		if (!pixels) {
-			return ApngError::MemoryError;
+		if (pEnc->palette) {
+			//indexed output, optimize has no further effect
+			err = MapToPalette(pEnc, &image);
+			if (err == ApngError::Success && pEnc->bitDepth < 8) {
+				pack_indices(&image, pEnc->bitDepth);
+			}
+		}
+		else if (optimize) {
+			err = OptimizeImage(pEnc, &image, &optimize);
+		}
+		if (err == ApngError::Success && !pEnc->palette && !optimize) {
+			err = copy_image(pEnc, &image);
+			if (err == ApngError::Success) {
+				err = near_lossless(pEnc, &image);
+			}
 		}
-		unsigned char *pDest = pixels, *pRow = (unsigned char*)bmpData.Scan0;
-		unsigned int rowbytes = bmpData.Width * bmpData.bpp;
-		for (int y = 0; y < bmpData.Height; y++) {
-			memcpy(pDest, pRow, rowbytes);
-			pRow += bmpData.Stride;
-			pDest += rowbytes;
+		if (err != ApngError::Success) {
+			return err;
+		}
+
+		swap_red_blue(&image);
+		if (!encode_deadline(pEnc).Cancelled()) {
+			deflate_rect_op(pEnc, &image, &filter);
 		}
-		bmpData.Scan0 = pixels;
-		bmpData.Stride = rowbytes;
 	}
 
-	//bgra->rgba
-	{
-		unsigned char *pColor = (unsigned char*)bmpData.Scan0;
-		for (int y = 0; y < bmpData.Height; y++) {
-			for (int x = 0; x < bmpData.Width; x++) {
+	//compress
+	if (encode_deadline(pEnc).Cancelled()) {
+		err = ApngError::Cancelled;
+	}
+	else {
+		err = deflate_rect_fin(pEnc, &image, filter, zsize);
+	}
+
+	if (err == ApngError::Success && pEnc->degraded) {
+		pEnc->stats.degradedFrames++;
+	}
+	return err;
+}
+
+/* replaces the pixels with a packed copy in the encoder's arena */
+ApngError copy_image(ApngEncoder *pEnc, BitmapData *image)
+{
+	unsigned char *pixels = (unsigned char *)pEnc->arena->Alloc((size_t)image->Width * image->Height * image->bpp);
+	if (!pixels) {
+		return ApngError::MemoryError;
+	}
+	unsigned char *pDest = pixels, *pRow = (unsigned char*)image->Scan0;
+	unsigned int rowbytes = image->Width * image->bpp;
+	for (int y = 0; y < image->Height; y++) {
+		memcpy(pDest, pRow, rowbytes);
+		pRow += image->Stride;
+		pDest += rowbytes;
+	}
+	image->Scan0 = pixels;
+	image->Stride = rowbytes;
+	return ApngError::Success;
+}
+
+/* bgra->rgba, in place; indexed images are left alone */
+void swap_red_blue(BitmapData *image)
+{
+	if (image->bpp == 4) {
+		unsigned char *pColor = (unsigned char*)image->Scan0;
+		for (int y = 0; y < image->Height; y++) {
+			for (int x = 0; x < image->Width; x++) {
 				auto temp = pColor[0];
 				pColor[0] = pColor[2];
 				pColor[2] = temp;
@@ -194,19 +915,26 @@ APNG_API(ApngError) apng_append_frame(ApngEncoder *pEnc, void* pData, int x, int
 			}
 		}
 	}
+}
 
-	//compress
-	bool filter;
-	unsigned int zsize;
-	deflate_rect_op(pEnc, &bmpData, &filter);
-	deflate_rect_fin(pEnc, &bmpData, filter, &zsize);
+Deadline encode_deadline(const ApngEncoder *pEnc)
+{
+	Deadline deadline;
+	deadline.Budget = pEnc->budget;
+	deadline.FrameEnd = pEnc->frameEnd;
+	return deadline;
+}
 
+/* fcTL and the frame data; dispose is applied to this frame before the next
+ * one is drawn. */
+void write_frame(ApngEncoder *pEnc, int x, int y, int width, int height, int delay_ms, unsigned char dispose, unsigned char *data, unsigned int zsize)
+{
 	//fcTL
 	{
 		unsigned char buf_fcTL[26];
 		png_save_uint_32(buf_fcTL, pEnc->seqIndex++);
-		png_save_uint_32(buf_fcTL + 4, bmpData.Width);
-		png_save_uint_32(buf_fcTL + 8, bmpData.Height);
+		png_save_uint_32(buf_fcTL + 4, width);
+		png_save_uint_32(buf_fcTL + 8, height);
 		png_save_uint_32(buf_fcTL + 12, x);
 		png_save_uint_32(buf_fcTL + 16, y);
 		if (delay_ms % 1000 == 0) {
@@ -225,81 +953,17 @@ APNG_API(ApngError) apng_append_frame(ApngEncoder *pEnc, void* pData, int x, int
 			png_save_uint_16(buf_fcTL + 20, delay_ms);
 			png_save_uint_16(buf_fcTL + 22, 1000);
 		}
-		buf_fcTL[24] = PNG_DISPOSE_OP_BACKGROUND;
+		buf_fcTL[24] = dispose;
 		buf_fcTL[25] = PNG_BLEND_OP_SOURCE;
 		write_chunk(pEnc, "fcTL", buf_fcTL, 26);
 	}
 
 	//Idat
-	write_IDATs(pEnc, pEnc->zbuf, zsize, pEnc->idat_size);
-
-	free(bmpData.Scan0);
+	write_IDATs(pEnc, data, zsize, pEnc->idat_size);
 
 	pEnc->frameCount++;
-	return ApngError::Success;
-}
-
-APNG_API(void) apng_write_end(ApngEncoder *pEnc)
-{
-	//fix acTL
-	bool acTLFixed = false;
-	if (pEnc->acTLPos > -1 && pEnc->frameCount > 0) {
-		if (!fseek(pEnc->hFile, pEnc->acTLPos, SEEK_SET)) {
-			unsigned char buf_acTL[8];
-			png_save_uint_32(buf_acTL, pEnc->frameCount); //frames
-			png_save_uint_32(buf_acTL + 4, 0); //loops
-
-			pEnc->acTLPos = ftell(pEnc->hFile);
-			write_chunk(pEnc, "acTL", buf_acTL, 8);
-			acTLFixed = true;
-		}
-	}
-
-	//write end
-	if (!acTLFixed || !fseek(pEnc->hFile, 0, SEEK_END)) {
-		static unsigned char buf_tEXt[33] = { 83, 111, 102, 116, 119, 97, 114, 101, 0, 108, 105, 98, 97, 112, 110, 103, 32, 102, 111, 114, 32, 87, 122, 67, 111, 109, 112, 97, 114, 101, 114, 82, 50 };
-		write_chunk(pEnc, "tEXt", buf_tEXt, 33);
-
-		write_chunk(pEnc, "IEND", NULL, 0);
-	}
-}
-
-APNG_API(void) apng_destroy(ApngEncoder **ppEnc)
-{
-	if (!ppEnc)
-		return;
-
-	ApngEncoder *pEnc = *ppEnc;
-	if (pEnc) {
-		if (pEnc->hFile) {
-			fclose(pEnc->hFile);
-		}
-		if (!pEnc->zbuf) {
-			free(pEnc->zbuf);
-		}
-		if (!pEnc->dest) {
-			free(pEnc->dest);
-		}
-		if (!pEnc->row_buf) {
-			free(pEnc->row_buf);
-		}
-		if (!pEnc->sub_row) {
-			free(pEnc->sub_row);
-		}
-		if (!pEnc->up_row) {
-			free(pEnc->up_row);
-		}
-		if (!pEnc->avg_row) {
-			free(pEnc->avg_row);
-		}
-		if (!pEnc->paeth_row) {
-			free(pEnc->paeth_row);
-		}
-	}
-	*ppEnc = NULL;
 }
 
-
 void write_chunk(ApngEncoder *enc, const char *name, unsigned char *data, unsigned int length)
 {
 	unsigned char buf[4];
@@ -402,167 +1066,401 @@ void get_rect(const BitmapData *bmpData, RECT *rect) {
 	}
 }
 
-ApngError OptimizeImage(BitmapData *bmpData) {
+/* Replaces the frame with its quantized colors. quantized is false when
+ * the deadline expired while building the histogram, bmpData is then left
+ * as it was. */
+ApngError OptimizeImage(ApngEncoder *pEnc, BitmapData *bmpData, bool *quantized) {
 	ApngError err = ApngError::Success;
+	unsigned int *pOptImg = NULL;
+	bool remapped = false;
+	QuantizeOptions options;
+	options.Effort = (QuantizeEffort)pEnc->quantizeEffort;
+	options.Limit = encode_deadline(pEnc);
+	options.Arena = pEnc->arena;
 	IndexedBitmapData optData;
 	optData.ColorCount = MaxColor;
-	optData.Palette = (Pixel*)malloc(4 * MaxColor);
+	optData.Palette = (Pixel*)pEnc->arena->Alloc(4 * MaxColor);
 	optData.Data.Width = bmpData->Width;
 	optData.Data.Height = bmpData->Height;
 	optData.Data.Stride = bmpData->Width;
 	optData.Data.bpp = 1;
-	optData.Data.Scan0 = malloc(bmpData->Width * bmpData->Height);
+	optData.Data.Scan0 = pEnc->arena->Alloc((size_t)bmpData->Width * bmpData->Height);
 
 	if (!optData.Palette || !optData.Data.Scan0) {
 		err = ApngError::MemoryError;
 		goto __end;
 	}
 
-	QuantizeImage(bmpData, &optData);
+	if (pEnc->reuseMeanError > 0 && pEnc->reusePaletteSize > 0) {
+		RemapLimits limits;
+		limits.MeanError = pEnc->reuseMeanError;
+		limits.MaxError = pEnc->reuseMaxError;
+		optData.ColorCount = pEnc->reusePaletteSize;
+		for (int i = 0; i < pEnc->reusePaletteSize; i++) {
+			optData.Palette[i] = PixelIndex(pEnc->reusePalette[i]).PixelValue;
+		}
+		remapped = RemapImage(bmpData, &optData, &limits);
+		if (remapped) {
+			pEnc->stats.remappedFrames++;
+		}
+	}
+
+	if (!remapped) {
+		optData.ColorCount = MaxColor;
+		int colorCount = QuantizeImage(bmpData, &optData, &options);
+		if (colorCount == 0) {
+			pEnc->degraded = true;
+			*quantized = false;
+			goto __end;
+		}
+
+		if (pEnc->reuseMeanError > 0) {
+			if (!pEnc->reusePalette) {
+				pEnc->reusePalette = (unsigned int *)malloc(4 * MaxColor);
+			}
+			if (pEnc->reusePalette) {
+				memcpy(pEnc->reusePalette, optData.Palette, 4 * colorCount);
+				pEnc->reusePaletteSize = colorCount;
+			}
+		}
+	}
 
 	//expand palette;
-	unsigned int *pOptImg = (unsigned int *)malloc(4 * bmpData->Width * bmpData->Height);
+	pOptImg = (unsigned int *)pEnc->arena->Alloc(4 * (size_t)bmpData->Width * bmpData->Height);
 
 	if (!pOptImg) {
 		err = ApngError::MemoryError;
 		goto __end;
 	}
 
-	for (int y = 0, y1 = bmpData->Height; y < y1; y++) {
-		unsigned int *pRow = pOptImg + y * bmpData->Width;
-		unsigned char *pIndex = (unsigned char *)optData.Data.Scan0 + y * bmpData->Width;
-		for (int x = 0, x1 = bmpData->Width; x < x1; x++) {
-			*pRow = *(unsigned int*)&(optData.Palette[*pIndex]);
-			pRow++;
-			pIndex++;
+	{
+		int width = bmpData->Width, height = bmpData->Height;
+#if defined(OPENMP) && defined(_OPENMP)
+#pragma omp parallel for schedule(static) if (width * height >= ParallelMappingThreshold)
+#endif
+		for (int y = 0; y < height; y++) {
+			unsigned int *pRow = pOptImg + (size_t)y * width;
+			unsigned char *pIndex = (unsigned char *)optData.Data.Scan0 + (size_t)y * width;
+			for (int x = 0; x < width; x++) {
+				*pRow = *(unsigned int*)&(optData.Palette[*pIndex]);
+				pRow++;
+				pIndex++;
+			}
 		}
 	}
 
 	bmpData->Scan0 = pOptImg;
 	bmpData->Stride = 4 * bmpData->Width;
+	*quantized = true;
 
 	__end:
-	if (optData.Palette)
-		free(optData.Palette);
-	if (optData.Data.Scan0)
-		free(optData.Data.Scan0);
 	return err;
 }
 
-void process_rect(ApngEncoder *pEnc, BitmapData *image, unsigned char *dest)
+/* Replaces the frame with its 8-bit indices into the shared palette. */
+ApngError MapToPalette(ApngEncoder *pEnc, BitmapData *bmpData) {
+	IndexedBitmapData indexData;
+	indexData.ColorCount = 0;
+	indexData.Palette = NULL;
+	indexData.Data.Width = bmpData->Width;
+	indexData.Data.Height = bmpData->Height;
+	indexData.Data.Stride = bmpData->Width;
+	indexData.Data.bpp = 1;
+	indexData.Data.Scan0 = pEnc->arena->Alloc((size_t)bmpData->Width * bmpData->Height);
+
+	if (!indexData.Data.Scan0) {
+		return ApngError::MemoryError;
+	}
+
+	pEnc->palette->MapImage(bmpData, &indexData);
+	*bmpData = indexData.Data;
+	return ApngError::Success;
+}
+
+/* Packs the 8-bit indices of a mapped frame to depth bits per pixel, the
+ * leftmost pixel in the high bits, in place. Width then counts the bytes of
+ * a packed row, which is all the filter and deflate passes look at. */
+void pack_indices(BitmapData *image, int depth)
+{
+	int perByte = 8 / depth;
+	int rowbytes = (image->Width + perByte - 1) / perByte;
+	unsigned char *pixels = (unsigned char *)image->Scan0;
+
+	//a packed row never reaches past the unpacked one it comes from
+	for (int y = 0; y < image->Height; y++) {
+		const unsigned char *src = pixels + (size_t)y * image->Stride;
+		unsigned char *dst = pixels + (size_t)y * rowbytes;
+		for (int i = 0; i < rowbytes; i++) {
+			unsigned int b = 0;
+			for (int k = 0, x = i * perByte; k < perByte; k++, x++) {
+				b = (b << depth) | (x < image->Width ? src[x] : 0);
+			}
+			dst[i] = (unsigned char)b;
+		}
+	}
+	image->Width = rowbytes;
+	image->Stride = rowbytes;
+}
+
+void write_palette(ApngEncoder *enc, const Pixel *palette, int colorCount)
+{
+	unsigned char buf_PLTE[3 * MaxColor];
+	unsigned char buf_tRNS[MaxColor];
+	int trnsCount = 0;
+
+	for (int i = 0; i < colorCount; i++) {
+		buf_PLTE[i * 3] = palette[i].Red;
+		buf_PLTE[i * 3 + 1] = palette[i].Green;
+		buf_PLTE[i * 3 + 2] = palette[i].Blue;
+		buf_tRNS[i] = palette[i].Alpha;
+		if (palette[i].Alpha != 255) trnsCount = i + 1;
+	}
+
+	write_chunk(enc, "PLTE", buf_PLTE, 3 * colorCount);
+	//entries past the last translucent one default to opaque
+	if (trnsCount > 0) {
+		write_chunk(enc, "tRNS", buf_tRNS, trnsCount);
+	}
+}
+
+/* Runs the five filters on a row and returns the one with the smallest sum
+ * of absolute differences, type byte first; row_buf always gets the
+ * unfiltered row. prev is NULL for the first row. */
+static unsigned char *select_filter(ApngEncoder *pEnc, const unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
 {
-	unsigned char *prev = NULL;
-	unsigned char *dp = dest;
 	unsigned char *out;
-	int rowbytes = image->Width * image->bpp;
-	int bpp = image->bpp;
+	unsigned int sum;
+	unsigned char *best_row = pEnc->row_buf;
+	unsigned int mins = ((unsigned int)(-1)) >> 1;
+	
+	//filter:0
+	sum = 0;
+	out = pEnc->row_buf + 1;
+	for (int i = 0; i < rowbytes; i++)
+	{
+		auto v = out[i] = row[i];
+		sum += (v < 128) ? v : 256 - v;
+	}
+	mins = sum;
 
-	for (int y = 0, y1 = image->Height; y < y1; y++)
+	//filter:1
+	sum = 0;
+	out = pEnc->sub_row + 1;
+	
+	for (int i = 0; i < bpp; i++)
 	{
-		unsigned char *row = (unsigned char *)image->Scan0 + y * image->Stride;
-		unsigned int sum;
-		unsigned char *best_row = pEnc->row_buf;
-		unsigned int mins = ((unsigned int)(-1)) >> 1;
-		
-		//filter:0
+		auto v = out[i] = row[i];
+		sum += (v < 128) ? v : 256 - v;
+	}
+	for (int i = bpp; i < rowbytes; i++)
+	{
+		auto v = out[i] = row[i] - row[i - bpp];
+		sum += (v < 128) ? v : 256 - v;
+		if (sum > mins) break;
+	}
+	if (sum < mins)
+	{
+		mins = sum;
+		best_row = pEnc->sub_row;
+	}
+	
+	if (prev)
+	{
+		//filter:2
 		sum = 0;
-		out = pEnc->row_buf + 1;
+		out = pEnc->up_row + 1;
 		for (int i = 0; i < rowbytes; i++)
 		{
-			auto v = out[i] = row[i];
+			auto v = out[i] = row[i] - prev[i];
 			sum += (v < 128) ? v : 256 - v;
+			if (sum > mins) break;
+		}
+		if (sum < mins)
+		{
+			mins = sum;
+			best_row = pEnc->up_row;
 		}
-		mins = sum;
 
-		//filter:1
+		//filter:3
 		sum = 0;
-		out = pEnc->sub_row + 1;
-		
+		out = pEnc->avg_row + 1;
 		for (int i = 0; i < bpp; i++)
 		{
-			auto v = out[i] = row[i];
+			auto v = out[i] = row[i] - prev[i] / 2;
 			sum += (v < 128) ? v : 256 - v;
 		}
 		for (int i = bpp; i < rowbytes; i++)
 		{
-			auto v = out[i] = row[i] - row[i - bpp];
+			auto v = out[i] = row[i] - (prev[i] + row[i - bpp]) / 2;
 			sum += (v < 128) ? v : 256 - v;
 			if (sum > mins) break;
 		}
 		if (sum < mins)
 		{
 			mins = sum;
-			best_row = pEnc->sub_row;
+			best_row = pEnc->avg_row;
 		}
-		
-		if (prev)
+
+		//filter:4
+		sum = 0;
+		out = pEnc->paeth_row + 1;
+		for (int i = 0; i < bpp; i++)
 		{
-			//filter:2
-			sum = 0;
-			out = pEnc->up_row + 1;
-			for (int i = 0; i < rowbytes; i++)
-			{
-				auto v = out[i] = row[i] - prev[i];
-				sum += (v < 128) ? v : 256 - v;
-				if (sum > mins) break;
-			}
-			if (sum < mins)
-			{
-				mins = sum;
-				best_row = pEnc->up_row;
-			}
+			auto v = out[i] = row[i] - prev[i];
+			sum += (v < 128) ? v : 256 - v;
+		}
+		for (int i = bpp; i < rowbytes; i++)
+		{
+			int a, b, c, pa, pb, pc, p;
+
+			a = row[i - bpp];
+			b = prev[i];
+			c = prev[i - bpp];
+			p = b - c;
+			pc = a - c;
+			pa = abs(p);
+			pb = abs(pc);
+			pc = abs(p + pc);
+			p = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+			auto v = out[i] = row[i] - p;
+			sum += (v < 128) ? v : 256 - v;
+			if (sum > mins) break;
+		}
+		if (sum < mins)
+		{
+			best_row = pEnc->paeth_row;
+		}
+	}
+	return best_row;
+}
+
+/* The fixed filter, or the candidate of the lowest entropy or, with a
+ * scorer, the lowest deflate cost. */
+static unsigned char *select_filter_scored(ApngEncoder *pEnc, DeflateScorer *scorer, const unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	unsigned char *rows[5] = { pEnc->row_buf, pEnc->sub_row, pEnc->up_row, pEnc->avg_row, pEnc->paeth_row };
+	if (pEnc->filterStrategy == (int)FilterStrategy::Fixed)
+	{
+		filter_row(pEnc->fixedFilter, row, prev, rows[pEnc->fixedFilter] + 1, rowbytes, bpp);
+		return rows[pEnc->fixedFilter];
+	}
+
+	unsigned char *best_row = NULL;
+	double best = 0;
+	for (int type = 0, types = prev ? 5 : 2; type < types; type++)
+	{
+		filter_row(type, row, prev, rows[type] + 1, rowbytes, bpp);
+		double score = scorer ? (double)scorer->Cost(rows[type], rowbytes + 1) : row_entropy(rows[type] + 1, rowbytes);
+		if (!best_row || score < best)
+		{
+			best = score;
+			best_row = rows[type];
+		}
+	}
+	return best_row;
+}
+
+/* A memoized row is only taken when its filter, applied to this row and the
+ * row above, gives the same bytes again, so a hash collision costs the
+ * filter search instead of writing wrong pixels. */
+static bool memo_matches(ApngEncoder *pEnc, const unsigned char *memo, const unsigned char *row, const unsigned char *prev, int rowbytes, int bpp)
+{
+	unsigned char *rows[5] = { pEnc->row_buf, pEnc->sub_row, pEnc->up_row, pEnc->avg_row, pEnc->paeth_row };
+	int type = memo[0];
+	if (type > 4)
+	{
+		return false;
+	}
+	filter_row(type, row, prev, rows[type] + 1, rowbytes, bpp);
+	return memcmp(rows[type] + 1, memo + 1, rowbytes) == 0;
+}
+
+/* Picks the filter of every row by pEnc->filterStrategy. Unless the memo is
+ * off, a row that hashes the same, along with the row above, as the last
+ * one filtered at its canvas position takes the memoized choice once
+ * memo_matches confirms it. The trial pass (dest == NULL) stops once the
+ * deadline expires, the final one only when cancelled; false when
+ * stopped. */
+bool process_rect(ApngEncoder *pEnc, BitmapData *image, unsigned char *dest)
+{
+	unsigned char *prev = NULL;
+	unsigned char *dp = dest;
+	int rowbytes = image->Width * image->bpp;
+	int bpp = image->bpp;
+	uint64_t prevHash = 0;
+	Deadline deadline = encode_deadline(pEnc);
+	FilterStrategy strategy = (FilterStrategy)pEnc->filterStrategy;
+	DeflateScorer *scorer = NULL; //pEnc->scorer once begun for this rect
+	int scored = 0; //rows fed to the scorer
+	bool memo = !pEnc->rowMemoOff;
+
+	for (int y = 0, y1 = image->Height; y < y1; y++)
+	{
+		if (dest == NULL ? deadline.Expired() : deadline.Cancelled())
+		{
+			return false;
+		}
 
-			//filter:3
-			sum = 0;
-			out = pEnc->avg_row + 1;
-			for (int i = 0; i < bpp; i++)
+		unsigned char *row = (unsigned char *)image->Scan0 + y * image->Stride;
+		uint64_t hash = memo ? RowMemo::Hash(row, rowbytes) : 0;
+		bool earlier = false;
+		unsigned char *best_row = memo ? pEnc->rowMemo->Find(pEnc->frameX, pEnc->frameY + y, bpp, rowbytes, hash, prevHash, prev == NULL, &earlier) : NULL;
+		if (best_row && !memo_matches(pEnc, best_row, row, prev, rowbytes, bpp))
+		{
+			best_row = NULL;
+		}
+		bool hit = best_row != NULL;
+		if (hit)
+		{
+			if (earlier)
 			{
-				auto v = out[i] = row[i] - prev[i] / 2;
-				sum += (v < 128) ? v : 256 - v;
+				pEnc->stats.reusedRows++;
 			}
-			for (int i = bpp; i < rowbytes; i++)
+		}
+		else if (strategy == FilterStrategy::MinSad)
+		{
+			best_row = select_filter(pEnc, row, prev, rowbytes, bpp);
+			if (memo)
 			{
-				auto v = out[i] = row[i] - (prev[i] + row[i - bpp]) / 2;
-				sum += (v < 128) ? v : 256 - v;
-				if (sum > mins) break;
+				pEnc->rowMemo->Store(pEnc->frameX, pEnc->frameY + y, bpp, rowbytes, hash, prevHash, prev == NULL, best_row);
 			}
-			if (sum < mins)
+		}
+		else
+		{
+			//started at the first row that needs it, catching up on the memoized ones
+			if (strategy == FilterStrategy::Deflate && !scorer)
 			{
-				mins = sum;
-				best_row = pEnc->avg_row;
+				if (!pEnc->scorer)
+				{
+					pEnc->scorer = new (std::nothrow) DeflateScorer();
+				}
+				if (pEnc->scorer && pEnc->scorer->Begin(rowbytes))
+				{
+					scorer = pEnc->scorer;
+				}
 			}
-
-			//filter:4
-			sum = 0;
-			out = pEnc->paeth_row + 1;
-			for (int i = 0; i < bpp; i++)
+			for (; scorer && scored < y; scored++)
 			{
-				auto v = out[i] = row[i] - prev[i];
-				sum += (v < 128) ? v : 256 - v;
+				scorer->Commit(pEnc->rowMemo->Row(pEnc->frameY + scored), rowbytes + 1);
 			}
-			for (int i = bpp; i < rowbytes; i++)
+			best_row = select_filter_scored(pEnc, scorer, row, prev, rowbytes, bpp);
+			if (scorer)
 			{
-				int a, b, c, pa, pb, pc, p;
-
-				a = row[i - bpp];
-				b = prev[i];
-				c = prev[i - bpp];
-				p = b - c;
-				pc = a - c;
-				pa = abs(p);
-				pb = abs(pc);
-				pc = abs(p + pc);
-				p = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
-				auto v = out[i] = row[i] - p;
-				sum += (v < 128) ? v : 256 - v;
-				if (sum > mins) break;
+				scorer->Commit(best_row, rowbytes + 1);
+				scored = y + 1;
 			}
-			if (sum < mins)
+			if (memo)
 			{
-				best_row = pEnc->paeth_row;
+				pEnc->rowMemo->Store(pEnc->frameX, pEnc->frameY + y, bpp, rowbytes, hash, prevHash, prev == NULL, best_row);
 			}
 		}
 
+		//the unfiltered stream, row_buf has it unless the row was memoized or the fixed filter is another
+		if (dest == NULL && (hit || (strategy == FilterStrategy::Fixed && pEnc->fixedFilter != 0)))
+		{
+			memcpy(pEnc->row_buf + 1, row, rowbytes);
+		}
+
 		if (dest == NULL)
 		{
 			// deflate_rect_op()
@@ -582,11 +1480,38 @@ void process_rect(ApngEncoder *pEnc, BitmapData *image, unsigned char *dest)
 		}
 
 		prev = row;
+		prevHash = hash;
 	}
+	return true;
 }
 
-void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter)
+/* Compares the unfiltered and the filtered rows on the two fast trial
+ * streams; estimate gets the smaller trial size. Out of time the trials are
+ * skipped and the rows are stored unfiltered, the cheapest final pass. */
+void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter, unsigned int *estimate)
 {
+	if (estimate)
+	{
+		*estimate = UINT_MAX;
+	}
+	pEnc->speculated = false;
+	if (encode_deadline(pEnc).Expired())
+	{
+		pEnc->degraded = true;
+		*filter = false;
+		return;
+	}
+	if (pEnc->filterStrategy != (int)FilterStrategy::MinSad && !estimate)
+	{
+		//the per-row choice stands in for the trials
+		*filter = pEnc->filterStrategy != (int)FilterStrategy::Fixed || pEnc->fixedFilter != 0;
+		return;
+	}
+	if (parallel_trials(pEnc, image, filter, estimate))
+	{
+		return;
+	}
+
 	pEnc->op_zstream1.data_type = Z_BINARY;
 	pEnc->op_zstream1.next_out = pEnc->zbuf;
 	pEnc->op_zstream1.avail_out = pEnc->zbuf_size;
@@ -595,12 +1520,23 @@ void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter)
 	pEnc->op_zstream2.next_out = pEnc->zbuf;
 	pEnc->op_zstream2.avail_out = pEnc->zbuf_size;
 
-	process_rect(pEnc, image, NULL);
+	bool complete = process_rect(pEnc, image, NULL);
+	if (complete)
+	{
+		deflate(&pEnc->op_zstream1, Z_FINISH);
+		deflate(&pEnc->op_zstream2, Z_FINISH);
+	}
+	else
+	{
+		pEnc->degraded = true;
+	}
 
-	deflate(&pEnc->op_zstream1, Z_FINISH);
-	deflate(&pEnc->op_zstream2, Z_FINISH);
+	if (complete && estimate)
+	{
+		*estimate = (unsigned int)min(pEnc->op_zstream1.total_out, pEnc->op_zstream2.total_out);
+	}
 
-	if (pEnc->op_zstream1.total_out < pEnc->op_zstream2.total_out)
+	if (!complete || pEnc->op_zstream1.total_out < pEnc->op_zstream2.total_out)
 	{
 		*filter = false;
 	}
@@ -613,7 +1549,27 @@ void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter)
 	deflateReset(&pEnc->op_zstream2);
 }
 
-void deflate_rect_fin(ApngEncoder *pEnc, BitmapData *image, bool filter, unsigned int *zsize)
+ApngError deflate_rect_fin(ApngEncoder *pEnc, BitmapData *image, bool filter, unsigned int *zsize)
+{
+	//started with the parallel trials
+	if (pEnc->speculated)
+	{
+		pEnc->speculated = false;
+		*zsize = pEnc->speculatedSize;
+		return ApngError::Success;
+	}
+
+	ApngError err = filter_rows(pEnc, image, filter);
+	if (err != ApngError::Success)
+	{
+		return err;
+	}
+	return deflate_rows(pEnc, pEnc->dest, image->Height * (image->bpp * image->Width + 1), Z_BEST_COMPRESSION, 8, filter ? Z_FILTERED : Z_DEFAULT_STRATEGY, zsize);
+}
+
+/* the filtered rows, type byte first, into pEnc->dest; filter = false
+ * stores every row unfiltered */
+ApngError filter_rows(ApngEncoder *pEnc, BitmapData *image, bool filter)
 {
 	int rowbytes = image->bpp * image->Width;
 	if (!filter)
@@ -628,24 +1584,55 @@ void deflate_rect_fin(ApngEncoder *pEnc, BitmapData *image, bool filter, unsigne
 			dp += rowbytes;
 		}
 	}
-	else
+	else if (!process_rect(pEnc, image, pEnc->dest))
 	{
-		process_rect(pEnc, image, pEnc->dest);
+		return ApngError::Cancelled;
 	}
+	return ApngError::Success;
+}
 
+/* Compresses the first length bytes of source into pEnc->zbuf, fed in
+ * blocks so the deadline is polled between them. Out of time the rest of
+ * the stream drops to the fastest level. */
+ApngError deflate_rows(ApngEncoder *pEnc, unsigned char *source, unsigned int length, int level, int memLevel, int strategy, unsigned int *zsize)
+{
+	const unsigned int block = 64 * 1024;
+	Deadline deadline = encode_deadline(pEnc);
 	z_stream fin_zstream;
 
+	if (level > Z_BEST_SPEED && deadline.Expired())
+	{
+		level = Z_BEST_SPEED;
+		pEnc->degraded = true;
+	}
+
 	fin_zstream.data_type = Z_BINARY;
-	fin_zstream.zalloc = Z_NULL;
-	fin_zstream.zfree = Z_NULL;
-	fin_zstream.opaque = Z_NULL;
-	deflateInit2(&fin_zstream, Z_BEST_COMPRESSION, 8, 15, 8, filter ? Z_FILTERED : Z_DEFAULT_STRATEGY);
+	fin_zstream.zalloc = FrameArena::ZAlloc;
+	fin_zstream.zfree = FrameArena::ZFree;
+	fin_zstream.opaque = pEnc->arena;
+	deflateInit2(&fin_zstream, level, 8, 15, memLevel, strategy);
 
 	fin_zstream.next_out = pEnc->zbuf;
 	fin_zstream.avail_out = pEnc->zbuf_size;
-	fin_zstream.next_in = pEnc->dest;
-	fin_zstream.avail_in = image->Height * (rowbytes + 1);
+	fin_zstream.next_in = source;
+	for (unsigned int offset = 0; offset < length; offset += block)
+	{
+		if (deadline.Cancelled())
+		{
+			deflateEnd(&fin_zstream);
+			return ApngError::Cancelled;
+		}
+		if (level > Z_BEST_SPEED && deadline.Expired())
+		{
+			level = Z_BEST_SPEED;
+			pEnc->degraded = true;
+			deflateParams(&fin_zstream, level, strategy);
+		}
+		fin_zstream.avail_in = length - offset < block ? length - offset : block;
+		deflate(&fin_zstream, Z_NO_FLUSH);
+	}
 	deflate(&fin_zstream, Z_FINISH);
 	*zsize = (unsigned int)fin_zstream.total_out;
 	deflateEnd(&fin_zstream);
+	return ApngError::Success;
 }
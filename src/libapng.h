@@ -3,10 +3,54 @@
 #include <stdio.h>
 #include <zlib.h>
 
+#ifdef _WIN32
 #define APNG_API(ret) extern "C" __declspec(dllexport) ret __stdcall
+#else
+#define APNG_API(ret) extern "C" __attribute__((visibility("default"))) ret
+#endif
 
+#ifdef _MSC_VER
 #pragma comment (lib, "zlib.lib")
 #pragma comment (lib, "libpng16.lib")
+#endif
+
+class GlobalPalette;
+class FrameCapture;
+class FrameIndex;
+class EncodeBudget;
+class RowMemo;
+class FrameArena;
+class DeflateScorer;
+class DirtyRegions;
+struct EditSource;
+struct AppendTarget;
+class CaptureRing;
+
+enum struct ApngError : int {
+	Success = 0,
+	ContextCreateFailed = 1,
+	FileError = 2,
+	ArgumentError = 3,
+	MemoryError = 4,
+	FormatError = 5,
+	Cancelled = 6,
+};
+
+struct ApngStats {
+	int frames;
+	int remappedFrames; //optimized frames that reused the last palette
+	long long bytes; //file size, set by apng_write_end
+	long long encodedPixels; //area of the frame rects written
+	long long streamingPixels; //the same with the rects each frame gets on its own
+	int degradedFrames; //frames that skipped work after running out of time
+	int losslessFrames; //optimize frames the auto mode kept lossless
+	long long reusedRows; //rows that took their filter from an earlier frame
+	double psnr; //near-lossless mode, of the rgba frames against the source; 0 when nothing changed
+	long long arenaReused; //frame buffer bytes served from memory the encoders already held
+	long long arenaAllocated; //bytes the encoders allocated for frame buffers
+	int subFrames; //zero-delay frames written for the separate regions of a frame, not in frames
+	int droppedFrames; //capture ring frames dropped or merged into the one before when the ring was full
+};
 
 struct ApngEncoder {
 	FILE* hFile;
@@ -17,12 +61,52 @@ struct ApngEncoder {
 	int frameCount;
 	int seqIndex;
 	int acTLPos;
+	ApngError deferredError;
+	ApngStats stats;
+	long long frameEnd; //deadline of the frame being encoded, 0 for none
+	int frameX; //canvas position of the rect being encoded
+	int frameY;
+
+	//options
+	int quantizeEffort;
+	int reuseMeanError;
+	int reuseMaxError;
+	GlobalPalette *palette;
+	int bitDepth; //of the indexed output, below 8 when the shared palette is small
+	FrameCapture *capture; //deferred mode
+	bool capturePalette;
+	EncodeBudget *budget; //shared with the deferred-mode workers
+	double autoPsnr; //auto mode, 0 = off
+	int parallelTrials; //0 = off, 1 = trial streams on threads, 2 = also a speculative final pass
+	int filterStrategy; //FilterStrategy
+	int fixedFilter; //filter type of FilterStrategy::Fixed
+	int nearLosslessError; //0 = off
+	int nearLosslessDither;
+	bool rowMemoOff; //apng_set_row_memo(false): every row runs the filter search
+	DirtyRegions *regions; //sub-frame mode, NULL = off
+	EditSource *appendTo; //apng_open_append: the file the frames continue, written out before the first of them
+	AppendTarget *appendTarget; //apng_open_append: hFile is a temp file, renamed over the original by apng_write_end
+	CaptureRing *ring; //apng_ring_init: frames are encoded on the ring's thread
 
 	//temp
 	z_stream op_zstream1;
 	z_stream op_zstream2;
 	unsigned int idat_size;
 	unsigned int zbuf_size;
+	unsigned int bufferRowbytes; //frame size the row and stream buffers hold
+	unsigned int bufferHeight;
+	unsigned int *reusePalette;
+	int reusePaletteSize;
+	bool degraded; //the current frame skipped work
+	ApngEncoder *autoWorker; //trial streams for the lossless side of the auto mode
+	RowMemo *rowMemo;
+	DeflateScorer *scorer; //FilterStrategy::Deflate, kept from the first rect that needs it
+	FrameArena *arena; //buffers of the frame being encoded, reset per frame
+	bool lastFilter; //filter choice of the previous frame, the speculation guess
+	bool speculated; //zbuf already holds the final stream of the current frame
+	unsigned int speculatedSize;
+	unsigned long long nearSquaredError; //near-lossless mode, summed over the color samples
+	unsigned long long nearSamples;
 
 	unsigned char *zbuf;
 	unsigned char *dest;
@@ -31,17 +115,174 @@ struct ApngEncoder {
 	unsigned char *up_row;
 	unsigned char *avg_row;
 	unsigned char *paeth_row;
+	unsigned char *trial_rows; //parallel trials: the unfiltered rows
+	unsigned char *trial_zbuf; //parallel trials: output of both trial streams
 };
 
-enum struct ApngError : int {
-	Success = 0,
-	ContextCreateFailed = 1,
-	FileError = 2,
-	ArgumentError = 3,
-	MemoryError = 4,
+struct ApngFrameInfo {
+	int x;
+	int y;
+	int width;
+	int height;
+	int delay_ms;
+	unsigned char dispose; //PNG_DISPOSE_OP_*
+	unsigned char blend; //PNG_BLEND_OP_*
+};
+
+struct ApngDecoder {
+	int width;
+	int height;
+	int frameCount;
+	int numPlays; //0 = forever
+
+	//context
+	int current; //frame composited on the canvas, -1 for none
+	FrameIndex *index;
+
+	//temp
+	z_stream zstream;
+	unsigned char *canvas;
+	unsigned char *previous; //canvas under the current frame rect, for dispose previous
+	unsigned char *row_buf;
+	unsigned char *prev_row;
+	unsigned char *pixel_row;
 };
 
 APNG_API(ApngError) apng_init(wchar_t *fileName, int width, int height, ApngEncoder **ppEnc);
 APNG_API(ApngError) apng_append_frame(ApngEncoder *pEnc, void* pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize);
 APNG_API(void) apng_write_end(ApngEncoder *pEnc);
 APNG_API(void) apng_destroy(ApngEncoder **ppEnc);
+/* Starts a new file on an existing encoder, after apng_write_end or in place
+ * of it. The options stay, except a shared palette and deferred mode, which
+ * are set again; buffers and trial streams are kept when the new canvas
+ * fits in them. */
+APNG_API(ApngError) apng_reset(ApngEncoder *pEnc, wchar_t *fileName, int width, int height);
+/* An encoder from a process-wide pool of idle ones, reset to fileName and
+ * the canvas size with the options apng_init sets; apng_init when the pool
+ * is empty. Safe to call from any thread. */
+APNG_API(ApngError) apng_acquire(wchar_t *fileName, int width, int height, ApngEncoder **ppEnc);
+/* closes the file and returns the encoder to the pool, or destroys it when
+ * the pool is full; call apng_write_end first to finish the file */
+APNG_API(void) apng_release(ApngEncoder **ppEnc);
+/* effort: 0 = auto, 1 = fast (17^4 histogram), 2 = best (33^4 histogram) */
+APNG_API(ApngError) apng_set_quantize_effort(ApngEncoder *pEnc, int effort);
+/* adds a frame to the shared palette; call for every frame before the first
+ * apng_append_frame, the animation is then written as one indexed PLTE image */
+APNG_API(ApngError) apng_add_palette_frame(ApngEncoder *pEnc, void* pData, int width, int height, int stride);
+/* optimize mode maps a frame onto the last quantized palette and only runs
+ * the full quantizer when the rms or the largest per-pixel rgba error (in
+ * 8-bit levels) passes the limit; meanError 0 turns reuse off, maxError 0
+ * leaves the per-pixel error unbounded */
+APNG_API(ApngError) apng_set_palette_reuse(ApngEncoder *pEnc, int meanError, int maxError);
+/* mode: 0 = encode each frame in apng_append_frame, 1 = keep the frames in
+ * memory and encode them together in apng_write_end, choosing the frame
+ * rects and dispose ops jointly, 2 = like 1 with the frames spilled to a
+ * mapped temp file. globalPalette builds one PLTE from all kept frames.
+ * Call before the first frame; ArgumentError with sub-frames on. */
+APNG_API(ApngError) apng_set_deferred(ApngEncoder *pEnc, int mode, bool globalPalette);
+/* returns the error of a failed deferred encode, the stats are still filled */
+APNG_API(ApngError) apng_get_stats(ApngEncoder *pEnc, ApngStats *pStats);
+/* Limits the time spent per frame and, counted from this call, on the whole
+ * animation; 0 turns a limit off. A frame out of time skips quantization and
+ * the filter trials, or finishes its deflate at the fastest level, so the
+ * file stays complete. */
+APNG_API(ApngError) apng_set_time_budget(ApngEncoder *pEnc, int frameMs, int totalMs);
+/* may be called from any thread: the frame being encoded stops and it and
+ * every later apng_append_frame return Cancelled. apng_write_end still
+ * finishes a file with the frames written so far, except in deferred mode. */
+APNG_API(ApngError) apng_cancel(ApngEncoder *pEnc);
+/* Auto mode: a frame appended with optimize is only quantized when that is
+ * smaller and the quantized frame keeps at least minPsnr dB against the
+ * source. Frames with at most 256 colors stay lossless without quantizing,
+ * other ones quantize while the lossless trials run and the smaller trial
+ * size decides. 0 turns it off. */
+APNG_API(ApngError) apng_set_auto_optimize(ApngEncoder *pEnc, double minPsnr);
+/* mode: 0 = off, 1 = the two trial deflates of a frame run on their own
+ * threads, 2 = like 1 with the final pass for the filter choice of the
+ * previous frame started alongside them and kept when the trials agree.
+ * The output does not change. Needs OpenMP, call before the first frame. */
+APNG_API(ApngError) apng_set_parallel_trials(ApngEncoder *pEnc, int mode);
+/* how each row's filter is picked: 0 = smallest sum of absolute values,
+ * checked against no filtering with two fast trial deflates of the frame
+ * (default), 1 = filter type fixedFilter (0-4) for every row, 2 = smallest
+ * entropy of the filtered bytes, 3 = fewest bytes added to a deflate stream
+ * of the rows so far. 1-3 skip the trial deflates. Call before the first
+ * frame. */
+APNG_API(ApngError) apng_set_filter_strategy(ApngEncoder *pEnc, int strategy, int fixedFilter);
+/* The row memo (on by default) gives a row that is unchanged from the last
+ * frame, along with the row above, the filter chosen for it then, and lets
+ * the final pass of a frame reuse the choices of its trial pass. Off, every
+ * row runs the filter search, which saves the hash of each row when few
+ * rows repeat. The output is the same, except with filter strategy 3,
+ * whose choice depends on the rows before. Call before the first frame. */
+APNG_API(ApngError) apng_set_row_memo(ApngEncoder *pEnc, bool enabled);
+/* Near-lossless mode: frames written as rgba, with or without optimize,
+ * get their color channels rounded to multiples of the largest power of two
+ * that keeps every change within maxError (1-127, 0 = off) before
+ * filtering; alpha stays exact. dither: 0 = round to nearest, 1 = ordered
+ * 4x4, 2 = error diffusion. apng_get_stats reports the PSNR. */
+APNG_API(ApngError) apng_set_near_lossless(ApngEncoder *pEnc, int maxError, int dither);
+/* Sub-frame mode: a frame whose opaque pixels form regions far apart is
+ * written as up to maxRegions rects (0 or 1 = off), all but the last as
+ * frames of delay 0 that stay on the canvas, so the pixels between them are
+ * not encoded. Regions are merged while that adds fewer transparent pixels
+ * than another frame costs. Frames after the first must cover the canvas.
+ * Streaming mode only, ArgumentError in deferred mode; call before the
+ * first frame. */
+APNG_API(ApngError) apng_set_sub_frames(ApngEncoder *pEnc, int maxRegions);
+/* Capture ring: slots canvas-sized frame buffers (at least 2), encoded in
+ * commit order by a thread of the encoder, so a capture thread only copies
+ * or writes a frame. policy, for when every slot waits to be encoded:
+ * 0 = block until one is free, 1 = drop the oldest waiting frame and add
+ * its delay to the next one, 2 = leave the new frame out and add its delay
+ * to the one before. Nothing is allocated after this call. Until
+ * apng_write_end, which encodes the frames still waiting, the setters and
+ * apng_append_frame return ArgumentError and apng_get_stats returns a copy
+ * taken after the last frame encoded; apng_destroy drops the waiting
+ * frames. Call before the first frame; ArgumentError in deferred mode and
+ * on an encoder from apng_open_append. */
+APNG_API(ApngError) apng_ring_init(ApngEncoder *pEnc, int slots, int policy);
+/* zero-copy: a slot to write the next canvas into, width * 4 bytes per row
+ * at *pStride, then apng_ring_commit to queue it */
+APNG_API(ApngError) apng_ring_acquire(ApngEncoder *pEnc, void **ppData, int *pStride);
+APNG_API(ApngError) apng_ring_commit(ApngEncoder *pEnc, int delay_ms, bool optimize);
+/* copies a canvas-sized frame into a slot and queues it; returns the error
+ * of an earlier frame the ring failed to encode */
+APNG_API(ApngError) apng_ring_push(ApngEncoder *pEnc, void *pData, int stride, int delay_ms, bool optimize);
+/* rewrites an existing png/apng with every image stream filtered and
+ * deflated again, frames in parallel; pixels, timing and all other chunks
+ * are kept. pStats may be NULL, frames, bytes and the arena counters are filled. */
+APNG_API(ApngError) apng_recompress(wchar_t *srcFileName, wchar_t *dstFileName, ApngStats *pStats);
+/* Chunk-level editing of existing apng files, without decoding: frames are
+ * copied with their compressed data and only the sequence numbers, the
+ * frame count and the CRCs are written again. A kept frame that was drawn
+ * over pixels of a frame that is cut out gives FormatError. dstFileName may
+ * be the source. */
+//keeps count frames from first
+APNG_API(ApngError) apng_trim(wchar_t *srcFileName, wchar_t *dstFileName, int first, int count);
+//removes count frames from first
+APNG_API(ApngError) apng_drop_frames(wchar_t *srcFileName, wchar_t *dstFileName, int first, int count);
+/* the frames of all files in turn; they must have the same IHDR, PLTE and
+ * tRNS, the other chunks come from the first file */
+APNG_API(ApngError) apng_concat(wchar_t **srcFileNames, int fileCount, wchar_t *dstFileName);
+/* An encoder whose frames continue an 8-bit rgba apng file, like the ones
+ * apng_init writes without a shared palette. The frames of the file and
+ * the new ones go to a temp file next to it, named apart from those of
+ * other appends to the file, which apng_write_end renames
+ * over the file once it is complete; until then, or when the encoder is
+ * destroyed without it, the file stays as it was. Frames may be cropped
+ * rects from the first one; a shared palette and deferred mode are not
+ * available. FormatError for other files, or when the last frame leaves
+ * pixels of earlier frames on the canvas. */
+APNG_API(ApngError) apng_open_append(wchar_t *fileName, ApngEncoder **ppEnc);
+/* opens a png/apng file for decoding. Frames come out as composited canvases
+ * in the bgra layout apng_append_frame takes. A copy of the canvas is kept
+ * every keyframeInterval frames as they are decoded (<= 0 picks 16), so a
+ * seek only decodes from the nearest one. Interlaced files are rejected. */
+APNG_API(ApngError) apng_decode_init(wchar_t *fileName, int keyframeInterval, ApngDecoder **ppDec);
+APNG_API(ApngError) apng_decode_frame_info(ApngDecoder *pDec, int frame, ApngFrameInfo *pInfo);
+/* writes the canvas after frame has been drawn, width * height pixels */
+APNG_API(ApngError) apng_decode_frame(ApngDecoder *pDec, int frame, void *pData, int stride);
+/* decodes every frame once to fill all keyframes up front */
+APNG_API(ApngError) apng_decode_index(ApngDecoder *pDec);
+APNG_API(void) apng_decode_destroy(ApngDecoder **ppDec);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <png.h>
+#include "libapng.h"
+#include "WuQuantizer.h"
+#include "ApngDeferred.h"
+#include "EncodeBudget.h"
+#include "RowMemo.h"
+#include "FilterStrategy.h"
+#include "FrameArena.h"
+#include "DirtyRegions.h"
+
+#ifndef PNG_APNG_SUPPORTED
+/* stock libpng without the apng patch */
+#define PNG_DISPOSE_OP_NONE 0x00
+#define PNG_DISPOSE_OP_BACKGROUND 0x01
+#define PNG_DISPOSE_OP_PREVIOUS 0x02
+#define PNG_BLEND_OP_SOURCE 0x00
+#define PNG_BLEND_OP_OVER 0x01
+#endif
+
+//sse2 kernels, the scalar code is the fallback
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define APNG_SSE2
+#endif
+
+struct RECT {
+	int x, y, width, height;
+};
+
+#pragma region Function Declarations
+
+FILE *open_file(const wchar_t *fileName, const char *mode);
+#ifndef _WIN32
+char *utf8_path(const wchar_t *fileName);
+#endif
+void init_streams(ApngEncoder *pEnc);
+ApngError alloc_buffers(ApngEncoder *pEnc);
+ApngError alloc_buffers(ApngEncoder *pEnc, unsigned int rowbytes, unsigned int height);
+void free_buffers(ApngEncoder *pEnc);
+size_t arena_bytes(const ApngEncoder *pEnc, bool optimize);
+void reset_options(ApngEncoder *pEnc);
+ApngError write_header(ApngEncoder *pEnc);
+ApngError encode_frame(ApngEncoder *pEnc, BitmapData *bmpData, int x, int y, bool optimize, unsigned int *zsize);
+ApngError copy_image(ApngEncoder *pEnc, BitmapData *image);
+ApngError near_lossless(ApngEncoder *pEnc, BitmapData *image);
+void swap_red_blue(BitmapData *image);
+ApngError auto_optimize(ApngEncoder *pEnc, BitmapData *image, bool *filter);
+void destroy_auto_worker(ApngEncoder *pEnc);
+ApngError write_appended(ApngEncoder *pEnc);
+void destroy_append_source(ApngEncoder *pEnc);
+ApngError finish_append(ApngEncoder *pEnc);
+void destroy_append_target(ApngEncoder *pEnc);
+ApngError append_frame(ApngEncoder *pEnc, void* pData, int x, int y, int width, int height, int stride, int delay_ms, bool optimize);
+void destroy_ring(ApngEncoder *pEnc);
+void collect_stats(ApngEncoder *pEnc, ApngStats *pStats);
+void write_frame(ApngEncoder *pEnc, int x, int y, int width, int height, int delay_ms, unsigned char dispose, unsigned char *data, unsigned int zsize);
+void write_chunk(ApngEncoder *enc, const char *name, unsigned char *data, unsigned int length);
+void write_IDATs(ApngEncoder *enc, unsigned char *data, unsigned int length, unsigned int idat_size);
+void get_rect(const BitmapData *bmpData, RECT *rect);
+bool process_rect(ApngEncoder *pEnc, BitmapData *image, unsigned char *dest);
+ApngError OptimizeImage(ApngEncoder *pEnc, BitmapData *bmpData, bool *quantized);
+ApngError MapToPalette(ApngEncoder *pEnc, BitmapData *bmpData);
+void pack_indices(BitmapData *image, int depth);
+void write_palette(ApngEncoder *enc, const Pixel *palette, int colorCount);
+void deflate_rect_op(ApngEncoder *pEnc, BitmapData *image, bool *filter, unsigned int *estimate = NULL);
+ApngError deflate_rect_fin(ApngEncoder *pEnc, BitmapData *image, bool filter, unsigned int *zsize);
+ApngError filter_rows(ApngEncoder *pEnc, BitmapData *image, bool filter);
+bool parallel_trials(ApngEncoder *pEnc, BitmapData *image, bool *filter, unsigned int *estimate);
+ApngError deflate_rows(ApngEncoder *pEnc, unsigned char *source, unsigned int length, int level, int memLevel, int strategy, unsigned int *zsize);
+Deadline encode_deadline(const ApngEncoder *pEnc);
+#pragma endregion
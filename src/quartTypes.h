@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 #include <memory>
 
@@ -31,35 +32,99 @@ struct Box
 	int32_t Size;
 };
 
-template<int dataGranularity>
+struct Pixel
+{
+	Pixel() : Blue(0), Green(0), Red(0), Alpha(0)
+	{
+	}
+
+	Pixel(uint8_t alpha, uint8_t red, uint8_t green, uint8_t blue)
+	{
+		Alpha = alpha;
+		Red = red;
+		Green = green;
+		Blue = blue;
+	}
+
+	uint8_t Blue;
+	uint8_t Green;
+	uint8_t Red;
+	uint8_t Alpha;
+};
+
+struct PixelIndex
+{
+	PixelIndex() : Value(0) {
+
+	}
+
+	PixelIndex(uint8_t alpha, uint8_t red, uint8_t green, uint8_t blue)
+		: PixelValue(Pixel(alpha, red, green, blue))
+	{
+	}
+
+	PixelIndex(uint32_t packValue) : Value(packValue) {
+	}
+	union {
+		uint32_t Value;
+		Pixel PixelValue;
+	};
+};
+
+/* Histogram and moment cubes with dataGranularity levels per channel plus
+ * the zero border the prefix sums need. TValue holds the weights and the
+ * first-order moments; callers pick int32_t when 255 * pixel count fits.
+ * The second-order moments are always 64-bit. */
+template<int dataGranularity, typename TValue = int64_t>
 class ColorData
 {
 public:
-	ColorData()
+	static const int Granularity = dataGranularity;
+	static const int SideSize = dataGranularity + 1;
+	typedef TValue ValueType;
+
+	/* storage, when given, is Bytes() long, 8-byte aligned and outlives the
+	 * cubes; otherwise they are allocated here */
+	explicit ColorData(void *storage = NULL) : owned(storage == NULL)
 	{
-		Weights = new int64_t[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		MomentsAlpha = new int64_t[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		MomentsRed = new int64_t[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		MomentsGreen = new int64_t[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		MomentsBlue = new int64_t[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		Moments = new float[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-		QuantizedPixels = vector<PixelIndex>();
-		Pixels = vector<Pixel>();
+		const size_t cells = (size_t)SideSize * SideSize * SideSize * SideSize;
+		if (owned)
+		{
+			Weights = new TValue[SideSize][SideSize][SideSize][SideSize];
+			MomentsAlpha = new TValue[SideSize][SideSize][SideSize][SideSize];
+			MomentsRed = new TValue[SideSize][SideSize][SideSize][SideSize];
+			MomentsGreen = new TValue[SideSize][SideSize][SideSize][SideSize];
+			MomentsBlue = new TValue[SideSize][SideSize][SideSize][SideSize];
+			Moments = new int64_t[SideSize][SideSize][SideSize][SideSize];
+		}
+		else
+		{
+			//the 64-bit cube first keeps every cube aligned
+			typedef TValue(*Cube)[SideSize][SideSize][SideSize];
+			unsigned char *p = (unsigned char *)storage;
+			Moments = (int64_t(*)[SideSize][SideSize][SideSize])p;
+			p += sizeof(int64_t) * cells;
+			Weights = (Cube)p;
+			MomentsAlpha = (Cube)(p + sizeof(TValue) * cells);
+			MomentsRed = (Cube)(p + 2 * sizeof(TValue) * cells);
+			MomentsGreen = (Cube)(p + 3 * sizeof(TValue) * cells);
+			MomentsBlue = (Cube)(p + 4 * sizeof(TValue) * cells);
+		}
 
 #pragma omp parallel sections
 		{
 #pragma omp section
-			{memset(Weights, 0, sizeof(int64_t)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(Weights, 0, sizeof(TValue) * cells); }
 #pragma omp section
-			{memset(MomentsAlpha, 0, sizeof(int64_t)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(MomentsAlpha, 0, sizeof(TValue) * cells); }
 #pragma omp section
-			{memset(MomentsRed, 0, sizeof(int64_t)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(MomentsRed, 0, sizeof(TValue) * cells); }
 #pragma omp section
-			{memset(MomentsGreen, 0, sizeof(int64_t)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(MomentsGreen, 0, sizeof(TValue) * cells); }
 #pragma omp section
-			{memset(MomentsBlue, 0, sizeof(int64_t)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(MomentsBlue, 0, sizeof(TValue) * cells); }
 #pragma omp section
-			{memset(Moments, 0, sizeof(float)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)*(dataGranularity + 1)); }
+			{memset(Moments, 0, sizeof(int64_t) * cells); }
 		}
 	}
 
@@ -70,8 +135,7 @@ public:
 		MomentsGreen(move(other.MomentsGreen)),
 		MomentsBlue(move(other.MomentsBlue)),
 		Moments(move(other.Moments)),
-		QuantizedPixels(move(other.QuantizedPixels)),
-		Pixels(move(other.Pixels))
+		owned(other.owned)
 	{
 		other.Weights = NULL;
 		other.MomentsAlpha = NULL;
@@ -81,16 +145,20 @@ public:
 		other.Moments = NULL;
 	}
 
-	int64_t (*Weights)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	int64_t(*MomentsAlpha)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	int64_t(*MomentsRed)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	int64_t(*MomentsGreen)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	int64_t(*MomentsBlue)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	float(*Moments)[dataGranularity + 1][dataGranularity + 1][dataGranularity + 1];
-	vector<PixelIndex> QuantizedPixels;
-	vector<Pixel> Pixels;
+	static size_t Bytes()
+	{
+		return (size_t)SideSize * SideSize * SideSize * SideSize * (5 * sizeof(TValue) + sizeof(int64_t));
+	}
+
+	TValue(*Weights)[SideSize][SideSize][SideSize];
+	TValue(*MomentsAlpha)[SideSize][SideSize][SideSize];
+	TValue(*MomentsRed)[SideSize][SideSize][SideSize];
+	TValue(*MomentsGreen)[SideSize][SideSize][SideSize];
+	TValue(*MomentsBlue)[SideSize][SideSize][SideSize];
+	int64_t(*Moments)[SideSize][SideSize][SideSize];
 
 	~ColorData() {
+		if (!owned) return;
 		delete[] Weights;
 		delete[] MomentsAlpha;
 		delete[] MomentsRed;
@@ -98,6 +166,9 @@ public:
 		delete[] MomentsBlue;
 		delete[] Moments;
 	}
+
+private:
+	bool owned;
 };
 
 struct CubeCut
@@ -120,88 +191,18 @@ struct Lookup
 	uint32_t Blue;
 };
 
-template<int granularity>
-class LookupData
-{
-public:
-	LookupData()
-	{
-		Lookups = vector<Lookup>();
-		Tags = new PixelIndex[granularity][granularity][granularity][granularity];
-
-		memset(Tags, 0, sizeof(PixelIndex)*granularity*granularity*granularity*granularity);
-	}
-
-	LookupData(LookupData &&other) :
-		Lookups(move(other.Lookups)),
-		Tags(move(other.Tags))
-	{
-		other.Tags = NULL;
-	}
-
-	vector<Lookup> Lookups;
-	PixelIndex (*Tags)[granularity][granularity][granularity];
-
-	~LookupData() {
-		delete[] Tags;
-	}
-};
-
-struct Pixel
-{
-	Pixel(uint8_t alpha, uint8_t red, uint8_t green, uint8_t blue)
-	{
-		Alpha = alpha;
-		Red = red;
-		Green = green;
-		Blue = blue;
-	}
-
-	uint8_t Blue;
-	uint8_t Green;
-	uint8_t Red;
-	uint8_t Alpha;
-};
-
-struct PixelIndex
-{
-	PixelIndex() : Value(0) {
-
-	}
-
-	PixelIndex(uint8_t alpha, uint8_t red, uint8_t green, uint8_t blue)
-		: PixelValue(Pixel(alpha, red, green, blue))
-	{
-	}
-
-	PixelIndex(uint32_t packValue) : Value(packValue) {
-	}
-	union {
-		uint32_t Value;
-		Pixel PixelValue;
-	};
-};
-
 class QuantizedPalette
 {
 public:
-	QuantizedPalette(int size)
+	QuantizedPalette()
 	{
 		Colors = vector<Pixel>();
-		PixelIndex = new int[size] {0};
 	}
 
 	QuantizedPalette(QuantizedPalette &&other)
-		: Colors(move(other.Colors)),
-		PixelIndex(move(other.PixelIndex))
+		: Colors(move(other.Colors))
 	{
-		other.PixelIndex = NULL;
 	}
 
 	vector<Pixel> Colors;
-	int* PixelIndex;
-
-	~QuantizedPalette() {
-		delete[] PixelIndex;
-	}
 };
\ No newline at end of file